@@ -54,13 +54,94 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 #include "module.h"
+#include "json_writer.h"
+#include "timer_wheel.h"
 
 #define HTTP_BUFFER_LEN (64 * 1024)
 #define HTTP_RESPONSE_TYPE_LEN (1024)
 #define HTTP_POST_URL_LEN_MAX (1024)
 #define MODULE_LOG_LEVEL_0VERRIDE 0
 
+#define CHATBOT_ENDPOINTS_MAX 32
+#define CHATBOT_DEFAULT_MAX_FAILS 3
+#define CHATBOT_DEFAULT_FAIL_TIMEOUT 30 //seconds
+#define CHATBOT_EWMA_WEIGHT 0.2 //weight of the latest sample in the latency average
+
+#define CHATBOT_DEFAULT_TYPING_TEXT "typing"
+#define CHATBOT_DEFAULT_COALESCE_MAX (4 * 1024) //bytes
+#define CHATBOT_TIMER_TICK_USEC (10 * 1000)
+#define CHATBOT_DEFAULT_CACHE_TTL 300 //seconds
+#define CHATBOT_DEFAULT_CACHE_SIZE (1024 * 1024) //bytes
+#define CHATBOT_CACHE_ENTRY_OVERHEAD 128 //approximate bookkeeping bytes per entry
+
+#define CHATBOT_ENDPOINT_FAIL 0
+#define CHATBOT_ENDPOINT_OK 1
+#define CHATBOT_ENDPOINT_CANCEL 2 //request was never sent, health is not updated
+
+/**
+ * Chatbot backend endpoint
+ * Multiple endpoints can be configured, requests are spread across them 
+ * based on the number of requests in-flight and the observed latency
+ */
+typedef struct chatbot_endpoint_s {
+	char* url;
+	char* post_url; // <url>/projects/<project>/agent/sessions
+	mesibo_uint_t weight;
+
+	mesibo_int_t inflight;
+	double ewma_latency; //usec, 0 until the first response
+	mesibo_uint_t fails; //consecutive failures
+	mesibo_int_t ejected_until; //usec timestamp, 0 if the endpoint is healthy
+} chatbot_endpoint_t;
+
+/**
+ * Messages from a user which are waiting to be sent to the chatbot as a single query
+ */
+typedef struct chatbot_batch_s {
+	mesibo_module_t* mod;
+	std::string key; // <from>\0<to>
+	std::string from;
+	std::string to;
+	mesibo_message_params_t params; //Parameters of the latest message, the reply refers to it
+	std::string text; //Messages joined by newlines
+	mesibo_uint_t count;
+
+	timer_wheel_timer_t timer;
+	int armed;
+	int detached; //Removed from the batch table while its timer was firing, timer callback sends it
+} chatbot_batch_t;
+
+typedef std::unordered_map<std::string, chatbot_batch_t*> chatbot_batch_map_t;
+
+/**
+ * Cached chatbot answer, keyed on <project>\0<language>\0<normalized query>
+ */
+typedef struct chatbot_cache_entry_s {
+	std::string key;
+	std::string answer;
+	mesibo_int_t expiry; //usec
+} chatbot_cache_entry_t;
+
+/**
+ * LRU cache of answers of the intents listed in cache_intents
+ */
+typedef struct chatbot_cache_s {
+	std::unordered_set<std::string> intents;
+	std::list<chatbot_cache_entry_t> lru; //Most recently used first
+	std::unordered_map<std::string, std::list<chatbot_cache_entry_t>::iterator> entries;
+	size_t size; //bytes
+	size_t max_size;
+	mesibo_uint_t ttl; //seconds
+	pthread_mutex_t lock;
+} chatbot_cache_t;
+
 /**
  * Sample Chatbot Module Configuration
  * Refer sample.conf
@@ -68,42 +149,337 @@
 typedef struct chatbot_config_s {
 	/* To be configured in module configuration file */
 	const char* project;
-	const char* endpoint;
+	const char* endpoint; // url [weight], url [weight], ...
 	const char* access_token;
 	const char* language;
 	const char* response_field;
 	const char* address;
 	int log;
+	mesibo_uint_t max_fails; //consecutive failures before an endpoint is ejected
+	mesibo_uint_t fail_timeout; //seconds an ejected endpoint is kept out of rotation
+	int typing; //send a transient typing indicator while the query is in progress
+	const char* typing_text;
+	int stream; //forward partial answers from streaming (NDJSON / SSE) responses
+	mesibo_uint_t coalesce; //msec, messages from a user within this quiet period are sent as one query
+	mesibo_uint_t coalesce_max; //bytes, a batch is sent right away once it reaches this size
+	const char* cache_intents; //comma-separated list of intents whose answers can be cached
 
 	/* To be configured by Dialogflow init function */
-	char* post_url;
+	chatbot_endpoint_t endpoints[CHATBOT_ENDPOINTS_MAX];
+	int endpoint_count;
+	mesibo_uint_t total_weight;
+	pthread_mutex_t endpoint_lock;
+
 	char* auth_bearer;
 	mesibo_http_t* chatbot_http_req;
 
+	timer_wheel_t* timers;
+	chatbot_batch_map_t* batches;
+	pthread_mutex_t batch_lock;
+
+	chatbot_cache_t* cache;
+
 } chatbot_config_t;
 
 /**Http Context **/
 typedef struct http_context_s {
         mesibo_module_t *mod;
 	mesibo_message_params_t* params;
+	chatbot_endpoint_t* endpoint; //Released once the request completes
+	mesibo_int_t ts; //Request start time, usec
         char *from;
         char *to;
-	char* post_data; //Cleanup after HTTP request is complete
+	json_writer_t post_data; //Cleanup after HTTP request is complete
         mesibo_int_t status;
         char response_type[HTTP_RESPONSE_TYPE_LEN];
         // To copy data in response
         char buffer[HTTP_BUFFER_LEN];
         int datalen;
+	char* cache_key; //Set if the answer can be cached
+	size_t cache_key_len;
+	int streaming; //response is a stream of records, one per line
+	int chunks; //number of partial answers sent
 } http_context_t;
 
 void mesibo_chatbot_destroy_http_context(http_context_t* mc){
 	free(mc->from);
 	free(mc->to);
 	free(mc->params);
-	free(mc->post_data);
+	free(mc->cache_key);
+	json_writer_free(&mc->post_data);
 	free(mc);
 }
 
+/**
+ * Weighted random pick among the endpoints which are not ejected
+ */
+static chatbot_endpoint_t* chatbot_random_endpoint(chatbot_config_t* cbc, mesibo_int_t now, 
+		chatbot_endpoint_t* exclude){
+	mesibo_uint_t total = 0;
+	for(int i = 0; i < cbc->endpoint_count; i++){
+		chatbot_endpoint_t* e = &cbc->endpoints[i];
+		if(e == exclude || e->ejected_until > now) continue;
+		total += e->weight;
+	}
+	if(!total) return NULL;
+
+	mesibo_uint_t r = (mesibo_uint_t)rand() % total;
+	for(int i = 0; i < cbc->endpoint_count; i++){
+		chatbot_endpoint_t* e = &cbc->endpoints[i];
+		if(e == exclude || e->ejected_until > now) continue;
+		if(r < e->weight) return e;
+		r -= e->weight;
+	}
+	return NULL;
+}
+
+/* Lower is better. Endpoints without latency samples are preferred so that they get probed */
+static double chatbot_endpoint_load(chatbot_endpoint_t* e){
+	return (double)(e->inflight + 1) * (e->ewma_latency > 0 ? e->ewma_latency : 1) / e->weight;
+}
+
+/**
+ * Selects an endpoint for a new request using power-of-two-choices: 
+ * two endpoints are picked at random (by weight) and the less loaded one is used.
+ * If all endpoints are ejected, the one which recovers first is used.
+ */
+static chatbot_endpoint_t* chatbot_acquire_endpoint(chatbot_config_t* cbc){
+	mesibo_int_t now = mesibo_util_usec();
+
+	pthread_mutex_lock(&cbc->endpoint_lock);
+	chatbot_endpoint_t* e = chatbot_random_endpoint(cbc, now, NULL);
+	if(e){
+		chatbot_endpoint_t* other = chatbot_random_endpoint(cbc, now, e);
+		if(other && chatbot_endpoint_load(other) < chatbot_endpoint_load(e))
+			e = other;
+	} else {
+		e = &cbc->endpoints[0];
+		for(int i = 1; i < cbc->endpoint_count; i++){
+			if(cbc->endpoints[i].ejected_until < e->ejected_until)
+				e = &cbc->endpoints[i];
+		}
+	}
+	e->inflight++;
+	pthread_mutex_unlock(&cbc->endpoint_lock);
+
+	return e;
+}
+
+/**
+ * Updates endpoint health once a request is complete
+ * An endpoint which fails max_fails times in a row is ejected for fail_timeout seconds
+ */
+static void chatbot_release_endpoint(mesibo_module_t* mod, http_context_t* b, int result){
+	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
+	chatbot_endpoint_t* e = b->endpoint;
+	if(!e) return;
+	b->endpoint = NULL;
+
+	mesibo_int_t now = mesibo_util_usec();
+
+	pthread_mutex_lock(&cbc->endpoint_lock);
+	e->inflight--;
+	if(CHATBOT_ENDPOINT_CANCEL == result){
+		//Nothing to update
+	} else if(CHATBOT_ENDPOINT_OK == result){
+		double latency = (double)(now - b->ts);
+		e->ewma_latency = e->ewma_latency > 0 ? 
+			e->ewma_latency + CHATBOT_EWMA_WEIGHT * (latency - e->ewma_latency) : latency;
+		e->fails = 0;
+		e->ejected_until = 0;
+	} else {
+		e->fails++;
+		if(e->fails >= cbc->max_fails){
+			e->ejected_until = now + (mesibo_int_t)cbc->fail_timeout * 1000000;
+			//One more failure ejects the endpoint again once it is back in rotation
+			e->fails = cbc->max_fails - 1;
+			mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "endpoint %s ejected for %u sec\n",
+					e->url, (uint32_t)cbc->fail_timeout);
+		}
+	}
+	pthread_mutex_unlock(&cbc->endpoint_lock);
+}
+
+/**
+ * Sends a reply from the chatbot to the user who sent the query
+ */
+static mesibo_int_t chatbot_send_reply(mesibo_module_t* mod, mesibo_message_params_t* query, 
+		char* from, char* to, const char* text, mesibo_uint_t len, mesibo_uint_t flags){
+	mesibo_message_params_t p;
+	memset(&p, 0, sizeof(mesibo_message_params_t));
+	p.id = rand();
+	p.refid = query->id;
+	p.aid = query->aid;
+	p.from = from;
+	p.to = to;
+	p.flags = flags;
+	p.expiry = 3600;
+
+	return mesibo_message(mod, &p, text, len);
+}
+
+/* Streaming responses are sent as NDJSON or as Server-Sent Events */
+static int chatbot_is_stream_type(const char* response_type){
+	return strstr(response_type, "ndjson") || strstr(response_type, "jsonl")
+		|| strstr(response_type, "event-stream");
+}
+
+/**
+ * Sends the answer contained in a single record of a streaming response
+ */
+static void chatbot_stream_record(http_context_t* b, char* record, int len){
+	mesibo_module_t* mod = b->mod;
+	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
+
+	while(len && (' ' == *record || '\t' == *record)) { record++; len--; }
+	while(len && ('\r' == record[len - 1] || ' ' == record[len - 1])) len--;
+
+	//Server-Sent Events: "data: <json>". Other fields (event, id, comments) are ignored
+	if(len >= 5 && !strncmp(record, "data:", 5)){
+		record += 5; len -= 5;
+		while(len && ' ' == *record) { record++; len--; }
+	}
+	if(!len || '{' != *record) return;
+
+	char* answer = mesibo_util_json_extract(record, len, cbc->response_field, NULL);
+	if(!answer || !*answer) return;
+
+	b->chunks++;
+	chatbot_send_reply(mod, b->params, b->to, b->from, answer, strlen(answer), 0);
+}
+
+/**
+ * Sends every complete record received so far and discards it from the buffer
+ * so that long streams do not overflow the response buffer
+ */
+static void chatbot_stream_flush(http_context_t* b){
+	int start = 0;
+	for(int i = 0; i < b->datalen; i++){
+		if('\n' != b->buffer[i]) continue;
+		chatbot_stream_record(b, b->buffer + start, i - start);
+		start = i + 1;
+	}
+
+	if(start){
+		memmove(b->buffer, b->buffer + start, b->datalen - start);
+		b->datalen -= start;
+	}
+}
+
+/**
+ * Cache key for a query: project, language and the query text in lower case, 
+ * with whitespace collapsed and trailing punctuation removed
+ */
+static std::string chatbot_cache_key(chatbot_config_t* cbc, const char* message, mesibo_uint_t len){
+	std::string key(cbc->project);
+	key.push_back('\0');
+	key.append(cbc->language ? cbc->language : "");
+	key.push_back('\0');
+
+	size_t start = key.size();
+	int space = 0;
+	for(mesibo_uint_t i = 0; i < len; i++){
+		unsigned char c = message[i];
+		if(isspace(c)){
+			space = 1;
+			continue;
+		}
+		if(space && key.size() > start) key.push_back(' ');
+		space = 0;
+		key.push_back(tolower(c));
+	}
+
+	while(key.size() > start && strchr(".!?", key.back()))
+		key.pop_back();
+
+	return key;
+}
+
+static void chatbot_cache_remove(chatbot_cache_t* cache, std::list<chatbot_cache_entry_t>::iterator it){
+	cache->size -= it->key.size() + it->answer.size() + CHATBOT_CACHE_ENTRY_OVERHEAD;
+	cache->entries.erase(it->key);
+	cache->lru.erase(it);
+}
+
+/**
+ * Looks up a cached answer. Returns 1 and sets answer on a hit
+ */
+static int chatbot_cache_get(chatbot_cache_t* cache, const std::string& key, std::string& answer){
+	int found = 0;
+	mesibo_int_t now = mesibo_util_usec();
+
+	pthread_mutex_lock(&cache->lock);
+	auto it = cache->entries.find(key);
+	if(it != cache->entries.end()){
+		if(it->second->expiry <= now){
+			chatbot_cache_remove(cache, it->second);
+		} else {
+			cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+			answer = it->second->answer;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+static void chatbot_cache_put(chatbot_cache_t* cache, const std::string& key, const char* answer){
+	size_t entry_size = key.size() + strlen(answer) + CHATBOT_CACHE_ENTRY_OVERHEAD;
+	if(entry_size > cache->max_size) return;
+
+	pthread_mutex_lock(&cache->lock);
+	auto it = cache->entries.find(key);
+	if(it != cache->entries.end())
+		chatbot_cache_remove(cache, it->second);
+
+	//Evict least recently used entries to stay within the memory cap
+	while(!cache->lru.empty() && cache->size + entry_size > cache->max_size)
+		chatbot_cache_remove(cache, std::prev(cache->lru.end()));
+
+	cache->lru.push_front({key, answer, mesibo_util_usec() + (mesibo_int_t)cache->ttl * 1000000});
+	cache->entries[key] = cache->lru.begin();
+	cache->size += entry_size;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Caches the answer if the intent matched by the chatbot is in the allow-list
+ */
+static void chatbot_cache_response(http_context_t* b, const char* answer){
+	chatbot_config_t* cbc = (chatbot_config_t*)b->mod->ctx;
+	if(!cbc->cache || !b->cache_key || 200 != b->status)
+		return;
+
+	char* intent = mesibo_util_json_extract(b->buffer, b->datalen, "displayName", NULL);
+	if(!intent || !cbc->cache->intents.count(intent))
+		return;
+
+	mesibo_log(b->mod, cbc->log, "Caching answer of intent %s\n", intent);
+	chatbot_cache_put(cbc->cache, std::string(b->cache_key, b->cache_key_len), answer);
+}
+
+static chatbot_cache_t* chatbot_cache_create(chatbot_config_t* cbc, const char* ttl, const char* size){
+	chatbot_cache_t* cache = new chatbot_cache_t();
+	cache->size = 0;
+	cache->ttl = ttl ? atoi(ttl) : CHATBOT_DEFAULT_CACHE_TTL;
+	cache->max_size = size ? atol(size) : CHATBOT_DEFAULT_CACHE_SIZE;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	char* list = strdup(cbc->cache_intents);
+	char* saveptr = NULL;
+	for(char* item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)){
+		while(isspace((unsigned char)*item)) item++;
+		char* end = item + strlen(item);
+		while(end > item && isspace((unsigned char)end[-1])) end--;
+		if(end > item)
+			cache->intents.insert(std::string(item, end - item));
+	}
+	free(list);
+
+	return cache;
+}
+
 /**
  * HTTP Callback function
  * Response from Dialogflow is recieved through this callback
@@ -117,8 +493,8 @@ static mesibo_int_t chatbot_http_on_data_callback(void *cbdata, mesibo_int_t sta
 
 	
 	if (progress < 0) {
+		//on_close is called next, it releases the endpoint and the context
 		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Error in http callback \n");
-		mesibo_chatbot_destroy_http_context(b);
 		return MESIBO_RESULT_FAIL;
 	}
 
@@ -134,6 +510,10 @@ static mesibo_int_t chatbot_http_on_data_callback(void *cbdata, mesibo_int_t sta
 		}
 		memcpy(b->buffer + b->datalen, buffer, size);
 		b->datalen += size;
+
+		//Forward partial answers as soon as they arrive
+		if(b->streaming)
+			chatbot_stream_flush(b);
 	}
 
 	if (100 == progress) {
@@ -154,8 +534,9 @@ mesibo_int_t chatbot_http_on_status_callback(void *cbdata, mesibo_int_t status,
 
 	b->status = status;
 	if(NULL != response_type){
-		memcpy(b->response_type, response_type, strlen(response_type));
+		strncpy(b->response_type, response_type, HTTP_RESPONSE_TYPE_LEN - 1);
 		mesibo_log(mod, cbc->log, "status: %d, response_type: %s \n", (int)status, response_type);
+		b->streaming = cbc->stream && status < 300 && chatbot_is_stream_type(b->response_type);
 	}
 	return MESIBO_RESULT_OK;
 }
@@ -168,30 +549,39 @@ void chatbot_http_on_close_callback(void *cbdata,  mesibo_int_t result){
 	
 	if(MESIBO_RESULT_FAIL == result){
 		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Invalid HTTP response \n");
+		chatbot_release_endpoint(mod, b, CHATBOT_ENDPOINT_FAIL);
+		mesibo_chatbot_destroy_http_context(b);
 		return;
 	}
+
+	//Server errors count against the endpoint, client errors do not
+	chatbot_release_endpoint(mod, b, b->status < 500 ? CHATBOT_ENDPOINT_OK : CHATBOT_ENDPOINT_FAIL);
 	
 	//Send response and cleanup
-	
-	mesibo_message_params_t p;
-	memset(&p, 0, sizeof(mesibo_message_params_t));
-	p.id = rand();
-	p.refid = b->params->id;
-	p.aid = b->params->aid;
-	p.from = b->to;
-	p.to = b->from; // User adress who sent the query is the recipient
-	p.expiry = 3600;
-	
-	
 	mesibo_log(mod, cbc->log, "%.*s", b->datalen, b->buffer);	
+
+	if(b->streaming){
+		//Last record may not be terminated by a newline
+		chatbot_stream_flush(b);
+		chatbot_stream_record(b, b->buffer, b->datalen);
+		if(b->chunks){
+			mesibo_chatbot_destroy_http_context(b);
+			return;
+		}
+	}
+
 	char* extracted_response = mesibo_util_json_extract(b->buffer, b->datalen, cbc->response_field, NULL);
 	
 	if(!extracted_response){
 		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Error extracting response \n");
+		mesibo_chatbot_destroy_http_context(b);
 		return;
 	}
 	
-	mesibo_message(mod, &p, extracted_response , strlen(extracted_response));
+	chatbot_cache_response(b, extracted_response);
+
+	// User adress who sent the query is the recipient
+	chatbot_send_reply(mod, b->params, b->to, b->from, extracted_response, strlen(extracted_response), 0);
 	mesibo_chatbot_destroy_http_context(b);
 }
 
@@ -221,15 +611,54 @@ static mesibo_http_t* mesibo_chatbot_get_http_req(chatbot_config_t* cbc){
 static mesibo_int_t chatbot_init_dialogflow(mesibo_module_t* mod){
 	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
 
-	asprintf(&cbc->post_url, "%s/projects/%s/agent/sessions",
-			cbc->endpoint, cbc->project);
-	mesibo_log(mod, cbc->log, "Configured post URL for HTTP requests: %s \n", cbc->post_url);
+	if(!cbc->endpoint || !cbc->project)
+		return MESIBO_RESULT_FAIL;
+
+	// endpoint = <url> [weight], <url> [weight], ...
+	char* list = strdup(cbc->endpoint);
+	char* saveptr = NULL;
+	for(char* item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)){
+		while(isspace((unsigned char)*item)) item++;
+		char* url_end = item;
+		while(*url_end && !isspace((unsigned char)*url_end)) url_end++;
+		if(url_end == item) continue;
+
+		if(CHATBOT_ENDPOINTS_MAX == cbc->endpoint_count){
+			mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Too many endpoints, max %d\n", 
+					CHATBOT_ENDPOINTS_MAX);
+			break;
+		}
+
+		chatbot_endpoint_t* e = &cbc->endpoints[cbc->endpoint_count++];
+		e->url = strndup(item, url_end - item);
+		e->weight = *url_end ? strtoul(url_end, NULL, 10) : 1;
+		if(!e->weight) e->weight = 1;
+		cbc->total_weight += e->weight;
+
+		asprintf(&e->post_url, "%s/projects/%s/agent/sessions", e->url, cbc->project);
+		mesibo_log(mod, cbc->log, "Configured post URL for HTTP requests: %s weight %u\n", 
+				e->post_url, (uint32_t)e->weight);
+	}
+	free(list);
+
+	if(!cbc->endpoint_count)
+		return MESIBO_RESULT_FAIL;
+	pthread_mutex_init(&cbc->endpoint_lock, NULL);
 
 	asprintf(&cbc->auth_bearer, "Authorization: Bearer %s", cbc->access_token);
 	mesibo_log(mod, cbc->log, "Configured auth bearer for HTTP requests with token: %s \n", cbc->auth_bearer );
 
 	cbc->chatbot_http_req = mesibo_chatbot_get_http_req(cbc); 
 
+	if(cbc->coalesce){
+		pthread_mutex_init(&cbc->batch_lock, NULL);
+		cbc->batches = new chatbot_batch_map_t();
+		cbc->timers = (timer_wheel_t*)malloc(sizeof(timer_wheel_t));
+		timer_wheel_init(cbc->timers, CHATBOT_TIMER_TICK_USEC);
+		cbc->timers->running = 1;
+		mesibo_util_create_thread(timer_wheel_thread, cbc->timers, 0, "chatbot_timer");
+	}
+
 	return MESIBO_RESULT_OK;
 }
 
@@ -240,39 +669,187 @@ static mesibo_int_t chatbot_init_dialogflow(mesibo_module_t* mod){
  * The response to the request will be received in the callback function chatbot_http_callback
  */
 static mesibo_int_t chatbot_process_message(mesibo_module_t *mod, mesibo_message_params_t *p,
-		const char *message, mesibo_uint_t len) {
+		const char *message, mesibo_uint_t len, int typing) {
 
 	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
 
+	std::string cache_key;
+	if(cbc->cache){
+		//Answer right away without querying the chatbot
+		std::string answer;
+		cache_key = chatbot_cache_key(cbc, message, len);
+		if(chatbot_cache_get(cbc->cache, cache_key, answer)){
+			mesibo_log(mod, cbc->log, "Answered from cache\n");
+			chatbot_send_reply(mod, p, p->to, p->from, answer.data(), answer.size(), 0);
+			free(p);
+			return MESIBO_RESULT_OK;
+		}
+	}
+
+	//Let the user know that the query is being processed 
+	if(typing)
+		chatbot_send_reply(mod, p, p->to, p->from, cbc->typing_text, 
+				strlen(cbc->typing_text), MOD_MESIBO_MSGFLAG_TRANSIENT);
+
+	chatbot_endpoint_t* endpoint = chatbot_acquire_endpoint(cbc);
+
 	char post_url[HTTP_POST_URL_LEN_MAX];
-	sprintf(post_url, "%s/%lu:detectIntent", cbc->post_url, p->id); //Pass Message ID as Session ID
-	char* raw_post_data; 
-	asprintf(&raw_post_data, "{\"queryInput\":{\"text\":{\"text\":\"%.*s\", \"languageCode\":\"%s\"}}}",
-			(int)len, message, cbc->language);
+	snprintf(post_url, sizeof(post_url), "%s/%lu:detectIntent", endpoint->post_url, p->id); //Pass Message ID as Session ID
 
 	http_context_t *http_context =
 		(http_context_t *)calloc(1, sizeof(http_context_t));
 	http_context->mod = mod;
+	http_context->endpoint = endpoint;
+	http_context->ts = mesibo_util_usec();
 	http_context->params = p;
 	http_context->from = strdup(p->from);
 	http_context->to = strdup(p->to);
-	http_context->post_data = raw_post_data;
+	if(cbc->cache){
+		http_context->cache_key = (char*)malloc(cache_key.size());
+		memcpy(http_context->cache_key, cache_key.data(), cache_key.size());
+		http_context->cache_key_len = cache_key.size();
+	}
+
+	// {"queryInput":{"text":{"text":"<message>","languageCode":"<language>"}}}
+	json_writer_t* w = &http_context->post_data;
+	json_writer_init(w, len + 64);
+	json_writer_object_begin(w);
+	json_writer_key(w, "queryInput");
+	json_writer_object_begin(w);
+	json_writer_key(w, "text");
+	json_writer_object_begin(w);
+	json_writer_key(w, "text");
+	json_writer_string(w, message, len);
+	json_writer_key(w, "languageCode");
+	json_writer_cstring(w, cbc->language);
+	json_writer_object_end(w);
+	json_writer_object_end(w);
+	json_writer_object_end(w);
+
+	const char* raw_post_data = json_writer_data(w);
+	if(!raw_post_data){
+		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Error building POST data \n");
+		chatbot_release_endpoint(mod, http_context, CHATBOT_ENDPOINT_CANCEL);
+		mesibo_chatbot_destroy_http_context(http_context);
+		return MESIBO_RESULT_FAIL;
+	}
 
 	mesibo_log(mod, cbc->log , "%s %s %s %s \n", post_url, raw_post_data, cbc->chatbot_http_req->extra_header,
 			cbc->chatbot_http_req->content_type);
 
-	cbc->chatbot_http_req->url = post_url;
-	cbc->chatbot_http_req->post = raw_post_data;
+	//Queries are also sent from the timer thread, so don't modify the shared request options
+	mesibo_http_t req = *cbc->chatbot_http_req;
+	req.url = post_url;
+	req.post = raw_post_data;
 	
-	cbc->chatbot_http_req->on_data = chatbot_http_on_data_callback;
-	cbc->chatbot_http_req->on_status = chatbot_http_on_status_callback;
-	cbc->chatbot_http_req->on_close = chatbot_http_on_close_callback;
+	req.on_data = chatbot_http_on_data_callback;
+	req.on_status = chatbot_http_on_status_callback;
+	req.on_close = chatbot_http_on_close_callback;
 
-	mesibo_util_http(cbc->chatbot_http_req, (void *)http_context);
+	if(MESIBO_RESULT_FAIL == mesibo_util_http(&req, (void *)http_context)){
+		chatbot_release_endpoint(mod, http_context, CHATBOT_ENDPOINT_FAIL);
+		mesibo_chatbot_destroy_http_context(http_context);
+		return MESIBO_RESULT_FAIL;
+	}
 
 	return MESIBO_RESULT_OK;
 }
 
+/**
+ * Sends all the messages collected in a batch as a single query
+ */
+static void chatbot_batch_send(chatbot_batch_t* batch){
+	mesibo_module_t* mod = batch->mod;
+	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
+
+	mesibo_log(mod, cbc->log, "Sending %u messages from %s as a single query\n", 
+			(uint32_t)batch->count, batch->from.c_str());
+
+	mesibo_message_params_t* np = (mesibo_message_params_t*)malloc(sizeof(mesibo_message_params_t)); 
+	memcpy(np, &batch->params, sizeof(mesibo_message_params_t));
+	np->from = (char*)batch->from.c_str();
+	np->to = (char*)batch->to.c_str();
+	chatbot_process_message(mod, np, batch->text.data(), batch->text.size(), 0);
+
+	delete batch;
+}
+
+/**
+ * Timer callback, called once no more messages are received in the quiet period
+ */
+static void chatbot_batch_on_timer(void* data){
+	chatbot_batch_t* batch = (chatbot_batch_t*)data;
+	chatbot_config_t* cbc = (chatbot_config_t*)batch->mod->ctx;
+
+	pthread_mutex_lock(&cbc->batch_lock);
+	if(!batch->detached){
+		//Another message was received while the timer was firing
+		if(timer_wheel_pending(cbc->timers, &batch->timer)){
+			pthread_mutex_unlock(&cbc->batch_lock);
+			return;
+		}
+		cbc->batches->erase(batch->key);
+	}
+	pthread_mutex_unlock(&cbc->batch_lock);
+
+	chatbot_batch_send(batch);
+}
+
+/**
+ * Adds a message to the pending batch of the conversation, and (re)starts its quiet period
+ */
+static void chatbot_batch_add(mesibo_module_t *mod, mesibo_message_params_t *p,
+		const char *message, mesibo_uint_t len){
+	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
+
+	std::string key(p->from);
+	key.push_back('\0');
+	key.append(p->to);
+
+	chatbot_batch_t* send_now = NULL;
+	int first = 0;
+
+	pthread_mutex_lock(&cbc->batch_lock);
+	chatbot_batch_t*& batch = (*cbc->batches)[key];
+	if(!batch){
+		batch = new chatbot_batch_t();
+		batch->mod = mod;
+		batch->key = key;
+		batch->from = p->from;
+		batch->to = p->to;
+		first = 1;
+	} else {
+		batch->text.push_back('\n');
+	}
+
+	batch->text.append(message, len);
+	batch->count++;
+	memcpy(&batch->params, p, sizeof(mesibo_message_params_t));
+	batch->params.from = batch->params.to = NULL;
+
+	if(batch->text.size() >= cbc->coalesce_max){
+		chatbot_batch_t* b = batch;
+		cbc->batches->erase(key);
+		if(!b->armed || timer_wheel_del(cbc->timers, &b->timer))
+			send_now = b;
+		else
+			b->detached = 1;
+	} else {
+		batch->armed = 1;
+		timer_wheel_add(cbc->timers, &batch->timer, (uint64_t)cbc->coalesce * 1000, 
+				chatbot_batch_on_timer, batch);
+	}
+	pthread_mutex_unlock(&cbc->batch_lock);
+
+	//Let the user know that the messages are being processed
+	if(cbc->typing && first)
+		chatbot_send_reply(mod, p, p->to, p->from, cbc->typing_text, 
+				strlen(cbc->typing_text), MOD_MESIBO_MSGFLAG_TRANSIENT);
+
+	if(send_now)
+		chatbot_batch_send(send_now);
+}
+
 /**
  * Callback function to on_message
  * Called when any users sends a Message TO a particular user identified by mesibo user-id as the chatbot endpoint
@@ -289,10 +866,14 @@ static mesibo_int_t chatbot_on_message(mesibo_module_t *mod, mesibo_message_para
 	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
 
 	if(0 == strcmp(p->to, cbc->address)){
-		// Don't modify original as other module will use it
-		mesibo_message_params_t* np = (mesibo_message_params_t*)malloc(sizeof(mesibo_message_params_t)); 
-		memcpy(np, p, sizeof(mesibo_message_params_t));
-		chatbot_process_message(mod, np, message, len);
+		if(cbc->coalesce){
+			chatbot_batch_add(mod, p, message, len);
+		} else {
+			// Don't modify original as other module will use it
+			mesibo_message_params_t* np = (mesibo_message_params_t*)malloc(sizeof(mesibo_message_params_t)); 
+			memcpy(np, p, sizeof(mesibo_message_params_t));
+			chatbot_process_message(mod, np, message, len, cbc->typing);
+		}
 
 		return MESIBO_RESULT_CONSUMED;  // Process the message and CONSUME original
 	}
@@ -314,6 +895,30 @@ static chatbot_config_t*  get_config_dialogflow(mesibo_module_t* mod){
 	cbc->address = mesibo_util_getconfig(mod, "address");
 	cbc->log = atoi(mesibo_util_getconfig(mod, "log"));
 
+	//Optional
+	const char* max_fails = mesibo_util_getconfig(mod, "max_fails");
+	const char* fail_timeout = mesibo_util_getconfig(mod, "fail_timeout");
+	cbc->max_fails = max_fails ? atoi(max_fails) : CHATBOT_DEFAULT_MAX_FAILS;
+	if(!cbc->max_fails) cbc->max_fails = 1;
+	cbc->fail_timeout = fail_timeout ? atoi(fail_timeout) : CHATBOT_DEFAULT_FAIL_TIMEOUT;
+
+	const char* typing = mesibo_util_getconfig(mod, "typing");
+	const char* stream = mesibo_util_getconfig(mod, "stream");
+	cbc->typing = typing ? atoi(typing) : 0;
+	cbc->typing_text = mesibo_util_getconfig(mod, "typing_text");
+	if(!cbc->typing_text) cbc->typing_text = CHATBOT_DEFAULT_TYPING_TEXT;
+	cbc->stream = stream ? atoi(stream) : 0;
+
+	const char* coalesce = mesibo_util_getconfig(mod, "coalesce");
+	const char* coalesce_max = mesibo_util_getconfig(mod, "coalesce_max");
+	cbc->coalesce = coalesce ? atoi(coalesce) : 0;
+	cbc->coalesce_max = coalesce_max ? atoi(coalesce_max) : CHATBOT_DEFAULT_COALESCE_MAX;
+
+	cbc->cache_intents = mesibo_util_getconfig(mod, "cache_intents");
+	if(cbc->cache_intents && *cbc->cache_intents)
+		cbc->cache = chatbot_cache_create(cbc, mesibo_util_getconfig(mod, "cache_ttl"), 
+				mesibo_util_getconfig(mod, "cache_size"));
+
 	mesibo_log(mod, cbc->log, "Configured DialogFlow :\nproject %s\nendpoint %s\naccess_token %s\n"
 			"language %s\naddress %s\n", cbc->project, cbc->endpoint, 
 			cbc->access_token, cbc->language, cbc->address);
@@ -327,7 +932,28 @@ static chatbot_config_t*  get_config_dialogflow(mesibo_module_t* mod){
  **/ 
 static  mesibo_int_t  chatbot_on_cleanup(mesibo_module_t* mod){
 	chatbot_config_t* cbc = (chatbot_config_t*)mod->ctx;
-	free(cbc->post_url);
+	if(!cbc) return MESIBO_RESULT_OK;
+	for(int i = 0; i < cbc->endpoint_count; i++){
+		free(cbc->endpoints[i].url);
+		free(cbc->endpoints[i].post_url);
+	}
+	if(cbc->endpoint_count)
+		pthread_mutex_destroy(&cbc->endpoint_lock);
+
+	if(cbc->timers){
+		timer_wheel_stop(cbc->timers);
+		for(auto& it : *cbc->batches)
+			delete it.second;
+		delete cbc->batches;
+		free(cbc->timers);
+		pthread_mutex_destroy(&cbc->batch_lock);
+	}
+
+	if(cbc->cache){
+		pthread_mutex_destroy(&cbc->cache->lock);
+		delete cbc->cache;
+	}
+
 	free(cbc->auth_bearer);
 	free(cbc->chatbot_http_req);
 	free(cbc);
@@ -355,6 +981,7 @@ MESIBO_EXPORT int mesibo_module_chatbot_init(mesibo_int_t version, mesibo_module
 			return MESIBO_RESULT_FAIL;
 		}
 		m->ctx = (void* )cbc;
+		m->on_cleanup = chatbot_on_cleanup; //Stops the timer thread and frees the batches and cache
 
 		int init_status = chatbot_init_dialogflow(m);
 		if(MESIBO_RESULT_OK != init_status){
@@ -0,0 +1,773 @@
+/**
+ * File: fcgi_bench.cpp
+ * Description: Load harness for the FCGI module
+ *
+ * Runs the module in-process against a stub FastCGI responder, without mesibo
+ * or a PHP stack. The stub answers each request after a configurable service
+ * time with a response of a configurable size. Messages are sent to the
+ * module's on_message at a fixed rate (open loop, so a slow module does not
+ * slow down the senders) and each reply is matched to its message by the
+ * sequence number it carries.
+ *
+ * mesibo_message, mesibo_util_fcgi and the other mesibo functions are
+ * provided here. The stand-in mesibo_util_fcgi opens a connection per request
+ * on a new thread, to compare the pool = 0 path with the native client.
+ *
+ * Usage: fcgi_bench [key=value ...]
+ *   rate=2000 		messages per second
+ *   duration=5 		seconds
+ *   users=100 		distinct senders
+ *   msg=64 		message size
+ *   service=2 		stub service time, ms
+ *   size=256 		stub response size
+ *   mpxs=1 		stub FCGI_MPXS_CONNS
+ *   unix=/path 		stub listens on a Unix domain socket instead of TCP
+ * Other keys are passed to the module as its configuration, for example
+ * pool=8 multiplex=auto timeout=1000 ordered=1 envelope=1 framing=delimiter
+ *
+ * Batch mode is not supported by the stub.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+
+//The module is built into the harness, to read the client's counters from its configuration
+#include "fcgi.cpp"
+
+#define BENCH_MAX_CONFIG 		64
+#define BENCH_STUB_MAX_EVENTS 		64
+#define BENCH_STUB_MAX_REQS 		64
+#define BENCH_RECORD_MAX 		65535
+
+static const char* bench_keys[BENCH_MAX_CONFIG];
+static const char* bench_values[BENCH_MAX_CONFIG];
+static int bench_nconfig;
+static int bench_verbose;
+
+static uint64_t bench_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char* bench_get(const char* key) {
+	for(int i = 0; i < bench_nconfig; i++)
+		if(!strcmp(bench_keys[i], key)) return bench_values[i];
+	return NULL;
+}
+
+static void bench_set(const char* key, const char* value) {
+	for(int i = 0; i < bench_nconfig; i++) {
+		if(!strcmp(bench_keys[i], key)) {
+			bench_values[i] = value;
+			return;
+		}
+	}
+	if(bench_nconfig < BENCH_MAX_CONFIG) {
+		bench_keys[bench_nconfig] = key;
+		bench_values[bench_nconfig++] = value;
+	}
+}
+
+static long bench_int(const char* key, long def) {
+	const char* v = bench_get(key);
+	return v ? atol(v) : def;
+}
+
+/** Results, indexed by message sequence number */
+static uint64_t* bench_sent_at;
+static uint32_t* bench_latency; //usec, 0 until the first reply
+static volatile uint64_t bench_replies;
+static volatile uint64_t bench_reply_bytes;
+static volatile uint64_t bench_copied; //Bytes copied by the stand-in mesibo functions
+static uint64_t bench_count;
+
+/*------------------------------------------------------------------------------
+ * Stand-in mesibo functions
+ *----------------------------------------------------------------------------*/
+extern "C" {
+
+char* mesibo_util_getconfig(mesibo_module_t* mod, const char* item_name) {
+	return (char*)bench_get(item_name);
+}
+
+mesibo_int_t mesibo_vlog(mesibo_module_t *mod, mesibo_uint_t level, const char *format, va_list args) {
+	if(bench_verbose || !level) vfprintf(stderr, format, args);
+	return 0;
+}
+
+mesibo_int_t mesibo_log(mesibo_module_t *mod, mesibo_uint_t level, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	mesibo_vlog(mod, level, format, args);
+	va_end(args);
+	return 0;
+}
+
+/* Replies start with #<seq>, the first reply of a message gives its latency */
+mesibo_int_t mesibo_message(mesibo_module_t *mod, mesibo_message_params_t *params, const char *message, mesibo_uint_t len) {
+	uint64_t now = bench_usec();
+
+	//mesibo copies the message to queue it
+	char* copy = (char*)malloc(len ? len : 1);
+	if(copy) memcpy(copy, message, len);
+	__sync_fetch_and_add(&bench_copied, len);
+	__sync_fetch_and_add(&bench_reply_bytes, len);
+
+	if(len > 1 && '#' == message[0]) {
+		uint64_t seq = strtoull(message + 1, NULL, 10);
+		if(seq < bench_count && __sync_bool_compare_and_swap(&bench_latency[seq], 0,
+					(uint32_t)(now - bench_sent_at[seq] ? now - bench_sent_at[seq] : 1)))
+			__sync_fetch_and_add(&bench_replies, 1);
+	}
+	free(copy);
+	return 0;
+}
+
+mesibo_int_t mesibo_util_usec() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (mesibo_int_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void mesibo_util_create_thread(void *(*fn) (void *), void *data, size_t stacksize, const char *name) {
+	pthread_t t;
+	pthread_create(&t, NULL, fn, data);
+	pthread_detach(t);
+}
+
+mesibo_int_t mesibo_util_http(mesibo_http_t *req, void *cbdata) {
+	return MESIBO_RESULT_FAIL;
+}
+
+char* mesibo_util_json_extract(char *src, mesibo_int_t len, const char *key, char **next) {
+	return NULL;
+}
+
+}
+
+/*------------------------------------------------------------------------------
+ * Stand-in mesibo_util_fcgi, a connection per request
+ *----------------------------------------------------------------------------*/
+typedef struct bench_fcgi_s {
+	char* records; //All records of the request
+	size_t len;
+	char host[256];
+	mesibo_int_t port;
+	mesibo_fcgi_ondata_t cb;
+	void* cbdata;
+} bench_fcgi_t;
+
+static void bench_put_header(char* p, int type, int id, size_t len) {
+	p[0] = 1;
+	p[1] = type;
+	p[2] = (id >> 8) & 0xFF;
+	p[3] = id & 0xFF;
+	p[4] = (len >> 8) & 0xFF;
+	p[5] = len & 0xFF;
+	p[6] = 0;
+	p[7] = 0;
+}
+
+static size_t bench_put_length(char* p, size_t len) {
+	if(len < 128) {
+		p[0] = len;
+		return 1;
+	}
+	p[0] = ((len >> 24) & 0x7F) | 0x80;
+	p[1] = (len >> 16) & 0xFF;
+	p[2] = (len >> 8) & 0xFF;
+	p[3] = len & 0xFF;
+	return 4;
+}
+
+static size_t bench_put_pair(char* p, const char* name, const char* value) {
+	size_t nlen = strlen(name), vlen = value ? strlen(value) : 0;
+	size_t n = bench_put_length(p, nlen);
+	n += bench_put_length(p + n, vlen);
+	memcpy(p + n, name, nlen);
+	memcpy(p + n + nlen, value, vlen);
+	return n + nlen + vlen;
+}
+
+static int bench_connect(const char* host, mesibo_int_t port) {
+	int fd;
+	if(!strncmp(host, "unix:", 5)) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, host + 5, sizeof(sun.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd >= 0 && connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_pton(AF_INET, host, &sin.sin_addr);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd >= 0 && connect(fd, (struct sockaddr*)&sin, sizeof(sin))) {
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	if(fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int bench_read_full(int fd, char* buf, size_t len) {
+	while(len) {
+		ssize_t n = read(fd, buf, len);
+		if(n < 0 && EINTR == errno) continue;
+		if(n <= 0) return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void* bench_fcgi_thread(void* arg) {
+	bench_fcgi_t* f = (bench_fcgi_t*)arg;
+	int fd = bench_connect(f->host, f->port);
+	int result = MESIBO_RESULT_FAIL;
+	int in_body = 0, newlines = 0;
+
+	if(fd >= 0 && write(fd, f->records, f->len) == (ssize_t)f->len) {
+		char hdr[8];
+		char* content = (char*)malloc(BENCH_RECORD_MAX + 255);
+		while(content && !bench_read_full(fd, hdr, 8)) {
+			size_t clen = ((unsigned char)hdr[4] << 8) | (unsigned char)hdr[5];
+			size_t plen = (unsigned char)hdr[6];
+			if(bench_read_full(fd, content, clen + plen)) break;
+			if(3 == hdr[1]) {
+				result = MESIBO_RESULT_OK;
+				break;
+			}
+			if(6 != hdr[1]) continue;
+
+			//Skip the CGI headers
+			size_t i = 0;
+			while(!in_body && i < clen) {
+				char c = content[i++];
+				if('\n' == c) in_body = (2 == ++newlines);
+				else if('\r' != c) newlines = 0;
+			}
+			if(clen > i) f->cb(f->cbdata, MESIBO_RESULT_OK, content + i, clen - i);
+		}
+		free(content);
+	}
+
+	if(fd >= 0) close(fd);
+	if(MESIBO_RESULT_OK != result) f->cb(f->cbdata, MESIBO_RESULT_FAIL, NULL, 0);
+	free(f->records);
+	free(f);
+	return NULL;
+}
+
+extern "C" mesibo_int_t mesibo_util_fcgi(mesibo_fcgi_t *req, const char *host, mesibo_int_t port, mesibo_int_t keepalive,
+		mesibo_fcgi_ondata_t cb, void *cbdata) {
+	bench_fcgi_t* f = (bench_fcgi_t*)calloc(1, sizeof(bench_fcgi_t));
+	if(!f) return MESIBO_RESULT_FAIL;
+	size_t records = (req->bodylen + BENCH_RECORD_MAX - 1) / BENCH_RECORD_MAX;
+	f->records = (char*)malloc(1024 + (req->USER ? strlen(req->USER) : 0) + req->bodylen + (records + 1) * 8);
+	if(!f->records) {
+		free(f);
+		return MESIBO_RESULT_FAIL;
+	}
+
+	char clen[24];
+	snprintf(clen, sizeof(clen), "%llu", (unsigned long long)req->bodylen);
+	char script[512];
+	snprintf(script, sizeof(script), "%s/%s", req->DOCUMENT_ROOT ? req->DOCUMENT_ROOT : "", req->SCRIPT_NAME ? req->SCRIPT_NAME : "");
+
+	char* p = f->records;
+	bench_put_header(p, 1, 1, 8);
+	memset(p + 8, 0, 8);
+	p[9] = 1;
+	p += 16;
+
+	char* params = p + 8;
+	size_t n = 0;
+	n += bench_put_pair(params + n, "SCRIPT_FILENAME", script);
+	n += bench_put_pair(params + n, "REQUEST_METHOD", "POST");
+	n += bench_put_pair(params + n, "CONTENT_LENGTH", clen);
+	n += bench_put_pair(params + n, "USER", req->USER);
+	bench_put_header(p, 4, 1, n);
+	p = params + n;
+	bench_put_header(p, 4, 1, 0);
+	p += 8;
+
+	//The body is copied, as mesibo does
+	for(size_t off = 0; off < req->bodylen; off += BENCH_RECORD_MAX) {
+		size_t len = req->bodylen - off > BENCH_RECORD_MAX ? BENCH_RECORD_MAX : req->bodylen - off;
+		bench_put_header(p, 5, 1, len);
+		memcpy(p + 8, req->body + off, len);
+		p += 8 + len;
+	}
+	__sync_fetch_and_add(&bench_copied, req->bodylen);
+	bench_put_header(p, 5, 1, 0);
+	p += 8;
+
+	f->len = p - f->records;
+	snprintf(f->host, sizeof(f->host), "%s", host);
+	f->port = port;
+	f->cb = cb;
+	f->cbdata = cbdata;
+	mesibo_util_create_thread(bench_fcgi_thread, f, 0, "bench_fcgi");
+	return MESIBO_RESULT_OK;
+}
+
+/*------------------------------------------------------------------------------
+ * Stub FastCGI responder, one epoll thread
+ *----------------------------------------------------------------------------*/
+typedef struct stub_conn_s {
+	int fd;
+	int closed;
+	int pending; //Responses scheduled, the connection is freed once they are done
+	char* rbuf;
+	size_t rlen, rcap;
+	char* wbuf;
+	size_t wlen, wcap, woff;
+	uint64_t seq[BENCH_STUB_MAX_REQS + 1]; //Sequence number found in the request body
+	int found[BENCH_STUB_MAX_REQS + 1];
+} stub_conn_t;
+
+typedef struct stub_response_s {
+	uint64_t due;
+	stub_conn_t* conn;
+	uint16_t id;
+	uint64_t seq;
+} stub_response_t;
+
+typedef struct stub_s {
+	int lfd;
+	int epfd;
+	uint64_t service_usec;
+	size_t size;
+	int mpxs;
+	stub_response_t* heap; //Min-heap on due
+	size_t nheap, cheap;
+	char* padding;
+	volatile int conns;
+	int peak_conns;
+	volatile int running;
+	volatile int stopped;
+} stub_t;
+
+static void stub_heap_push(stub_t* s, stub_response_t r) {
+	if(s->nheap == s->cheap) {
+		s->cheap = s->cheap ? s->cheap * 2 : 1024;
+		s->heap = (stub_response_t*)realloc(s->heap, s->cheap * sizeof(stub_response_t));
+	}
+	size_t i = s->nheap++;
+	while(i && s->heap[(i - 1) / 2].due > r.due) {
+		s->heap[i] = s->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	s->heap[i] = r;
+}
+
+static stub_response_t stub_heap_pop(stub_t* s) {
+	stub_response_t top = s->heap[0];
+	stub_response_t last = s->heap[--s->nheap];
+	size_t i = 0;
+	while(1) {
+		size_t c = 2 * i + 1;
+		if(c >= s->nheap) break;
+		if(c + 1 < s->nheap && s->heap[c + 1].due < s->heap[c].due) c++;
+		if(last.due <= s->heap[c].due) break;
+		s->heap[i] = s->heap[c];
+		i = c;
+	}
+	if(s->nheap) s->heap[i] = last;
+	return top;
+}
+
+static void stub_reserve(char** buf, size_t* cap, size_t need) {
+	if(need <= *cap) return;
+	size_t c = *cap ? *cap : 4096;
+	while(c < need) c *= 2;
+	*buf = (char*)realloc(*buf, c);
+	*cap = c;
+}
+
+static void stub_write(stub_conn_t* c, const char* data, size_t len) {
+	stub_reserve(&c->wbuf, &c->wcap, c->wlen + len);
+	memcpy(c->wbuf + c->wlen, data, len);
+	c->wlen += len;
+}
+
+static void stub_flush(stub_conn_t* c) {
+	while(c->woff < c->wlen) {
+		ssize_t n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+		if(n < 0 && EINTR == errno) continue;
+		if(n <= 0) return; //Resumed on EPOLLOUT, or the read fails
+		c->woff += n;
+	}
+	c->woff = c->wlen = 0;
+}
+
+static void stub_close(stub_t* s, stub_conn_t* c) {
+	if(c->closed) return;
+	epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->closed = 1;
+	__sync_fetch_and_sub(&s->conns, 1);
+}
+
+static void stub_free(stub_conn_t* c) {
+	free(c->rbuf);
+	free(c->wbuf);
+	free(c);
+}
+
+static void stub_respond(stub_t* s, stub_response_t* r) {
+	stub_conn_t* c = r->conn;
+	char hdr[8];
+	char head[64];
+	int hlen = snprintf(head, sizeof(head), "Content-type: text/plain\r\n\r\n#%llu ", (unsigned long long)r->seq);
+	size_t body = s->size > (size_t)hlen ? s->size : hlen;
+
+	//Output in records of up to 64KB, the last byte is a newline for framing = delimiter
+	size_t off = 0;
+	while(off < body) {
+		size_t n = body - off > BENCH_RECORD_MAX ? BENCH_RECORD_MAX : body - off;
+		bench_put_header(hdr, 6, r->id, n);
+		stub_write(c, hdr, 8);
+		size_t i = 0;
+		if(off < (size_t)hlen) {
+			size_t h = (size_t)hlen - off < n ? (size_t)hlen - off : n;
+			stub_write(c, head + off, h);
+			i = h;
+		}
+		if(n > i) stub_write(c, s->padding, n - i);
+		if(off + n == body) c->wbuf[c->wlen - 1] = '\n';
+		off += n;
+	}
+	bench_put_header(hdr, 6, r->id, 0);
+	stub_write(c, hdr, 8);
+
+	char end[16];
+	bench_put_header(end, 3, r->id, 8);
+	memset(end + 8, 0, 8);
+	stub_write(c, end, 16);
+	stub_flush(c);
+}
+
+static void stub_values(stub_conn_t* c, int mpxs) {
+	char rec[64];
+	char v[8];
+	snprintf(v, sizeof(v), "%d", mpxs);
+	size_t n = bench_put_pair(rec + 8, "FCGI_MPXS_CONNS", v);
+	snprintf(v, sizeof(v), "%d", BENCH_STUB_MAX_REQS);
+	n += bench_put_pair(rec + 8 + n, "FCGI_MAX_REQS", v);
+	bench_put_header(rec, 10, 0, n);
+	stub_write(c, rec, 8 + n);
+	stub_flush(c);
+}
+
+static void stub_record(stub_t* s, stub_conn_t* c, int type, int id, const char* p, size_t len) {
+	if(9 == type) {
+		stub_values(c, s->mpxs);
+		return;
+	}
+	if(id <= 0 || id > BENCH_STUB_MAX_REQS) return;
+
+	if(1 == type) {
+		c->found[id] = 0;
+		c->seq[id] = 0;
+	} else if(5 == type && len && !c->found[id]) {
+		//The message starts with #<seq>, it is at the end of an envelope
+		const char* h = (const char*)memrchr(p, '#', len);
+		if(h) {
+			c->seq[id] = strtoull(h + 1, NULL, 10);
+			c->found[id] = 1;
+		}
+	} else if(5 == type && !len) {
+		stub_response_t r;
+		r.due = bench_usec() + s->service_usec;
+		r.conn = c;
+		r.id = id;
+		r.seq = c->seq[id];
+		c->pending++;
+		stub_heap_push(s, r);
+	}
+}
+
+static void stub_read(stub_t* s, stub_conn_t* c) {
+	while(1) {
+		stub_reserve(&c->rbuf, &c->rcap, c->rlen + 65536);
+		ssize_t n = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+		if(n < 0 && EINTR == errno) continue;
+		if(n < 0 && EAGAIN == errno) break;
+		if(n <= 0) {
+			stub_close(s, c);
+			return;
+		}
+		c->rlen += n;
+
+		size_t off = 0;
+		while(c->rlen - off >= 8) {
+			const unsigned char* h = (const unsigned char*)c->rbuf + off;
+			size_t clen = (h[4] << 8) | h[5];
+			size_t total = 8 + clen + h[6];
+			if(c->rlen - off < total) break;
+			stub_record(s, c, h[1], (h[2] << 8) | h[3], (const char*)h + 8, clen);
+			off += total;
+		}
+		memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+		c->rlen -= off;
+	}
+}
+
+static void* stub_thread(void* arg) {
+	stub_t* s = (stub_t*)arg;
+	struct epoll_event events[BENCH_STUB_MAX_EVENTS];
+
+	while(s->running) {
+		int timeout = 10;
+		if(s->nheap) {
+			uint64_t now = bench_usec();
+			timeout = s->heap[0].due > now ? (int)((s->heap[0].due - now + 999) / 1000) : 0;
+			if(timeout > 10) timeout = 10;
+		}
+
+		int n = epoll_wait(s->epfd, events, BENCH_STUB_MAX_EVENTS, timeout);
+		for(int i = 0; i < n; i++) {
+			if(!events[i].data.ptr) {
+				int fd;
+				while((fd = accept4(s->lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+					stub_conn_t* c = (stub_conn_t*)calloc(1, sizeof(stub_conn_t));
+					c->fd = fd;
+					struct epoll_event ev;
+					ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+					ev.data.ptr = c;
+					epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+					int conns = __sync_add_and_fetch(&s->conns, 1);
+					if(conns > s->peak_conns) s->peak_conns = conns;
+				}
+				continue;
+			}
+
+			stub_conn_t* c = (stub_conn_t*)events[i].data.ptr;
+			if(c->closed) continue;
+			if(events[i].events & EPOLLOUT) stub_flush(c);
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) stub_read(s, c);
+			if(c->closed && !c->pending) stub_free(c);
+		}
+
+		uint64_t now = bench_usec();
+		while(s->nheap && s->heap[0].due <= now) {
+			stub_response_t r = stub_heap_pop(s);
+			r.conn->pending--;
+			if(!r.conn->closed) stub_respond(s, &r);
+			else if(!r.conn->pending) stub_free(r.conn);
+		}
+	}
+
+	s->stopped = 1;
+	return NULL;
+}
+
+static int stub_start(stub_t* s, const char* path, int* port) {
+	if(path) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		unlink(path);
+		s->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if(s->lfd < 0 || bind(s->lfd, (struct sockaddr*)&sun, sizeof(sun))) return -1;
+	} else {
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		s->lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		int one = 1;
+		setsockopt(s->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		socklen_t len = sizeof(sin);
+		if(s->lfd < 0 || bind(s->lfd, (struct sockaddr*)&sin, sizeof(sin))
+				|| getsockname(s->lfd, (struct sockaddr*)&sin, &len)) return -1;
+		*port = ntohs(sin.sin_port);
+	}
+	if(listen(s->lfd, 4096)) return -1;
+
+	s->epfd = epoll_create1(0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL;
+	epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->lfd, &ev);
+
+	s->padding = (char*)malloc(BENCH_RECORD_MAX);
+	memset(s->padding, 'x', BENCH_RECORD_MAX);
+	s->running = 1;
+	mesibo_util_create_thread(stub_thread, s, 0, "bench_stub");
+	return 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Driver
+ *----------------------------------------------------------------------------*/
+static int bench_compare(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double bench_percentile(uint32_t* sorted, uint64_t n, double p) {
+	if(!n) return 0;
+	uint64_t i = (uint64_t)(p * (n - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+	for(int i = 1; i < argc; i++) {
+		char* eq = strchr(argv[i], '=');
+		if(!eq) {
+			fprintf(stderr, "usage: %s [key=value ...]\n", argv[0]);
+			return 1;
+		}
+		*eq = 0;
+		bench_set(argv[i], eq + 1);
+	}
+	bench_verbose = bench_int("verbose", 0);
+
+	long rate = bench_int("rate", 2000);
+	long duration = bench_int("duration", 5);
+	long users = bench_int("users", 100);
+	long msg = bench_int("msg", 64);
+	if(rate <= 0 || duration <= 0 || users <= 0) {
+		fprintf(stderr, "rate, duration and users must be positive\n");
+		return 1;
+	}
+
+	stub_t stub;
+	memset(&stub, 0, sizeof(stub));
+	stub.service_usec = bench_int("service", 2) * 1000;
+	stub.size = bench_int("size", 256);
+	stub.mpxs = bench_int("mpxs", 1);
+
+	int port = 0;
+	const char* path = bench_get("unix");
+	if(stub_start(&stub, path, &port)) {
+		fprintf(stderr, "unable to start the stub responder: %s\n", strerror(errno));
+		return 1;
+	}
+
+	//Module configuration, unless given
+	char portstr[16], hoststr[300];
+	snprintf(portstr, sizeof(portstr), "%d", port);
+	snprintf(hoststr, sizeof(hoststr), path ? "unix:%s" : "127.0.0.1", path);
+	if(!bench_get("host")) bench_set("host", hoststr);
+	if(!bench_get("port")) bench_set("port", portstr);
+	if(!bench_get("keepalive")) bench_set("keepalive", "1");
+	if(!bench_get("root")) bench_set("root", "/bench");
+	if(!bench_get("script")) bench_set("script", "bench.php");
+	if(!bench_get("log")) bench_set("log", "1");
+	if(bench_int("batch", 0) > 0) {
+		fprintf(stderr, "batch mode is not supported by the stub responder\n");
+		return 1;
+	}
+
+	static mesibo_module_t mod;
+	memset(&mod, 0, sizeof(mod));
+	mod.version = MESIBO_MODULE_VERSION;
+	mod.name = "fcgi";
+	mod.config = (module_config_t*)&mod; //Configuration is read through mesibo_util_getconfig
+	mod.signature = MESIBO_MODULE_SIGNATURE;
+	if(MESIBO_RESULT_OK != mesibo_module_fcgi_init(MESIBO_MODULE_VERSION, &mod, sizeof(mod))) {
+		fprintf(stderr, "module init failed\n");
+		return 1;
+	}
+	fcgi_config_t* fc = (fcgi_config_t*)mod.ctx;
+
+	bench_count = (uint64_t)rate * duration;
+	bench_sent_at = (uint64_t*)calloc(bench_count, sizeof(uint64_t));
+	bench_latency = (uint32_t*)calloc(bench_count, sizeof(uint32_t));
+	char* message = (char*)malloc(msg + 32);
+	if(!bench_sent_at || !bench_latency || !message) return 1;
+
+	printf("rate %ld/s for %lds, %ld users, message %ld bytes, service %llums, response %zu bytes, %s\n",
+			rate, duration, users, msg, (unsigned long long)stub.service_usec / 1000, stub.size,
+			fc->client ? "native client" : "mesibo_util_fcgi");
+
+	//Open loop, each message is sent at its own time whether or not earlier ones were answered
+	uint64_t start = bench_usec();
+	for(uint64_t i = 0; i < bench_count; i++) {
+		uint64_t at = start + i * 1000000 / rate;
+		uint64_t now = bench_usec();
+		if(at > now) usleep(at - now);
+
+		char from[32];
+		snprintf(from, sizeof(from), "user-%llu", (unsigned long long)(i % users));
+		int n = snprintf(message, msg + 32, "#%llu ", (unsigned long long)i);
+		if(n < msg) {
+			memset(message + n, 'm', msg - n);
+			n = msg;
+		}
+
+		mesibo_message_params_t p;
+		memset(&p, 0, sizeof(p));
+		p.from = from;
+		p.to = (char*)"bench";
+		p.id = (mesibo_uint_t)i;
+		bench_sent_at[i] = bench_usec();
+		mod.on_message(&mod, &p, message, n);
+	}
+	uint64_t sent_usec = bench_usec() - start;
+
+	//Wait for the replies, at most 5s after the last message
+	uint64_t deadline = bench_usec() + 5000000;
+	while(bench_replies < bench_count && bench_usec() < deadline)
+		usleep(1000);
+	uint64_t elapsed = bench_usec() - start;
+
+	fcgi_client_stats_t stats;
+	memset(&stats, 0, sizeof(stats));
+	if(fc->client) fcgi_client_stats(fc->client, &stats);
+	int open_conns = stub.conns;
+
+	uint64_t replies = bench_replies;
+	uint32_t* sorted = (uint32_t*)malloc((replies ? replies : 1) * sizeof(uint32_t));
+	uint64_t n = 0;
+	for(uint64_t i = 0; i < bench_count && n < replies; i++)
+		if(bench_latency[i]) sorted[n++] = bench_latency[i];
+	qsort(sorted, n, sizeof(uint32_t), bench_compare);
+
+	printf("sent %llu in %.2fs (%.0f/s), replied %llu (%.0f/s), missing %llu\n",
+			(unsigned long long)bench_count, sent_usec / 1e6, bench_count * 1e6 / sent_usec,
+			(unsigned long long)n, n * 1e6 / elapsed, (unsigned long long)(bench_count - n));
+	printf("latency ms: p50 %.2f p99 %.2f p999 %.2f max %.2f\n", bench_percentile(sorted, n, 0.5),
+			bench_percentile(sorted, n, 0.99), bench_percentile(sorted, n, 0.999), n ? sorted[n - 1] / 1000.0 : 0);
+	printf("connections: open %d, peak %d (stub)\n", open_conns, stub.peak_conns);
+	printf("per message: reply %.0f bytes, copied %.0f bytes (module %.0f, mesibo %.0f)",
+			(double)bench_reply_bytes / bench_count, (double)(bench_copied + stats.bytes_copied) / bench_count,
+			(double)stats.bytes_copied / bench_count, (double)bench_copied / bench_count);
+	if(fc->client)
+		printf(", sent %.0f bytes, received %.0f bytes", (double)stats.bytes_sent / bench_count,
+				(double)stats.bytes_received / bench_count);
+	printf("\n");
+
+	mod.on_cleanup(&mod);
+	stub.running = 0;
+	while(!stub.stopped) usleep(1000);
+	if(path) unlink(path);
+	return 0;
+}
@@ -50,7 +50,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
 #include "module.h"
+#include "byte_buffer.h"
+#include "json_writer.h"
+#include "timer_wheel.h"
+#include "fcgi_client.h"
+
+#define FCGI_BATCH_NDJSON 		0 	//One JSON object per line
+#define FCGI_BATCH_LENGTH 		1 	//Length prefixed binary records
+#define FCGI_TIMER_TICK_USEC 		1000
+
+#define FCGI_FRAME_NONE 		0 	//Each chunk of the output is a reply
+#define FCGI_FRAME_DELIMITER 		1 	//Replies are separated by a delimiter
+#define FCGI_FRAME_LENGTH 		2 	//Each reply is prefixed with its length
+#define FCGI_DEFAULT_MAX_FRAME 		1048576 	//Larger frames fail the request
+
+#define FCGI_CONV_BUCKETS 		4096 	//Hash table of conversations, in ordered mode
+
+#define FCGI_ENVELOPE_VERSION 		1
+#define FCGI_ENVELOPE_POOL 		16 	//Envelope buffers kept for reuse
+#define FCGI_ENVELOPE_KEEP 		65536 	//Larger buffers are not kept
 
 
 /**
@@ -64,6 +85,44 @@ typedef struct fcgi_config_s{
         const char* root;
         const char* script;
 	mesibo_uint_t log;
+
+	//Native client, used instead of mesibo_util_fcgi if pool is configured
+	mesibo_int_t pool;
+	mesibo_int_t multiplex;
+	mesibo_int_t max_requests;
+	const char* backends; //host:port [weight], unix:/path [weight], ...
+	double load_factor; //Bound on a backend's share of the in-flight requests, 0 to disable
+	fcgi_client_t* client;
+	fcgi_params_t* params; //Encoded once from root and script
+
+	//Batch mode, messages to the same backend within the window are sent as one request
+	mesibo_int_t batch; //window, ms. 0 to disable
+	mesibo_int_t batch_max; //max messages in a batch
+	int batch_format;
+	struct fcgi_batch_s* batches; //Open batches, one per backend
+	pthread_mutex_t batch_lock;
+	timer_wheel_t* timers;
+
+	//Splits the script output into one reply per frame
+	int framing;
+	char* delimiter;
+	size_t delimiter_len;
+	size_t max_frame;
+
+	mesibo_uint_t timeout; //ms, requests still running are aborted
+	const char* timeout_message; //Sent to the user if the request timed out
+
+	//Replies of a conversation are sent in the order of the messages
+	int ordered;
+	mesibo_uint_t order_wait; //ms, max time replies are held for an earlier request
+	struct fcgi_conv_s** convs;
+	pthread_mutex_t order_lock;
+
+	//The body is the message parameters and the message, in a binary envelope
+	int envelope;
+	byte_buffer_t* envelopes[FCGI_ENVELOPE_POOL];
+	int nenvelopes;
+	pthread_mutex_t envelope_lock;
 } fcgi_config_t;
 
 //For logging-errors and exceptions
@@ -73,8 +132,60 @@ typedef struct fcgi_config_s{
 typedef struct fcgi_context_s {
         mesibo_module_t *mod;
 	mesibo_message_params_t params;
+	byte_buffer_t frame; //Incomplete frame carried over to the next chunk
+	int frame_error; //A frame was larger than max_frame, the rest of the output is dropped
+	char* body; //Copy of the request body for mesibo_util_fcgi, which does not copy it
+	mesibo_int_t replies;
+
+	//Ordered mode
+	struct fcgi_conv_s* conv;
+	struct fcgi_context_s* next; //Next request of the conversation
+	uint64_t seq;
+	byte_buffer_t held; //Replies waiting for the earlier requests, <length:u32> <reply>
+	int done;
 } fcgi_context_t;
 
+/**
+ * Requests from one user to one destination, in the order the messages were
+ * received. Only the replies of the first request (the head) are sent right
+ * away; the replies of the others are held until all earlier requests are
+ * complete, or the head has been waited for order_wait ms.
+ */
+typedef struct fcgi_conv_s {
+	struct fcgi_conv_s* next; //Hash chain
+	uint64_t hash;
+	fcgi_context_t* head;
+	fcgi_context_t* tail;
+	uint64_t seq;
+
+	timer_wheel_timer_t timer; //Head of line wait
+	uint64_t head_seq; //Request the timer is running for
+	mesibo_int_t deadline;
+	int armed;
+	int dead; //Freed by the timer callback, which was already running
+	mesibo_module_t *mod;
+} fcgi_conv_t;
+
+/**
+ * Messages collected for one backend request in batch mode. The body holds one
+ * record per message and the response is split back into one reply per
+ * message, using the record id (the index of the message in the batch).
+ */
+typedef struct fcgi_batch_s {
+	struct fcgi_batch_s* next; //Open batches
+	mesibo_module_t *mod;
+	fcgi_backend_t* backend;
+
+	fcgi_context_t** messages;
+	mesibo_int_t count;
+	mesibo_int_t cap;
+	json_writer_t body; //NDJSON, or binary records written to body.out in the length format
+
+	byte_buffer_t response; //Incomplete record carried over to the next chunk
+	byte_buffer_t text; //Unescaped message of an NDJSON record
+	timer_wheel_timer_t timer;
+} fcgi_batch_t;
+
 /*
  * Function: fcgi_on_cleanup
  * -----------------------------
@@ -83,6 +194,30 @@ typedef struct fcgi_context_s {
  *
  */
 static mesibo_int_t fcgi_on_cleanup(mesibo_module_t *mod) {
+	fcgi_config_t* fc = (fcgi_config_t*)mod->ctx;
+	if(!fc) return MESIBO_RESULT_OK;
+
+	//Open batches are dropped, the client fails the ones in flight
+	if(fc->timers) timer_wheel_stop(fc->timers);
+	if(fc->client) {
+		fcgi_client_destroy(fc->client);
+		fcgi_client_params_destroy(fc->params);
+		fc->client = NULL;
+		fc->params = NULL;
+	}
+
+	//Completed requests may still have used the timers
+	free(fc->timers);
+	fc->timers = NULL;
+	free(fc->convs);
+	fc->convs = NULL;
+	free(fc->delimiter);
+	fc->delimiter = NULL;
+	while(fc->nenvelopes > 0) {
+		byte_buffer_t* w = fc->envelopes[--fc->nenvelopes];
+		byte_buffer_free(w);
+		free(w);
+	}
 	return MESIBO_RESULT_OK;
 }
 
@@ -113,6 +248,299 @@ static mesibo_int_t fcgi_on_message_status(mesibo_module_t *mod, mesibo_message_
 	return MESIBO_RESULT_OK;
 }
 
+static void fcgi_conv_add(fcgi_config_t* fc, fcgi_context_t* b);
+
+static fcgi_context_t* fcgi_create_context(mesibo_module_t *mod, mesibo_message_params_t *p) {
+	fcgi_config_t* fc = (fcgi_config_t*)mod->ctx;
+	size_t flen = strlen(p->from) + 1;
+	size_t tlen = strlen(p->to) + 1;
+
+	//from and to are stored right after the context, in the same allocation
+	fcgi_context_t* b = (fcgi_context_t*)malloc(sizeof(fcgi_context_t) + flen + tlen);
+	if(!b) return NULL;
+	b->mod = mod;
+	b->params = *p; //Copy message parmeters to fcgi call back context 
+	b->params.from = (char*)(b + 1);
+	b->params.to = b->params.from + flen;
+	memcpy(b->params.from, p->from, flen);
+	memcpy(b->params.to, p->to, tlen);
+	byte_buffer_init(&b->frame, 0);
+	b->frame_error = 0;
+	b->body = NULL;
+	b->replies = 0;
+
+	b->conv = NULL;
+	b->next = NULL;
+	byte_buffer_init(&b->held, 0);
+	b->done = 0;
+	if(fc->ordered) fcgi_conv_add(fc, b);
+	return b;
+}
+
+static void fcgi_destroy_context(fcgi_context_t *b) {
+	byte_buffer_free(&b->frame);
+	free(b->body);
+	byte_buffer_free(&b->held);
+	free(b);
+}
+
+/* Parses complete records at the start of data and returns the number of bytes consumed */
+typedef size_t (*fcgi_parser_t)(void* arg, const char* data, size_t len, int last);
+
+/**
+ * Feeds a chunk of the script output to a parser. Records are parsed straight
+ * from the chunk and only an incomplete record is copied, to carry, which is
+ * reused for the following chunks. last is set for the final, empty chunk.
+ */
+static void fcgi_parse_chunk(byte_buffer_t* carry, const char *buffer, size_t size, int last,
+		fcgi_parser_t parser, void* arg) {
+	if(carry->len) {
+		if(size) byte_buffer_append(carry, buffer, size);
+		byte_buffer_consume(carry, parser(arg, carry->buf, carry->len, last));
+	} else if(size || last) {
+		size_t used = parser(arg, buffer, size, last);
+		if(used < size) byte_buffer_append(carry, buffer + used, size - used);
+	}
+}
+
+static void fcgi_send_message(fcgi_context_t *b, const char *buffer, mesibo_int_t size) {
+	mesibo_message_params_t	np;
+	memset(&np, 0, sizeof(mesibo_message_params_t));
+	np.to = b->params.from; 
+	np.from = b->params.to; 
+	np.id = rand();
+
+	mesibo_message(b->mod, &np, buffer, size);
+}
+
+static uint32_t fcgi_get_u32(const unsigned char* p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void fcgi_put_u32(byte_buffer_t* w, uint32_t v) {
+	char b[4] = { (char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v };
+	byte_buffer_append(w, b, 4);
+}
+
+static void fcgi_put_u16(byte_buffer_t* w, uint16_t v) {
+	char b[2] = { (char)(v >> 8), (char)v };
+	byte_buffer_append(w, b, 2);
+}
+
+static uint64_t fcgi_conv_hash(const char* from, const char* to) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(const char* p = from; *p; p++) h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	h = (h ^ 0xFF) * 0x100000001b3ULL; //Separator, not valid in a user address
+	for(const char* p = to; *p; p++) h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	return h;
+}
+
+/**
+ * Conversations are matched by a 64-bit hash of from and to, a collision only
+ * orders the replies of two conversations with each other.
+ */
+static void fcgi_conv_add(fcgi_config_t* fc, fcgi_context_t* b) {
+	uint64_t hash = fcgi_conv_hash(b->params.from, b->params.to);
+
+	pthread_mutex_lock(&fc->order_lock);
+	fcgi_conv_t* conv = fc->convs[hash % FCGI_CONV_BUCKETS];
+	while(conv && conv->hash != hash) conv = conv->next;
+
+	if(!conv) {
+		conv = (fcgi_conv_t*)calloc(1, sizeof(fcgi_conv_t));
+		if(!conv) {
+			//Replies of this request are not ordered
+			pthread_mutex_unlock(&fc->order_lock);
+			return;
+		}
+		conv->hash = hash;
+		conv->mod = b->mod;
+		conv->next = fc->convs[hash % FCGI_CONV_BUCKETS];
+		fc->convs[hash % FCGI_CONV_BUCKETS] = conv;
+	}
+
+	b->conv = conv;
+	b->seq = conv->seq++;
+	if(conv->tail) conv->tail->next = b;
+	else conv->head = b;
+	conv->tail = b;
+	pthread_mutex_unlock(&fc->order_lock);
+}
+
+static void fcgi_conv_on_timer(void* data);
+
+/* Unlinks and frees a conversation without requests, must be called with the order lock held */
+static void fcgi_conv_free(fcgi_config_t* fc, fcgi_conv_t* conv) {
+	for(fcgi_conv_t** pp = &fc->convs[conv->hash % FCGI_CONV_BUCKETS]; *pp; pp = &(*pp)->next) {
+		if(*pp == conv) {
+			*pp = conv->next;
+			break;
+		}
+	}
+
+	if(conv->armed && !timer_wheel_del(fc->timers, &conv->timer)) {
+		conv->dead = 1;
+		return;
+	}
+	free(conv);
+}
+
+/**
+ * Sends the held replies of the requests at the head of a conversation, up to
+ * the first one which is not complete. Must be called with the order lock held.
+ */
+static void fcgi_conv_release(fcgi_config_t* fc, fcgi_conv_t* conv) {
+	fcgi_context_t* head;
+	while((head = conv->head)) {
+		const char* p = head->held.buf;
+		const char* end = p + head->held.len;
+		while(p < end) {
+			uint32_t len = fcgi_get_u32((const unsigned char*)p);
+			fcgi_send_message(head, p + 4, len);
+			p += 4 + len;
+		}
+		byte_buffer_reset(&head->held);
+
+		if(!head->done) break;
+		conv->head = head->next;
+		if(!conv->head) conv->tail = NULL;
+		fcgi_destroy_context(head);
+	}
+
+	if(!conv->head) {
+		fcgi_conv_free(fc, conv);
+		return;
+	}
+
+	//The new head may hold up the rest of the conversation for order_wait
+	if(conv->head->seq != conv->head_seq || !conv->armed) {
+		conv->head_seq = conv->head->seq;
+		conv->deadline = mesibo_util_usec() + (mesibo_int_t)fc->order_wait * 1000;
+		if(!conv->armed && conv->head->next) {
+			conv->armed = 1;
+			timer_wheel_add(fc->timers, &conv->timer, fc->order_wait * 1000, fcgi_conv_on_timer, conv);
+		}
+	}
+}
+
+/* Stops waiting for a request which holds up its conversation */
+static void fcgi_conv_on_timer(void* data) {
+	fcgi_conv_t* conv = (fcgi_conv_t*)data;
+	fcgi_config_t* fc = (fcgi_config_t*)conv->mod->ctx;
+
+	pthread_mutex_lock(&fc->order_lock);
+	if(conv->dead) {
+		pthread_mutex_unlock(&fc->order_lock);
+		free(conv);
+		return;
+	}
+
+	//The head has changed since the timer was armed
+	mesibo_int_t now = mesibo_util_usec();
+	if(now < conv->deadline) {
+		timer_wheel_add(fc->timers, &conv->timer, conv->deadline - now, fcgi_conv_on_timer, conv);
+		pthread_mutex_unlock(&fc->order_lock);
+		return;
+	}
+	conv->armed = 0;
+
+	fcgi_context_t* head = conv->head;
+	if(head && head->next && !head->done) {
+		mesibo_log(conv->mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi: reply to %s is late, not waiting for it\n",
+				head->params.from);
+		//Its replies are sent as they come, and the context freed once complete
+		conv->head = head->next;
+		head->conv = NULL;
+		head->next = NULL;
+		fcgi_conv_release(fc, conv);
+	} else if(head) {
+		fcgi_conv_release(fc, conv);
+	}
+	pthread_mutex_unlock(&fc->order_lock);
+}
+
+/* Sends a reply to the user who sent the request */
+static void fcgi_send_reply(fcgi_context_t *b, const char *buffer, mesibo_int_t size) {
+	fcgi_config_t* fc = (fcgi_config_t*)b->mod->ctx;
+	b->replies++;
+
+	if(!fc->ordered) {
+		fcgi_send_message(b, buffer, size);
+		return;
+	}
+
+	//Sent with the lock held, so that released replies are not overtaken
+	pthread_mutex_lock(&fc->order_lock);
+	if(!b->conv || b == b->conv->head) {
+		fcgi_send_message(b, buffer, size);
+	} else {
+		fcgi_put_u32(&b->held, size);
+		byte_buffer_append(&b->held, buffer, size);
+
+		//Start the head of line wait, if not already running
+		fcgi_conv_release(fc, b->conv);
+	}
+	pthread_mutex_unlock(&fc->order_lock);
+}
+
+/* Frees the context of a completed request, once its replies have been sent */
+static void fcgi_context_done(fcgi_context_t *b) {
+	fcgi_config_t* fc = (fcgi_config_t*)b->mod->ctx;
+	if(!fc->ordered) {
+		fcgi_destroy_context(b);
+		return;
+	}
+
+	pthread_mutex_lock(&fc->order_lock);
+	if(!b->conv) {
+		fcgi_destroy_context(b);
+	} else {
+		b->done = 1;
+		fcgi_conv_release(fc, b->conv);
+	}
+	pthread_mutex_unlock(&fc->order_lock);
+}
+
+/* Sends each complete frame as a reply */
+static size_t fcgi_frame_parse(void* arg, const char* data, size_t len, int last) {
+	fcgi_context_t *b = (fcgi_context_t*)arg;
+	fcgi_config_t* fc = (fcgi_config_t*)b->mod->ctx;
+	size_t off = 0;
+
+	if(FCGI_FRAME_LENGTH == fc->framing) {
+		// <length:u32> <reply>
+		while(len - off >= 4) {
+			uint32_t flen = fcgi_get_u32((const unsigned char*)data + off);
+			if(flen > fc->max_frame) {
+				b->frame_error = 1;
+				return len;
+			}
+			if(len - off - 4 < flen) break;
+			fcgi_send_reply(b, data + off + 4, flen);
+			off += 4 + flen;
+		}
+		return off;
+	}
+
+	// <reply> <delimiter>, the delimiter is optional after the last reply
+	while(off < len) {
+		const char* d = (const char*)memmem(data + off, len - off, fc->delimiter, fc->delimiter_len);
+		if(!d) {
+			if(!last) {
+				if(len - off > fc->max_frame) {
+					b->frame_error = 1;
+					return len;
+				}
+				break;
+			}
+			d = data + len;
+		}
+		if(d > data + off) fcgi_send_reply(b, data + off, d - data - off);
+		off = d - data + (d < data + len ? fc->delimiter_len : 0);
+	}
+	return off;
+}
+
 /**
  * Function: mesibo_fcgi_data_callback_
  * ------------------------------------------
@@ -125,55 +553,523 @@ mesibo_int_t mesibo_fcgi_data_callback(void *cbdata, mesibo_int_t result, const
 	mesibo_module_t *mod = b->mod;
 	fcgi_config_t* fc = (fcgi_config_t*)mod->ctx;
 	
+	if(FCGI_CLIENT_RESULT_TIMEOUT == result){
+		mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi request timed out\n");
+		if(fc->timeout_message) fcgi_send_reply(b, fc->timeout_message, strlen(fc->timeout_message));
+		fcgi_context_done(b);
+		return MESIBO_RESULT_FAIL;
+	}
+
 	if(MESIBO_RESULT_FAIL == result){
 		mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "Bad response to fcgi request\n");
+		if(fc->client) fcgi_context_done(b);
 		return MESIBO_RESULT_FAIL;
 	}
 
+	//The native client signals the end of the response with an empty buffer
+	int last = (fc->client && !buffer && !size);
+
+	if(FCGI_FRAME_NONE != fc->framing) {
+		if(!b->frame_error) {
+			fcgi_parse_chunk(&b->frame, buffer, size, last, fcgi_frame_parse, b);
+			if(b->frame_error) {
+				mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi: frame larger than %u bytes, request failed\n", 
+						(uint32_t)fc->max_frame);
+				byte_buffer_free(&b->frame);
+			}
+		}
+		int failed = b->frame_error;
+		if(last) {
+			if(b->frame.len)
+				mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi: %d bytes of incomplete frame\n", (int)b->frame.len);
+			fcgi_context_done(b);
+		}
+		return failed ? MESIBO_RESULT_FAIL : MESIBO_RESULT_OK;
+	}
+
+	if(last) {
+		fcgi_context_done(b);
+		return MESIBO_RESULT_OK;
+	}
+
 	mesibo_log(mod, fc->log, "%.*s\n", size, buffer);
 
 	//Send response to the requester
-	mesibo_message_params_t	np;
-	memset(&np, 0, sizeof(mesibo_message_params_t));
+	fcgi_send_reply(b, buffer, size);
 	
-	mesibo_message_params_t request_params = b->params;	
-	np.to =  request_params.from; 
-	np.from = request_params.to; 
-	np.id = rand();
+	return MESIBO_RESULT_OK;
+}
 
-	mesibo_message(mod, &np, buffer, size);
-	
+static void fcgi_batch_free(fcgi_batch_t* batch) {
+	for(mesibo_int_t i = 0; i < batch->count; i++)
+		fcgi_context_done(batch->messages[i]);
+	free(batch->messages);
+	json_writer_free(&batch->body);
+	byte_buffer_free(&batch->response);
+	byte_buffer_free(&batch->text);
+	free(batch);
+}
+
+static void fcgi_put_utf8(byte_buffer_t* w, uint32_t c) {
+	if(c < 0x80) {
+		byte_buffer_char(w, c);
+	} else if(c < 0x800) {
+		byte_buffer_char(w, 0xC0 | (c >> 6));
+		byte_buffer_char(w, 0x80 | (c & 0x3F));
+	} else if(c < 0x10000) {
+		byte_buffer_char(w, 0xE0 | (c >> 12));
+		byte_buffer_char(w, 0x80 | ((c >> 6) & 0x3F));
+		byte_buffer_char(w, 0x80 | (c & 0x3F));
+	} else {
+		byte_buffer_char(w, 0xF0 | (c >> 18));
+		byte_buffer_char(w, 0x80 | ((c >> 12) & 0x3F));
+		byte_buffer_char(w, 0x80 | ((c >> 6) & 0x3F));
+		byte_buffer_char(w, 0x80 | (c & 0x3F));
+	}
+}
+
+static const char* fcgi_json_skip_space(const char* p, const char* end) {
+	while(p < end && isspace((unsigned char)*p)) p++;
+	return p;
+}
+
+/* Returns a pointer past the JSON string at p, or NULL if it is not terminated */
+static const char* fcgi_json_skip_string(const char* p, const char* end) {
+	for(p++; p < end; p++) {
+		if('\\' == *p) p++;
+		else if('"' == *p) return p + 1;
+	}
+	return NULL;
+}
+
+/* Returns a pointer past the JSON value at p, or NULL if it is not complete */
+static const char* fcgi_json_skip_value(const char* p, const char* end) {
+	int depth = 0;
+	while(p < end) {
+		char c = *p;
+		if('"' == c) {
+			p = fcgi_json_skip_string(p, end);
+			if(!p) return NULL;
+			if(!depth) return p;
+			continue;
+		}
+		if('{' == c || '[' == c) {
+			depth++;
+		} else if('}' == c || ']' == c) {
+			if(!depth) return p; //End of the enclosing object
+			if(!--depth) return p + 1;
+		} else if(!depth && (',' == c || isspace((unsigned char)c))) {
+			return p;
+		}
+		p++;
+	}
+	return depth ? NULL : p;
+}
+
+/* Finds the top level "key": of the JSON object at p and returns a pointer to its value */
+static const char* fcgi_json_value(const char* p, const char* end, const char* key) {
+	size_t klen = strlen(key);
+	p = fcgi_json_skip_space(p, end);
+	if(p >= end || '{' != *p) return NULL;
+	p++;
+
+	while(1) {
+		p = fcgi_json_skip_space(p, end);
+		if(p >= end || '"' != *p) return NULL;
+		const char* k = p + 1;
+		p = fcgi_json_skip_string(p, end);
+		if(!p) return NULL;
+		int match = ((size_t)(p - 1 - k) == klen && !memcmp(k, key, klen));
+
+		p = fcgi_json_skip_space(p, end);
+		if(p >= end || ':' != *p) return NULL;
+		p = fcgi_json_skip_space(p + 1, end);
+		if(match) return p;
+
+		p = fcgi_json_skip_value(p, end);
+		if(!p) return NULL;
+		p = fcgi_json_skip_space(p, end);
+		if(p >= end || ',' != *p) return NULL;
+		p++;
+	}
+}
+
+/* Unescapes the JSON string at p into out */
+static int fcgi_json_string(const char* p, const char* end, byte_buffer_t* out) {
+	if(p >= end || '"' != *p) return -1;
+	p++;
+
+	while(p < end && '"' != *p) {
+		const char* q = p;
+		while(q < end && '"' != *q && '\\' != *q) q++;
+		byte_buffer_append(out, p, q - p);
+		p = q;
+		if(p >= end || '"' == *p) break;
+
+		if(++p >= end) return -1;
+		char c = *p++;
+		switch(c) {
+			case 'n': byte_buffer_char(out, '\n'); break;
+			case 'r': byte_buffer_char(out, '\r'); break;
+			case 't': byte_buffer_char(out, '\t'); break;
+			case 'b': byte_buffer_char(out, '\b'); break;
+			case 'f': byte_buffer_char(out, '\f'); break;
+			case 'u': {
+				if(end - p < 4) return -1;
+				char hex[5] = { p[0], p[1], p[2], p[3], 0 };
+				uint32_t cp = strtoul(hex, NULL, 16);
+				p += 4;
+				//Surrogate pair
+				if(cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && '\\' == p[0] && 'u' == p[1]) {
+					char lo[5] = { p[2], p[3], p[4], p[5], 0 };
+					uint32_t l = strtoul(lo, NULL, 16);
+					if(l >= 0xDC00 && l < 0xE000) {
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (l - 0xDC00);
+						p += 6;
+					}
+				}
+				fcgi_put_utf8(out, cp);
+				break;
+			}
+			default: byte_buffer_char(out, c); break; // " \\ /
+		}
+	}
+
+	return (p < end) ? 0 : -1;
+}
+
+/* Sends the reply of one response record to the sender of message id */
+static void fcgi_batch_reply(fcgi_batch_t* batch, uint32_t id, const char* text, size_t len) {
+	if(id >= (uint32_t)batch->count) {
+		mesibo_log(batch->mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi batch: no message with id %u\n", id);
+		return;
+	}
+	fcgi_send_reply(batch->messages[id], text, len);
+}
+
+/* Parses the complete records at the start of data, returns the number of bytes consumed */
+static size_t fcgi_batch_parse(void* arg, const char* data, size_t len, int last) {
+	fcgi_batch_t* batch = (fcgi_batch_t*)arg;
+	fcgi_config_t* fc = (fcgi_config_t*)batch->mod->ctx;
+	size_t off = 0;
+
+	if(FCGI_BATCH_LENGTH == fc->batch_format) {
+		// <id:u32> <length:u32> <message>
+		while(len - off >= 8) {
+			const unsigned char* h = (const unsigned char*)data + off;
+			uint32_t mlen = fcgi_get_u32(h + 4);
+			if(len - off - 8 < mlen) break;
+			fcgi_batch_reply(batch, fcgi_get_u32(h), data + off + 8, mlen);
+			off += 8 + mlen;
+		}
+		return off;
+	}
+
+	// {"id":<id>,"message":"<message>"}\n
+	while(off < len) {
+		const char* line = data + off;
+		const char* nl = (const char*)memchr(line, '\n', len - off);
+		if(!nl && !last) break;
+		const char* end = nl ? nl : data + len;
+
+		const char* id = fcgi_json_value(line, end, "id");
+		const char* message = fcgi_json_value(line, end, "message");
+		byte_buffer_reset(&batch->text);
+		if(id && message && !fcgi_json_string(message, end, &batch->text))
+			fcgi_batch_reply(batch, strtoul(id, NULL, 10), batch->text.buf, batch->text.len);
+		else if(end > line + 1)
+			mesibo_log(batch->mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi batch: bad record %.*s\n", (int)(end - line), line);
+
+		off = end - data + (nl ? 1 : 0);
+	}
+	return off;
+}
+
+static mesibo_int_t fcgi_batch_callback(void *cbdata, mesibo_int_t result, const char *buffer, mesibo_int_t size){
+	fcgi_batch_t* batch = (fcgi_batch_t*)cbdata;
+	fcgi_config_t* fc = (fcgi_config_t*)batch->mod->ctx;
+
+	if(FCGI_CLIENT_RESULT_TIMEOUT == result){
+		mesibo_log(batch->mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi batch of %d messages timed out\n", (int)batch->count);
+		for(mesibo_int_t i = 0; fc->timeout_message && i < batch->count; i++) {
+			if(!batch->messages[i]->replies)
+				fcgi_send_reply(batch->messages[i], fc->timeout_message, strlen(fc->timeout_message));
+		}
+		fcgi_batch_free(batch);
+		return MESIBO_RESULT_FAIL;
+	}
+
+	if(MESIBO_RESULT_FAIL == result){
+		mesibo_log(batch->mod, MODULE_LOG_LEVEL_OVERRIDE, "Bad response to fcgi batch of %d messages\n", (int)batch->count);
+		fcgi_batch_free(batch);
+		return MESIBO_RESULT_FAIL;
+	}
+
+	int last = (!buffer && !size);
+	fcgi_parse_chunk(&batch->response, buffer, size, last, fcgi_batch_parse, batch);
+
+	if(last) {
+		if(batch->response.len)
+			mesibo_log(batch->mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi batch: %d bytes of incomplete record\n", (int)batch->response.len);
+		fcgi_batch_free(batch);
+	}
+	return MESIBO_RESULT_OK;
+}
+
+static void fcgi_batch_send(fcgi_batch_t* batch) {
+	fcgi_config_t* fc = (fcgi_config_t*)batch->mod->ctx;
+	mesibo_log(batch->mod, fc->log, "fcgi batch: sending %d messages, %d bytes\n", (int)batch->count, (int)batch->body.out.len);
+
+	if(batch->body.out.error || MESIBO_RESULT_FAIL == fcgi_client_request(fc->client, batch->backend, fc->params, 
+				NULL, batch->body.out.buf, batch->body.out.len, fc->timeout, fcgi_batch_callback, batch)) {
+		mesibo_log(batch->mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi batch request failed\n");
+		fcgi_batch_free(batch);
+	}
+
+	//The batch now belongs to the callback, which may already have freed it
+}
+
+/* Unlinks an open batch, must be called with the batch lock held */
+static int fcgi_batch_close(fcgi_config_t* fc, fcgi_batch_t* batch) {
+	for(fcgi_batch_t** pp = &fc->batches; *pp; pp = &(*pp)->next) {
+		if(*pp == batch) {
+			*pp = batch->next;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void fcgi_batch_on_timer(void* data) {
+	fcgi_batch_t* batch = (fcgi_batch_t*)data;
+	fcgi_config_t* fc = (fcgi_config_t*)batch->mod->ctx;
+
+	pthread_mutex_lock(&fc->batch_lock);
+	fcgi_batch_close(fc, batch); //Already closed if it filled up while the timer was firing
+	pthread_mutex_unlock(&fc->batch_lock);
+
+	fcgi_batch_send(batch);
+}
+
+static void fcgi_batch_encode(fcgi_config_t* fc, fcgi_batch_t* batch, uint32_t id, mesibo_message_params_t *p,
+		const char *message, mesibo_uint_t len) {
+	json_writer_t* w = &batch->body;
+
+	if(FCGI_BATCH_LENGTH == fc->batch_format) {
+		// <id:u32> <from length:u16> <from> <to length:u16> <to> <length:u32> <message>
+		byte_buffer_t* out = &w->out;
+		size_t flen = strlen(p->from), tlen = strlen(p->to);
+		fcgi_put_u32(out, id);
+		fcgi_put_u16(out, flen);
+		byte_buffer_append(out, p->from, flen);
+		fcgi_put_u16(out, tlen);
+		byte_buffer_append(out, p->to, tlen);
+		fcgi_put_u32(out, len);
+		byte_buffer_append(out, message, len);
+		return;
+	}
+
+	// {"id":<id>,"from":"<from>","to":"<to>","message":"<message>"}\n
+	json_writer_object_begin(w);
+	json_writer_key(w, "id");
+	json_writer_uint(w, id);
+	json_writer_key(w, "from");
+	json_writer_cstring(w, p->from);
+	json_writer_key(w, "to");
+	json_writer_cstring(w, p->to);
+	json_writer_key(w, "message");
+	json_writer_string(w, message, len);
+	json_writer_object_end(w);
+	json_writer_char(w, '\n');
+}
+
+/**
+ * Adds a message to the open batch of its backend, opening one if needed.
+ * The batch is sent when the window expires or once it has batch_max messages.
+ */
+static mesibo_int_t fcgi_batch_add(mesibo_module_t *mod, fcgi_backend_t* backend, mesibo_message_params_t *p,
+		const char *message, mesibo_uint_t len) {
+	fcgi_config_t* fc = (fcgi_config_t*)mod->ctx;
+
+	fcgi_context_t* ctx = fcgi_create_context(mod, p);
+	if(!ctx) return MESIBO_RESULT_FAIL;
+
+	pthread_mutex_lock(&fc->batch_lock);
+	fcgi_batch_t* batch = fc->batches;
+	while(batch && batch->backend != backend) batch = batch->next;
+
+	if(!batch) {
+		batch = (fcgi_batch_t*)calloc(1, sizeof(fcgi_batch_t));
+		if(!batch) {
+			pthread_mutex_unlock(&fc->batch_lock);
+			fcgi_context_done(ctx);
+			return MESIBO_RESULT_FAIL;
+		}
+		batch->mod = mod;
+		batch->backend = backend;
+		batch->next = fc->batches;
+		fc->batches = batch;
+		timer_wheel_add(fc->timers, &batch->timer, fc->batch * 1000, fcgi_batch_on_timer, batch);
+	}
+
+	if(batch->count == batch->cap) {
+		mesibo_int_t cap = batch->cap ? batch->cap * 2 : 16;
+		fcgi_context_t** messages = (fcgi_context_t**)realloc(batch->messages, cap * sizeof(fcgi_context_t*));
+		if(!messages) {
+			pthread_mutex_unlock(&fc->batch_lock);
+			fcgi_context_done(ctx);
+			return MESIBO_RESULT_FAIL;
+		}
+		batch->messages = messages;
+		batch->cap = cap;
+	}
+
+	fcgi_batch_encode(fc, batch, batch->count, p, message, len);
+	batch->messages[batch->count++] = ctx;
+
+	//Full, send now unless the timer is already firing, in which case the timer sends it
+	int send = 0;
+	if(batch->count >= fc->batch_max) {
+		fcgi_batch_close(fc, batch);
+		send = timer_wheel_del(fc->timers, &batch->timer);
+	}
+	pthread_mutex_unlock(&fc->batch_lock);
+
+	if(send) fcgi_batch_send(batch);
 	return MESIBO_RESULT_OK;
 }
 
-static mesibo_int_t fcgi_request(mesibo_module_t *mod, mesibo_message_params_t p, 
-		char *message, mesibo_uint_t len) {
+/* Takes an envelope buffer from the pool, or allocates one */
+static byte_buffer_t* fcgi_envelope_get(fcgi_config_t* fc) {
+	byte_buffer_t* w = NULL;
+	pthread_mutex_lock(&fc->envelope_lock);
+	if(fc->nenvelopes > 0) w = fc->envelopes[--fc->nenvelopes];
+	pthread_mutex_unlock(&fc->envelope_lock);
+
+	if(!w) {
+		w = (byte_buffer_t*)malloc(sizeof(byte_buffer_t));
+		if(w) byte_buffer_init(w, 0);
+	} else {
+		byte_buffer_reset(w);
+	}
+	return w;
+}
+
+static void fcgi_envelope_put(fcgi_config_t* fc, byte_buffer_t* w) {
+	if(w->cap <= FCGI_ENVELOPE_KEEP) {
+		pthread_mutex_lock(&fc->envelope_lock);
+		if(fc->nenvelopes < FCGI_ENVELOPE_POOL) {
+			fc->envelopes[fc->nenvelopes++] = w;
+			w = NULL;
+		}
+		pthread_mutex_unlock(&fc->envelope_lock);
+	}
+
+	if(w) {
+		byte_buffer_free(w);
+		free(w);
+	}
+}
+
+/**
+ * Encodes the message parameters and the message, all integers are big-endian
+ * <version:u8> <aid:u32> <id:u32> <refid:u32> <groupid:u32> <flags:u32> <type:u32> <expiry:u32>
+ * <from length:u16> <from> <to length:u16> <to> <length:u32> <message>
+ */
+static void fcgi_envelope_encode(byte_buffer_t* w, mesibo_message_params_t *p, const char *message, mesibo_uint_t len) {
+	size_t flen = strlen(p->from), tlen = strlen(p->to);
+	if(byte_buffer_reserve(w, 1 + 7*4 + 2 + flen + 2 + tlen + 4 + len)) return;
+
+	byte_buffer_char(w, FCGI_ENVELOPE_VERSION);
+	fcgi_put_u32(w, p->aid);
+	fcgi_put_u32(w, p->id);
+	fcgi_put_u32(w, p->refid);
+	fcgi_put_u32(w, p->groupid);
+	fcgi_put_u32(w, p->flags);
+	fcgi_put_u32(w, p->type);
+	fcgi_put_u32(w, p->expiry);
+	fcgi_put_u16(w, flen);
+	byte_buffer_append(w, p->from, flen);
+	fcgi_put_u16(w, tlen);
+	byte_buffer_append(w, p->to, tlen);
+	fcgi_put_u32(w, len);
+	byte_buffer_append(w, message, len);
+}
+
+static mesibo_int_t fcgi_request(mesibo_module_t *mod, mesibo_message_params_t *p, 
+		const char *message, mesibo_uint_t len) {
 	
 	fcgi_config_t* fc = (fcgi_config_t*)mod->ctx;
         mesibo_log(mod, fc->log, "fcgi_request called %s %s\n", fc->root, fc->script);
-        	
+
+	//Requests of a user go to the same backend, to make use of its per-user caches
+	fcgi_backend_t* backend = NULL;
+	if(fc->client) {
+		backend = fcgi_client_route(fc->client, p->from, strlen(p->from), fc->load_factor);
+		if(backend && fc->batch > 0)
+			return fcgi_batch_add(mod, backend, p, message, len);
+	}
+
+	fcgi_context_t* cbdata = fcgi_create_context(mod, p);
+	if(!cbdata) return MESIBO_RESULT_FAIL;
+
+	//The body is copied, by the client or below, so the buffer goes back right after
+	byte_buffer_t* envelope = NULL;
+	const char* body = message;
+	size_t bodylen = len;
+	if(fc->envelope) {
+		envelope = fcgi_envelope_get(fc);
+		if(envelope) fcgi_envelope_encode(envelope, p, message, len);
+		if(!envelope || envelope->error) {
+			mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi: out of memory\n");
+			if(envelope) fcgi_envelope_put(fc, envelope);
+			fcgi_context_done(cbdata);
+			return MESIBO_RESULT_FAIL;
+		}
+		body = envelope->buf;
+		bodylen = envelope->len;
+	}
+
+	if(fc->client) {
+		//Static parameters are precomputed, only USER and the body are sent per request
+		mesibo_int_t rv = backend ? fcgi_client_request(fc->client, backend, fc->params, p->from,
+					body, bodylen, fc->timeout, mesibo_fcgi_data_callback, (void*)cbdata) : MESIBO_RESULT_FAIL;
+		if(envelope) fcgi_envelope_put(fc, envelope);
+		if(MESIBO_RESULT_FAIL == rv) {
+			mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi request to %s failed\n", fc->host);
+			fcgi_context_done(cbdata);
+			return MESIBO_RESULT_FAIL;
+		}
+		return MESIBO_RESULT_OK;
+	}
+
+	//mesibo_util_fcgi uses the body after it returns, so it gets a copy which lives with the context
+	cbdata->body = (char*)malloc(bodylen ? bodylen : 1);
+	if(cbdata->body) memcpy(cbdata->body, body, bodylen);
+	if(envelope) fcgi_envelope_put(fc, envelope);
+	if(!cbdata->body) {
+		mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "fcgi: out of memory\n");
+		fcgi_context_done(cbdata);
+		return MESIBO_RESULT_FAIL;
+	}
+
 	mesibo_fcgi_t req;
 	memset(&req, 0, sizeof(mesibo_fcgi_t));
-	req.USER = p.from;
-	req.DOCUMENT_ROOT = strdup(fc->root);
-	req.SCRIPT_NAME = strdup(fc->script);
-	req.body = message;
-	req.bodylen = (uint64_t)len;
-
-        mesibo_log(mod, fc->log, "Request parameters %s %s %s %s %u\n", req.USER, req.DOCUMENT_ROOT,
-		 req.SCRIPT_NAME, req.body, req.bodylen );
-	
-	fcgi_context_t* cbdata  = (fcgi_context_t*)calloc(1, sizeof(fcgi_context_t));
-	cbdata->mod = mod;
-	cbdata->params = p; //Copy message parmeters to fcgi call back context 
-	cbdata->params.from = strdup(p.from);
-	cbdata->params.to = strdup(p.to);
+	req.USER = p->from;
+	req.DOCUMENT_ROOT = (char*)fc->root;
+	req.SCRIPT_NAME = (char*)fc->script;
+	if(envelope) req.CONTENT_TYPE = (char*)"application/x-mesibo-envelope";
+	req.body = cbdata->body;
+	req.bodylen = (uint64_t)bodylen;
+
+        mesibo_log(mod, fc->log, "Request parameters %s %s %s %.*s %u\n", req.USER, req.DOCUMENT_ROOT,
+		 req.SCRIPT_NAME, (int)bodylen, req.body, req.bodylen );
 
 	mesibo_log(mod, fc->log, "Request parameter object %p\n", &req);
 	mesibo_log(mod, fc->log , "host %s, port %lld, keepalive %lld, cb %p, cbdata %p", 
 			fc->host, fc->port, fc->keepalive,
 			mesibo_fcgi_data_callback, cbdata);
-	
+
 	//Host, Port, Keepalive parmeters need to be in configuration
 	mesibo_util_fcgi(&req, fc->host, fc->port, fc->keepalive, mesibo_fcgi_data_callback , (void*)cbdata);
 
@@ -192,12 +1088,10 @@ static mesibo_int_t fcgi_request(mesibo_module_t *mod, mesibo_message_params_t p
 
 static mesibo_int_t fcgi_on_message(mesibo_module_t *mod, mesibo_message_params_t *p, char *message, mesibo_uint_t len) {
 	mesibo_log(mod, 0, "================> %s on_message called\n", mod->name);
-	mesibo_log(mod, 0, " from %s to %s id %u message %s\n", p->from, p->to, (uint32_t) p->id, message);
+	mesibo_log(mod, 0, " from %s to %s id %u message %.*s\n", p->from, p->to, (uint32_t) p->id, (int)len, message);
 	
-	mesibo_message_params_t np;
-	memset(&np, 0 ,sizeof(mesibo_message_params_t));
-	memcpy(&np, p, sizeof(mesibo_message_params_t));
-	fcgi_request(mod, np, strdup(message), len);	
+	//The message is not copied here, fcgi_request copies it when it is not sent right away
+	fcgi_request(mod, p, message, len);	
 	return MESIBO_RESULT_PASS; 
 }
 
@@ -209,20 +1103,200 @@ fcgi_config_t* get_config_fcgi(mesibo_module_t* mod){
 
         fcgi_config_t* fc = (fcgi_config_t*)calloc(1, sizeof(fcgi_config_t));
         fc->host = mesibo_util_getconfig(mod, "host");
-        fc->port = atoi(mesibo_util_getconfig(mod, "port"));
+        const char* port = mesibo_util_getconfig(mod, "port");
+        fc->port = port ? atoi(port) : 0; //Not used with unix:/path/to.sock
         fc->keepalive = atoi(mesibo_util_getconfig(mod, "keepalive"));
         fc->root = mesibo_util_getconfig(mod, "root");
 	fc->script = mesibo_util_getconfig(mod, "script");
         fc->log = atoi(mesibo_util_getconfig(mod, "log"));
+
+	//Optional, connection pool of the native client
+	const char* pool = mesibo_util_getconfig(mod, "pool");
+	fc->pool = pool ? atoi(pool) : 0;
+	const char* multiplex = mesibo_util_getconfig(mod, "multiplex");
+	fc->multiplex = (!multiplex || !strcmp(multiplex, "auto")) ? FCGI_CLIENT_MULTIPLEX_AUTO : atoi(multiplex);
+	const char* max_requests = mesibo_util_getconfig(mod, "max_requests");
+	fc->max_requests = max_requests ? atoi(max_requests) : FCGI_CLIENT_MAX_REQS;
+
+	//Optional, list of backends requests are spread across, instead of host and port
+	fc->backends = mesibo_util_getconfig(mod, "backends");
+	const char* load_factor = mesibo_util_getconfig(mod, "load_factor");
+	fc->load_factor = load_factor ? atof(load_factor) : 1.25;
+
+	//Optional, batch mode
+	const char* batch = mesibo_util_getconfig(mod, "batch");
+	fc->batch = batch ? atoi(batch) : 0;
+	const char* batch_max = mesibo_util_getconfig(mod, "batch_max");
+	fc->batch_max = batch_max ? atoi(batch_max) : 64;
+	if(fc->batch_max <= 0) fc->batch_max = 1;
+	const char* batch_format = mesibo_util_getconfig(mod, "batch_format");
+	fc->batch_format = (batch_format && !strcmp(batch_format, "length")) ? FCGI_BATCH_LENGTH : FCGI_BATCH_NDJSON;
+
+	//Optional, request deadline
+	const char* timeout = mesibo_util_getconfig(mod, "timeout");
+	fc->timeout = timeout ? atoi(timeout) : 0;
+	fc->timeout_message = mesibo_util_getconfig(mod, "timeout_message");
+
+	//Optional, replies in the order of the messages
+	const char* ordered = mesibo_util_getconfig(mod, "ordered");
+	fc->ordered = ordered ? atoi(ordered) : 0;
+	const char* order_wait = mesibo_util_getconfig(mod, "order_wait");
+	fc->order_wait = order_wait ? atoi(order_wait) : 2000;
+
+	//Optional, binary envelope with the message parameters
+	const char* envelope = mesibo_util_getconfig(mod, "envelope");
+	fc->envelope = envelope ? atoi(envelope) : 0;
+	pthread_mutex_init(&fc->envelope_lock, NULL);
+
+	//A batch has its own body format, which carries the id of each message
+	if(fc->envelope && fc->batch > 0) {
+		mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "%s : envelope is not supported in batch mode, ignoring it\n", 
+				mod->name);
+		fc->envelope = 0;
+	}
+
+	//Optional, response framing
+	const char* framing = mesibo_util_getconfig(mod, "framing");
+	fc->framing = FCGI_FRAME_NONE;
+	if(framing && !strcmp(framing, "length"))
+		fc->framing = FCGI_FRAME_LENGTH;
+	else if(framing && !strcmp(framing, "delimiter"))
+		fc->framing = FCGI_FRAME_DELIMITER;
+
+	if(FCGI_FRAME_DELIMITER == fc->framing) {
+		//\n, \r and \t may be used in the configuration, default \n
+		const char* delimiter = mesibo_util_getconfig(mod, "delimiter");
+		if(!delimiter || !*delimiter) delimiter = "\\n";
+		fc->delimiter = (char*)malloc(strlen(delimiter) + 1);
+		if(!fc->delimiter) {
+			free(fc);
+			return NULL;
+		}
+
+		size_t n = 0;
+		for(const char* d = delimiter; *d; d++) {
+			char c = *d;
+			if('\\' == c && d[1]) {
+				c = *++d;
+				if('n' == c) c = '\n';
+				else if('r' == c) c = '\r';
+				else if('t' == c) c = '\t';
+			}
+			fc->delimiter[n++] = c;
+		}
+		fc->delimiter[n] = 0;
+		fc->delimiter_len = n;
+	}
+	const char* max_frame = mesibo_util_getconfig(mod, "max_frame");
+	fc->max_frame = max_frame ? strtoul(max_frame, NULL, 10) : FCGI_DEFAULT_MAX_FRAME;
+	if(!fc->max_frame) fc->max_frame = FCGI_DEFAULT_MAX_FRAME;
+
+	//Unix domain sockets, multiple backends, batches, framing, timeouts and ordering are only supported by the native client
+	if(((fc->host && !strncmp(fc->host, "unix:", 5)) || fc->backends || fc->batch > 0 ||
+				FCGI_FRAME_NONE != fc->framing || fc->timeout || fc->ordered) && fc->pool <= 0)
+		fc->pool = 1;
+
+	if(!fc->host && !fc->backends) {
+		mesibo_log(mod, MODULE_LOG_LEVEL_OVERRIDE, "%s : Neither host nor backends configured\n", mod->name);
+		pthread_mutex_destroy(&fc->envelope_lock);
+		free(fc->delimiter);
+		free(fc);
+		return NULL;
+	}
         
 	mesibo_log(mod, fc->log, "fcgi Module Configured :host %s port %u keepalive %d"
-			" root %s script %s log %d\n",
+			" root %s script %s log %d pool %d multiplex %d max_requests %d\n",
 		       	fc->host, (uint16_t)fc->port, fc->keepalive, 
-			fc->root, fc->script, fc->log);
+			fc->root, fc->script, fc->log, fc->pool, fc->multiplex, fc->max_requests);
 
         return fc;
 }
 
+static mesibo_int_t fcgi_add_backend(mesibo_module_t *mod, fcgi_config_t* fc, const char* address, 
+		mesibo_int_t weight) {
+	fcgi_backend_config_t bc;
+	memset(&bc, 0, sizeof(bc));
+	bc.port = fc->port;
+	bc.weight = weight;
+	bc.max_conns = fc->pool;
+	bc.multiplex = fc->multiplex;
+	bc.max_reqs = fc->max_requests;
+
+	//host:port, the port is optional. [addr]:port for IPv6
+	char* host = strdup(address);
+	char* colon = strchr(host, ':');
+	if('[' == host[0] && strchr(host, ']')) {
+		char* close = strchr(host, ']');
+		if(':' == close[1]) bc.port = atoi(close + 2);
+		*close = 0;
+		memmove(host, host + 1, strlen(host));
+	} else if(strncmp(host, "unix:", 5) && colon && !strchr(colon + 1, ':')) {
+		*colon = 0;
+		bc.port = atoi(colon + 1);
+	}
+	bc.host = host;
+
+	fcgi_backend_t* backend = fcgi_client_add_backend(fc->client, &bc);
+	free(host);
+	return backend ? MESIBO_RESULT_OK : MESIBO_RESULT_FAIL;
+}
+
+static mesibo_int_t fcgi_init_client(mesibo_module_t *m, fcgi_config_t* fc) {
+	mesibo_fcgi_t script;
+	memset(&script, 0, sizeof(mesibo_fcgi_t));
+	script.DOCUMENT_ROOT = (char*)fc->root;
+	script.SCRIPT_NAME = (char*)fc->script;
+	if(fc->batch > 0)
+		script.CONTENT_TYPE = (char*)(FCGI_BATCH_LENGTH == fc->batch_format ? 
+				"application/octet-stream" : "application/x-ndjson");
+	else if(fc->envelope)
+		script.CONTENT_TYPE = (char*)"application/x-mesibo-envelope";
+	fc->params = fcgi_client_params_create(&script);
+
+	if(fc->ordered) {
+		pthread_mutex_init(&fc->order_lock, NULL);
+		fc->convs = (fcgi_conv_t**)calloc(FCGI_CONV_BUCKETS, sizeof(fcgi_conv_t*));
+		if(!fc->convs) return MESIBO_RESULT_FAIL;
+	}
+
+	if(fc->batch > 0 || fc->ordered) {
+		pthread_mutex_init(&fc->batch_lock, NULL);
+		fc->timers = (timer_wheel_t*)malloc(sizeof(timer_wheel_t));
+		if(!fc->timers) return MESIBO_RESULT_FAIL;
+		timer_wheel_init(fc->timers, FCGI_TIMER_TICK_USEC);
+		fc->timers->running = 1;
+		mesibo_util_create_thread(timer_wheel_thread, fc->timers, 0, "fcgi_timer");
+	}
+	fc->client = fcgi_client_create(m, fc->log);
+	if(!fc->params || !fc->client)
+		return MESIBO_RESULT_FAIL;
+
+	if(!fc->backends)
+		return fcgi_add_backend(m, fc, fc->host, 1);
+
+	// backends = <host:port> [weight], <unix:/path> [weight], ...
+	mesibo_int_t count = 0;
+	char* list = strdup(fc->backends);
+	char* saveptr = NULL;
+	for(char* item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)){
+		while(isspace((unsigned char)*item)) item++;
+		char* end = item;
+		while(*end && !isspace((unsigned char)*end)) end++;
+		if(end == item) continue;
+
+		mesibo_int_t weight = *end ? strtoul(end, NULL, 10) : 1;
+		*end = 0;
+		if(MESIBO_RESULT_OK != fcgi_add_backend(m, fc, item, weight ? weight : 1)) {
+			mesibo_log(m, MODULE_LOG_LEVEL_OVERRIDE, "%s : Invalid backend %s\n", m->name, item);
+			continue;
+		}
+		count++;
+	}
+	free(list);
+
+	return count ? MESIBO_RESULT_OK : MESIBO_RESULT_FAIL;
+}
+
 /* 
  * Function: mesibo_module_fcgi_init 
  * -------------------------------------
@@ -243,6 +1317,12 @@ int mesibo_module_fcgi_init(mesibo_int_t version, mesibo_module_t *m, mesibo_uin
 			return MESIBO_RESULT_FAIL;
 		}
 		m->ctx = (void* )fc;
+
+		if(fc->pool > 0 && MESIBO_RESULT_OK != fcgi_init_client(m, fc)) {
+			mesibo_log(m, MODULE_LOG_LEVEL_OVERRIDE, "%s : Unable to create fcgi client\n", m->name);
+			fcgi_on_cleanup(m);
+			return MESIBO_RESULT_FAIL;
+		}
 	}
 
 	m->flags = 0;
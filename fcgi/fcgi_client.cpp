@@ -0,0 +1,1384 @@
+/**
+ * File: fcgi_client.cpp
+ * Description: Module-native FastCGI client
+ *
+ * Each backend has a bounded pool of persistent (FCGI_KEEP_CONN) connections.
+ * A request goes to an idle connection, else to a new connection while the pool
+ * is not full, else - if the backend supports FCGI_MPXS_CONNS - to the least
+ * loaded connection. Otherwise it waits in the backend queue until a
+ * connection becomes free.
+ *
+ * The records of a request (BEGIN_REQUEST, PARAMS, STDIN) are queued on the
+ * connection as iovecs pointing at the request's own buffers and sent with a
+ * single writev, together with whatever else is pending on that connection.
+ * Responses are read by one epoll thread per client, which is also the only
+ * thread that frees requests and connections.
+ *
+ * A backend is either host and port (TCP) or unix:/path/to.sock (AF_UNIX).
+ *
+ * Requests with a timeout are tracked in a timer wheel advanced by the client
+ * thread. An expired request is failed right away and FCGI_ABORT_REQUEST is
+ * sent. A connection which is not multiplexed is closed to free it for the
+ * next request, a multiplexed one is closed only if the backend does not end
+ * the aborted request within another timeout.
+ *
+ * With several backends, requests are routed by key (the sender) on a
+ * consistent hash ring with virtual nodes, so that a user keeps hitting the
+ * same backend and its caches. To keep hot keys from overloading a backend, the
+ * ring is walked past backends whose in-flight requests exceed load_factor
+ * times their weighted share ("Consistent Hashing with Bounded Loads",
+ * Mirrokni et al).
+ *
+ * FastCGI Specification
+ * https://fastcgi-archives.github.io/FastCGI_Specification.html
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "timer_wheel.h"
+#include "fcgi_client.h"
+
+#define FCGI_VERSION_1 			1
+#define FCGI_HEADER_LEN 		8
+#define FCGI_MAX_CONTENT 		65535
+
+#define FCGI_BEGIN_REQUEST 		1
+#define FCGI_ABORT_REQUEST 		2
+#define FCGI_END_REQUEST 		3
+#define FCGI_PARAMS 			4
+#define FCGI_STDIN 			5
+#define FCGI_STDOUT 			6
+#define FCGI_STDERR 			7
+#define FCGI_GET_VALUES 		9
+#define FCGI_GET_VALUES_RESULT 		10
+
+#define FCGI_RESPONDER 			1
+#define FCGI_KEEP_CONN 			1
+
+#define FCGI_REQUEST_COMPLETE 		0
+#define FCGI_CANT_MPX_CONN 		1
+
+#define FCGI_CLIENT_TICK_MS 		10 		//epoll timeout, to check for stop
+#define FCGI_CLIENT_DOWN_USEC 		1000000 	//Backoff after a failed connect
+#define FCGI_CLIENT_READ_SIZE 		16384 		//Free space kept in the read buffer
+#define FCGI_CLIENT_SPILL_SIZE 		65536 		//readv overflow, on stack
+#define FCGI_CLIENT_UNIX_PREFIX 	"unix:"
+#define FCGI_CLIENT_VNODES 		160 		//Points on the hash ring per unit of weight
+
+#ifndef IOV_MAX
+#define IOV_MAX 			1024
+#endif
+#define FCGI_CLIENT_MAX_EVENTS 		64
+
+typedef struct fcgi_buf_s {
+	char *data;
+	size_t len;
+	size_t cap;
+} fcgi_buf_t;
+
+typedef struct fcgi_conn_s fcgi_conn_t;
+
+typedef struct fcgi_req_s {
+	struct fcgi_req_s *next; //Backend wait queue or list of failed requests
+	fcgi_backend_t *backend; //Set once counted in the backend's in-flight requests
+	fcgi_conn_t *conn;
+	uint16_t id;
+
+	int newlines; //Consecutive newlines seen while skipping the CGI headers
+	int in_body; //CGI headers have been skipped
+
+	/**
+	 * BEGIN_REQUEST and the dynamic PARAMS records, followed by the headers of
+	 * the STDIN records. Encoded with request id 0 while waiting in the queue.
+	 */
+	fcgi_buf_t records;
+	size_t params_len;
+	const fcgi_params_t *params; //Static parameters
+
+	char *body; //Caller's buffer until it is copied by fcgi_req_own_body()
+	size_t bodylen;
+	int body_owned;
+	uint64_t wq_end; //Sent once the connection has written this many iovecs
+
+	uint64_t timeout; //usec, 0 if none
+	timer_wheel_timer_t timer;
+	char abort[FCGI_HEADER_LEN]; //FCGI_ABORT_REQUEST, queued from here
+
+	mesibo_fcgi_ondata_t cb;
+	void *cbdata;
+} fcgi_req_t;
+
+#define FCGI_CONN_CONNECTING 		0
+#define FCGI_CONN_READY 		1
+
+struct fcgi_conn_s {
+	fcgi_conn_t *next; //Backend connection list, then the client's closed list
+	fcgi_backend_t *backend;
+	int fd;
+	int state;
+	int probe; //Only used to send FCGI_GET_VALUES
+	int error; //Write failed, closed by the client thread
+	int closed;
+
+	fcgi_req_t *reqs[FCGI_CLIENT_MAX_REQS + 1]; //Indexed by request id
+	mesibo_int_t nreqs;
+
+	struct iovec *wq; //Pending writes, pointing at buffers owned by requests
+	size_t wq_head;
+	size_t wq_count;
+	size_t wq_cap;
+	uint64_t wq_done; //Number of iovecs written since the connection was opened
+
+	fcgi_buf_t ctl; //Records not belonging to a request (FCGI_GET_VALUES)
+	fcgi_buf_t rbuf; //Only accessed by the client thread
+};
+
+struct fcgi_backend_s {
+	fcgi_backend_t *next;
+	fcgi_client_t *client;
+	char *name; //host:port or unix:/path, for logs
+	mesibo_int_t weight;
+	volatile mesibo_int_t inflight; //Requests submitted and not yet completed
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	mesibo_int_t max_conns;
+	mesibo_int_t multiplex;
+	mesibo_int_t max_reqs;
+	int probing;
+
+	fcgi_conn_t *conns;
+	mesibo_int_t nconns; //Excluding the probe connection
+
+	fcgi_req_t *waitq;
+	fcgi_req_t *waitq_tail;
+
+	mesibo_int_t down_until;
+};
+
+typedef struct fcgi_vnode_s {
+	uint64_t point;
+	fcgi_backend_t *backend;
+} fcgi_vnode_t;
+
+struct fcgi_client_s {
+	mesibo_module_t *mod;
+	mesibo_uint_t log;
+	pthread_mutex_t lock;
+	int epfd;
+
+	fcgi_backend_t *backends;
+	fcgi_conn_t *closed; //Freed by the client thread at the end of each loop
+
+	fcgi_vnode_t *ring; //Sorted by point
+	size_t ring_len;
+	mesibo_int_t total_weight;
+	volatile mesibo_int_t inflight;
+	timer_wheel_t timers; //Request deadlines, advanced by the client thread
+	fcgi_client_stats_t stats; //Counters are updated atomically
+
+	volatile int running;
+	volatile int stopped;
+};
+
+static int fcgi_buf_reserve(fcgi_buf_t *b, size_t extra) {
+	size_t need = b->len + extra;
+	if(need <= b->cap) return 0;
+
+	size_t cap = b->cap ? b->cap : 1024;
+	while(cap < need) cap <<= 1;
+
+	char *data = (char *)realloc(b->data, cap);
+	if(!data) return -1;
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+static void fcgi_buf_free(fcgi_buf_t *b) {
+	free(b->data);
+	memset(b, 0, sizeof(fcgi_buf_t));
+}
+
+static void fcgi_put_header(char *p, int type, uint16_t id, size_t len) {
+	p[0] = FCGI_VERSION_1;
+	p[1] = type;
+	p[2] = (id >> 8) & 0xFF;
+	p[3] = id & 0xFF;
+	p[4] = (len >> 8) & 0xFF;
+	p[5] = len & 0xFF;
+	p[6] = 0; //padding
+	p[7] = 0;
+}
+
+/* Appends data as a stream of records of the given type, without the terminating empty record */
+static int fcgi_put_stream(fcgi_buf_t *b, int type, uint16_t id, const char *data, size_t len) {
+	size_t records = (len + FCGI_MAX_CONTENT - 1) / FCGI_MAX_CONTENT;
+	if(fcgi_buf_reserve(b, len + records * FCGI_HEADER_LEN)) return -1;
+
+	while(len) {
+		size_t n = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+		fcgi_put_header(b->data + b->len, type, id, n);
+		memcpy(b->data + b->len + FCGI_HEADER_LEN, data, n);
+		b->len += FCGI_HEADER_LEN + n;
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int fcgi_put_length(fcgi_buf_t *b, size_t len) {
+	if(fcgi_buf_reserve(b, 4)) return -1;
+	unsigned char *p = (unsigned char *)b->data + b->len;
+	if(len < 128) {
+		p[0] = len;
+		b->len += 1;
+		return 0;
+	}
+	p[0] = ((len >> 24) & 0x7F) | 0x80;
+	p[1] = (len >> 16) & 0xFF;
+	p[2] = (len >> 8) & 0xFF;
+	p[3] = len & 0xFF;
+	b->len += 4;
+	return 0;
+}
+
+static int fcgi_put_pair(fcgi_buf_t *b, const char *name, const char *value, size_t vlen) {
+	size_t nlen = strlen(name);
+	if(fcgi_put_length(b, nlen) || fcgi_put_length(b, vlen) || fcgi_buf_reserve(b, nlen + vlen))
+		return -1;
+	memcpy(b->data + b->len, name, nlen);
+	memcpy(b->data + b->len + nlen, value, vlen);
+	b->len += nlen + vlen;
+	return 0;
+}
+
+static size_t fcgi_get_length(const unsigned char *p, size_t avail, size_t *len) {
+	if(!avail) return 0;
+	if(p[0] < 128) {
+		*len = p[0];
+		return 1;
+	}
+	if(avail < 4) return 0;
+	*len = ((size_t)(p[0] & 0x7F) << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+	return 4;
+}
+
+/** mesibo_fcgi_t fields sent as FastCGI parameters **/
+static const struct {
+	const char *name;
+	size_t offset;
+} fcgi_fields[] = {
+#define FCGI_FIELD(f) { #f, offsetof(mesibo_fcgi_t, f) }
+	FCGI_FIELD(USER),
+	FCGI_FIELD(SCRIPT_FILENAME),
+	FCGI_FIELD(QUERY_STRING),
+	FCGI_FIELD(CONTENT_TYPE),
+	FCGI_FIELD(SCRIPT_NAME),
+	FCGI_FIELD(REQUEST_URI),
+	FCGI_FIELD(DOCUMENT_URI),
+	FCGI_FIELD(DOCUMENT_ROOT),
+	FCGI_FIELD(SERVER_PROTOCOL),
+	FCGI_FIELD(REQUEST_SCHEME),
+	FCGI_FIELD(REMOTE_ADDR),
+	FCGI_FIELD(REMOTE_PORT),
+	FCGI_FIELD(SERVER_ADDR),
+	FCGI_FIELD(SERVER_PORT),
+	FCGI_FIELD(SERVER_NAME),
+	FCGI_FIELD(HTTP_HOST),
+	FCGI_FIELD(HTTP_CONNECTION),
+	FCGI_FIELD(HTTP_CACHE_CONTROL),
+	FCGI_FIELD(HTTP_UPGRADE_INSECURE_REQUESTS),
+	FCGI_FIELD(HTTP_USER_AGENT),
+	FCGI_FIELD(HTTP_ACCEPT),
+	FCGI_FIELD(HTTP_ACCEPT_ENCODING),
+	FCGI_FIELD(HTTP_ACCEPT_LANGUAGE),
+#undef FCGI_FIELD
+};
+
+/**
+ * Static parameters of a script, encoded once as a ready to send PARAMS
+ * stream. Since the request id is part of every record header, the stream is
+ * kept once per request id, so that nothing is patched per request.
+ */
+struct fcgi_params_s {
+	char *blocks; //(FCGI_CLIENT_MAX_REQS + 1) copies, block n has request id n
+	size_t len;
+};
+
+static int fcgi_put_static_params(fcgi_buf_t *b, const mesibo_fcgi_t *req) {
+	for(size_t i = 0; i < sizeof(fcgi_fields)/sizeof(fcgi_fields[0]); i++) {
+		const char *value = *(char * const *)((const char *)req + fcgi_fields[i].offset);
+		if(value && fcgi_put_pair(b, fcgi_fields[i].name, value, strlen(value)))
+			return -1;
+	}
+
+	//php-fpm needs the full path of the script
+	if(!req->SCRIPT_FILENAME && req->DOCUMENT_ROOT && req->SCRIPT_NAME) {
+		size_t rlen = strlen(req->DOCUMENT_ROOT);
+		while(rlen && req->DOCUMENT_ROOT[rlen - 1] == '/') rlen--;
+		const char *script = req->SCRIPT_NAME;
+		while(*script == '/') script++;
+
+		size_t slen = strlen(script);
+		char *path = (char *)malloc(rlen + slen + 2);
+		if(!path) return -1;
+		memcpy(path, req->DOCUMENT_ROOT, rlen);
+		path[rlen] = '/';
+		memcpy(path + rlen + 1, script, slen + 1);
+		int rv = fcgi_put_pair(b, "SCRIPT_FILENAME", path, rlen + slen + 1);
+		free(path);
+		if(rv) return -1;
+	}
+
+	if(fcgi_put_pair(b, "REQUEST_METHOD", "POST", 4)) return -1;
+	return fcgi_put_pair(b, "GATEWAY_INTERFACE", "CGI/1.1", 7);
+}
+
+fcgi_params_t *fcgi_client_params_create(const mesibo_fcgi_t *req) {
+	fcgi_buf_t pairs, stream;
+	memset(&pairs, 0, sizeof(pairs));
+	memset(&stream, 0, sizeof(stream));
+
+	fcgi_params_t *params = NULL;
+	if(fcgi_put_static_params(&pairs, req) || fcgi_put_stream(&stream, FCGI_PARAMS, 0, pairs.data, pairs.len))
+		goto done;
+
+	params = (fcgi_params_t *)calloc(1, sizeof(fcgi_params_t));
+	if(!params) goto done;
+	params->len = stream.len;
+	params->blocks = (char *)malloc((FCGI_CLIENT_MAX_REQS + 1) * stream.len);
+	if(!params->blocks) {
+		free(params);
+		params = NULL;
+		goto done;
+	}
+
+	for(uint16_t id = 0; id <= FCGI_CLIENT_MAX_REQS; id++) {
+		char *block = params->blocks + id * stream.len;
+		memcpy(block, stream.data, stream.len);
+		for(size_t off = 0; off < stream.len; ) {
+			unsigned char *p = (unsigned char *)block + off;
+			p[2] = (id >> 8) & 0xFF;
+			p[3] = id & 0xFF;
+			off += FCGI_HEADER_LEN + ((p[4] << 8) | p[5]) + p[6];
+		}
+	}
+
+done:
+	fcgi_buf_free(&pairs);
+	fcgi_buf_free(&stream);
+	return params;
+}
+
+void fcgi_client_params_destroy(fcgi_params_t *params) {
+	if(!params) return;
+	free(params->blocks);
+	free(params);
+}
+
+/**
+ * Encodes the per request records into r->records: BEGIN_REQUEST, a PARAMS
+ * record with USER and CONTENT_LENGTH and the empty PARAMS record, followed by
+ * the headers of the STDIN records. The static parameters are sent from the
+ * precomputed block, between BEGIN_REQUEST and the dynamic parameters, and the
+ * STDIN content from the caller's buffer.
+ */
+static int fcgi_encode_request(fcgi_req_t *r, uint16_t id, const char *user, size_t bodylen) {
+	fcgi_buf_t *b = &r->records;
+
+	if(fcgi_buf_reserve(b, 3*FCGI_HEADER_LEN)) return -1;
+	char *p = b->data;
+	fcgi_put_header(p, FCGI_BEGIN_REQUEST, id, 8);
+	memset(p + FCGI_HEADER_LEN, 0, 8);
+	p[FCGI_HEADER_LEN + 1] = FCGI_RESPONDER;
+	p[FCGI_HEADER_LEN + 2] = FCGI_KEEP_CONN;
+	b->len = 3*FCGI_HEADER_LEN; //Header of the dynamic PARAMS record is filled below
+
+	char clen[24];
+	int n = snprintf(clen, sizeof(clen), "%llu", (unsigned long long)bodylen);
+	if((user && fcgi_put_pair(b, "USER", user, strlen(user))) || fcgi_put_pair(b, "CONTENT_LENGTH", clen, n))
+		return -1;
+
+	size_t plen = b->len - 3*FCGI_HEADER_LEN;
+	if(plen > FCGI_MAX_CONTENT) return -1;
+	fcgi_put_header(b->data + 2*FCGI_HEADER_LEN, FCGI_PARAMS, id, plen);
+
+	size_t records = (bodylen + FCGI_MAX_CONTENT - 1) / FCGI_MAX_CONTENT;
+	if(fcgi_buf_reserve(b, (records + 2) * FCGI_HEADER_LEN)) return -1;
+	fcgi_put_header(b->data + b->len, FCGI_PARAMS, id, 0);
+	b->len += FCGI_HEADER_LEN;
+	r->params_len = b->len;
+
+	size_t left = bodylen;
+	for(size_t i = 0; i < records; i++) {
+		size_t n = left > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : left;
+		fcgi_put_header(b->data + b->len, FCGI_STDIN, id, n);
+		b->len += FCGI_HEADER_LEN;
+		left -= n;
+	}
+	fcgi_put_header(b->data + b->len, FCGI_STDIN, id, 0);
+	b->len += FCGI_HEADER_LEN;
+	return 0;
+}
+
+/* Sets the request id of records which were encoded while the request was queued */
+static void fcgi_set_request_id(fcgi_req_t *r, uint16_t id) {
+	size_t off = 0;
+	while(off < r->records.len) {
+		unsigned char *p = (unsigned char *)r->records.data + off;
+		p[2] = (id >> 8) & 0xFF;
+		p[3] = id & 0xFF;
+
+		//STDIN headers are not followed by their content
+		if(off < r->params_len) off += FCGI_HEADER_LEN + ((p[4] << 8) | p[5]) + p[6];
+		else off += FCGI_HEADER_LEN;
+	}
+}
+
+static void fcgi_req_free(fcgi_req_t *r) {
+	if(r->backend) {
+		if(r->timeout) timer_wheel_del(&r->backend->client->timers, &r->timer);
+		__sync_fetch_and_sub(&r->backend->inflight, 1);
+		__sync_fetch_and_sub(&r->backend->client->inflight, 1);
+	}
+	fcgi_buf_free(&r->records);
+	if(r->body_owned) free(r->body);
+	free(r);
+}
+
+/* Callback of requests which have already been failed, the rest of the response is dropped */
+static mesibo_int_t fcgi_req_discard(void *cbdata, mesibo_int_t result, const char *buffer, mesibo_int_t size) {
+	return MESIBO_RESULT_OK;
+}
+
+/* Calls back and frees the requests of a list, must be called without the lock */
+static void fcgi_fail_requests(fcgi_req_t *list) {
+	while(list) {
+		fcgi_req_t *r = list;
+		list = list->next;
+		r->cb(r->cbdata, MESIBO_RESULT_FAIL, NULL, 0);
+		fcgi_req_free(r);
+	}
+}
+
+static int fcgi_conn_reserve(fcgi_conn_t *c, size_t count) {
+	if(c->wq_count + count <= c->wq_cap) return 0;
+
+	//Reclaim the iovecs already written before growing
+	if(c->wq_head) {
+		memmove(c->wq, c->wq + c->wq_head, (c->wq_count - c->wq_head) * sizeof(struct iovec));
+		c->wq_count -= c->wq_head;
+		c->wq_head = 0;
+		if(c->wq_count + count <= c->wq_cap) return 0;
+	}
+
+	size_t cap = c->wq_cap ? c->wq_cap : 16;
+	while(cap < c->wq_count + count) cap <<= 1;
+
+	struct iovec *wq = (struct iovec *)realloc(c->wq, cap * sizeof(struct iovec));
+	if(!wq) return -1;
+	c->wq = wq;
+	c->wq_cap = cap;
+	return 0;
+}
+
+static void fcgi_conn_push(fcgi_conn_t *c, const char *data, size_t len, int merge) {
+	if(!len) return;
+
+	//Merge with the previous iovec if contiguous, the STDIN headers usually are
+	if(merge && c->wq_count > c->wq_head) {
+		struct iovec *last = &c->wq[c->wq_count - 1];
+		if((const char *)last->iov_base + last->iov_len == data) {
+			last->iov_len += len;
+			return;
+		}
+	}
+
+	c->wq[c->wq_count].iov_base = (void *)data;
+	c->wq[c->wq_count].iov_len = len;
+	c->wq_count++;
+}
+
+/* Queues the records of a request on the connection, must be called with the lock held */
+static int fcgi_conn_queue(fcgi_conn_t *c, fcgi_req_t *r) {
+	size_t records = (r->bodylen + FCGI_MAX_CONTENT - 1) / FCGI_MAX_CONTENT;
+	if(fcgi_conn_reserve(c, 4 + 2*records)) return -1;
+
+	const char *hdr = r->records.data + r->params_len;
+	fcgi_conn_push(c, r->records.data, 2*FCGI_HEADER_LEN, 1);
+	fcgi_conn_push(c, r->params->blocks + r->id * r->params->len, r->params->len, 0);
+	fcgi_conn_push(c, r->records.data + 2*FCGI_HEADER_LEN, r->params_len - 2*FCGI_HEADER_LEN, 0);
+	for(size_t i = 0; i < records; i++) {
+		size_t off = i * FCGI_MAX_CONTENT;
+		size_t n = r->bodylen - off > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : r->bodylen - off;
+		fcgi_conn_push(c, hdr, FCGI_HEADER_LEN, 1);
+		fcgi_conn_push(c, r->body + off, n, 0);
+		hdr += FCGI_HEADER_LEN;
+	}
+	fcgi_conn_push(c, hdr, FCGI_HEADER_LEN, 1);
+
+	r->wq_end = c->wq_done + (c->wq_count - c->wq_head);
+	return 0;
+}
+
+/* Must be called with the lock held */
+static int fcgi_conn_flush(fcgi_conn_t *c) {
+	if(c->state != FCGI_CONN_READY || c->error || c->closed) return 0;
+
+	while(c->wq_head < c->wq_count) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = c->wq + c->wq_head;
+		msg.msg_iovlen = c->wq_count - c->wq_head;
+		if(msg.msg_iovlen > IOV_MAX) msg.msg_iovlen = IOV_MAX;
+
+		//sendmsg rather than writev, for MSG_NOSIGNAL
+		ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0; //Resumed on EPOLLOUT
+		if(n <= 0) {
+			c->error = 1;
+			return -1;
+		}
+		__sync_fetch_and_add(&c->backend->client->stats.bytes_sent, n);
+
+		while(n) {
+			struct iovec *iov = &c->wq[c->wq_head];
+			if((size_t)n < iov->iov_len) {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+				break;
+			}
+			n -= iov->iov_len;
+			c->wq_head++;
+			c->wq_done++;
+		}
+	}
+
+	c->wq_head = c->wq_count = 0;
+	return 0;
+}
+
+static int fcgi_conn_probe(fcgi_conn_t *c) {
+	fcgi_buf_t values;
+	memset(&values, 0, sizeof(values));
+	if(fcgi_put_pair(&values, "FCGI_MPXS_CONNS", "", 0) || fcgi_put_pair(&values, "FCGI_MAX_REQS", "", 0)
+			|| fcgi_put_stream(&c->ctl, FCGI_GET_VALUES, 0, values.data, values.len)
+			|| fcgi_conn_reserve(c, 1)) {
+		fcgi_buf_free(&values);
+		return -1;
+	}
+	fcgi_buf_free(&values);
+	fcgi_conn_push(c, c->ctl.data, c->ctl.len, 0);
+	return 0;
+}
+
+static void fcgi_conn_free(fcgi_conn_t *c) {
+	free(c->wq);
+	fcgi_buf_free(&c->ctl);
+	fcgi_buf_free(&c->rbuf);
+	free(c);
+}
+
+/* Must be called with the lock held */
+static fcgi_conn_t *fcgi_conn_create(fcgi_backend_t *b, int probe) {
+	fcgi_client_t *client = b->client;
+
+	int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) return NULL;
+
+	if(AF_UNIX != b->addr.ss_family) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	int rv = connect(fd, (struct sockaddr *)&b->addr, b->addrlen);
+	if(rv < 0 && errno != EINPROGRESS) {
+		mesibo_log(client->mod, 0, "fcgi: connect to %s failed: %s\n", b->name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	fcgi_conn_t *c = (fcgi_conn_t *)calloc(1, sizeof(fcgi_conn_t));
+	if(!c) {
+		close(fd);
+		return NULL;
+	}
+	c->backend = b;
+	c->fd = fd;
+	c->probe = probe;
+	c->state = rv ? FCGI_CONN_CONNECTING : FCGI_CONN_READY;
+
+	if(probe && fcgi_conn_probe(c)) {
+		close(fd);
+		fcgi_conn_free(c);
+		return NULL;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if(epoll_ctl(client->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		fcgi_conn_free(c);
+		return NULL;
+	}
+
+	c->next = b->conns;
+	b->conns = c;
+	if(!probe) b->nconns++;
+	__sync_fetch_and_add(&client->stats.conns, 1);
+	return c;
+}
+
+/* Picks a connection for the next request, must be called with the lock held */
+static fcgi_conn_t *fcgi_backend_pick(fcgi_backend_t *b) {
+	fcgi_conn_t *least = NULL;
+	int multiplex = (1 == b->multiplex);
+
+	for(fcgi_conn_t *c = b->conns; c; c = c->next) {
+		if(c->probe || c->error) continue;
+		if(!c->nreqs) return c;
+		if(multiplex && c->nreqs < b->max_reqs && (!least || c->nreqs < least->nreqs))
+			least = c;
+	}
+
+	if(b->nconns < b->max_conns && b->down_until <= mesibo_util_usec()) {
+		fcgi_conn_t *c = fcgi_conn_create(b, 0);
+		if(!c) {
+			b->down_until = mesibo_util_usec() + FCGI_CLIENT_DOWN_USEC;
+			return least;
+		}
+
+		if(FCGI_CLIENT_MULTIPLEX_AUTO == b->multiplex && !b->probing) {
+			if(fcgi_conn_create(b, 1)) b->probing = 1;
+		}
+		return c;
+	}
+
+	return least;
+}
+
+/* Must be called with the lock held */
+static void fcgi_conn_assign(fcgi_conn_t *c, fcgi_req_t *r) {
+	uint16_t id = 1;
+	while(c->reqs[id]) id++;
+
+	r->id = id;
+	r->conn = c;
+	c->reqs[id] = r;
+	c->nreqs++;
+}
+
+/* Sends the queued requests to free connections, must be called with the lock held */
+static void fcgi_backend_dispatch(fcgi_backend_t *b) {
+	while(b->waitq) {
+		fcgi_conn_t *c = fcgi_backend_pick(b);
+		if(!c) return;
+
+		fcgi_req_t *r = b->waitq;
+		b->waitq = r->next;
+		if(!b->waitq) b->waitq_tail = NULL;
+		r->next = NULL;
+
+		fcgi_conn_assign(c, r);
+		fcgi_set_request_id(r, r->id);
+		if(fcgi_conn_queue(c, r)) {
+			c->error = 1; //Closed by the client thread, failing its requests
+			continue;
+		}
+		fcgi_conn_flush(c);
+	}
+}
+
+/* Unlinks and closes a connection, its requests are moved to the failed list */
+static void fcgi_conn_release(fcgi_conn_t *c, fcgi_req_t **failed) {
+	fcgi_backend_t *b = c->backend;
+	fcgi_client_t *client = b->client;
+
+	for(fcgi_conn_t **pp = &b->conns; *pp; pp = &(*pp)->next) {
+		if(*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	}
+	if(!c->probe) b->nconns--;
+	__sync_fetch_and_sub(&client->stats.conns, 1);
+
+	epoll_ctl(client->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->closed = 1;
+	c->next = client->closed;
+	client->closed = c;
+
+	for(int i = 1; i <= FCGI_CLIENT_MAX_REQS; i++) {
+		fcgi_req_t *r = c->reqs[i];
+		if(!r) continue;
+		c->reqs[i] = NULL;
+		r->next = *failed;
+		*failed = r;
+	}
+	c->nreqs = 0;
+}
+
+/**
+ * Closes a connection and fails its requests. If the connection could not be
+ * established, the backend is marked down and the queued requests fail too.
+ * Must be called with the lock held.
+ */
+static void fcgi_conn_close(fcgi_conn_t *c, int connect_failed, fcgi_req_t **failed) {
+	fcgi_backend_t *b = c->backend;
+	fcgi_client_t *client = b->client;
+
+	fcgi_conn_release(c, failed);
+
+	if(c->probe) {
+		//Connection could not be made, try again with the next new connection
+		if(connect_failed) b->probing = 0;
+		else if(FCGI_CLIENT_MULTIPLEX_AUTO == b->multiplex) {
+			mesibo_log(client->mod, client->log, "fcgi: %s did not answer FCGI_GET_VALUES, not multiplexing\n",
+					b->name);
+			b->multiplex = 0;
+		}
+		return;
+	}
+
+	if(connect_failed) {
+		mesibo_log(client->mod, 0, "fcgi: unable to connect to %s\n", b->name);
+		b->down_until = mesibo_util_usec() + FCGI_CLIENT_DOWN_USEC;
+		if(b->waitq) {
+			b->waitq_tail->next = *failed;
+			*failed = b->waitq;
+			b->waitq = b->waitq_tail = NULL;
+		}
+		return;
+	}
+
+	fcgi_backend_dispatch(b);
+}
+
+static void fcgi_on_values(fcgi_conn_t *c, const unsigned char *p, size_t len) {
+	fcgi_backend_t *b = c->backend;
+	fcgi_client_t *client = b->client;
+	mesibo_int_t multiplex = 0, max_reqs = 0;
+
+	while(len) {
+		size_t nlen, vlen, n;
+		if(!(n = fcgi_get_length(p, len, &nlen))) break;
+		p += n; len -= n;
+		if(!(n = fcgi_get_length(p, len, &vlen))) break;
+		p += n; len -= n;
+		if(nlen + vlen > len) break;
+
+		char value[16];
+		size_t l = vlen < sizeof(value) - 1 ? vlen : sizeof(value) - 1;
+		memcpy(value, p + nlen, l);
+		value[l] = 0;
+
+		if(15 == nlen && !memcmp(p, "FCGI_MPXS_CONNS", 15)) multiplex = atoi(value);
+		else if(13 == nlen && !memcmp(p, "FCGI_MAX_REQS", 13)) max_reqs = atoi(value);
+		p += nlen + vlen;
+		len -= nlen + vlen;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	b->multiplex = multiplex ? 1 : 0;
+	if(max_reqs > 0 && max_reqs < b->max_reqs) b->max_reqs = max_reqs;
+	mesibo_log(client->mod, client->log, "fcgi: %s multiplex %lld max requests %lld\n",
+			b->name, b->multiplex, b->max_reqs);
+	c->error = 1; //Done with the probe
+	pthread_mutex_unlock(&client->lock);
+}
+
+static void fcgi_req_stdout(fcgi_req_t *r, const char *data, size_t len) {
+	if(!r->in_body) {
+		size_t i = 0;
+		while(i < len && !r->in_body) {
+			char ch = data[i++];
+			if('\n' == ch) {
+				if(2 == ++r->newlines) r->in_body = 1;
+			} else if('\r' != ch) {
+				r->newlines = 0;
+			}
+		}
+		data += i;
+		len -= i;
+	}
+
+	if(len) r->cb(r->cbdata, MESIBO_RESULT_OK, data, len);
+}
+
+static void fcgi_conn_record(fcgi_conn_t *c, int type, uint16_t id, const unsigned char *p, size_t len) {
+	fcgi_backend_t *b = c->backend;
+	fcgi_client_t *client = b->client;
+	fcgi_req_t *r = NULL;
+
+	if(FCGI_GET_VALUES_RESULT == type) {
+		if(c->probe) fcgi_on_values(c, p, len);
+		return;
+	}
+
+	if(!id || id > FCGI_CLIENT_MAX_REQS) return;
+
+	pthread_mutex_lock(&client->lock);
+	r = c->reqs[id];
+	if(r && FCGI_END_REQUEST == type) {
+		c->reqs[id] = NULL;
+		c->nreqs--;
+
+		//Ended before all of it was sent, the pending iovecs still point into the request
+		if(r->wq_end > c->wq_done) c->error = 1;
+		else fcgi_backend_dispatch(b);
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	if(!r) return;
+
+	if(FCGI_STDOUT == type) {
+		fcgi_req_stdout(r, (const char *)p, len);
+	} else if(FCGI_STDERR == type) {
+		mesibo_log(client->mod, client->log, "fcgi: %.*s\n", (int)len, (const char *)p);
+	} else if(FCGI_END_REQUEST == type) {
+		int status = len >= 5 ? p[4] : -1;
+		if(FCGI_REQUEST_COMPLETE == status) {
+			r->cb(r->cbdata, MESIBO_RESULT_OK, NULL, 0);
+		} else {
+			if(FCGI_CANT_MPX_CONN == status) {
+				pthread_mutex_lock(&client->lock);
+				b->multiplex = 0;
+				pthread_mutex_unlock(&client->lock);
+			}
+			mesibo_log(client->mod, 0, "fcgi: request failed with protocol status %d\n", status);
+			r->cb(r->cbdata, MESIBO_RESULT_FAIL, NULL, 0);
+		}
+		fcgi_req_free(r);
+	}
+}
+
+/* Reads and processes the available records, returns -1 if the connection is to be closed */
+static int fcgi_conn_read(fcgi_conn_t *c) {
+	fcgi_buf_t *rb = &c->rbuf;
+	char spill[FCGI_CLIENT_SPILL_SIZE];
+
+	while(1) {
+		if(fcgi_buf_reserve(rb, FCGI_CLIENT_READ_SIZE)) return -1;
+
+		//Large responses overflow into the spill buffer instead of growing the read buffer up front
+		struct iovec iov[2];
+		iov[0].iov_base = rb->data + rb->len;
+		iov[0].iov_len = rb->cap - rb->len;
+		iov[1].iov_base = spill;
+		iov[1].iov_len = sizeof(spill);
+
+		ssize_t n = readv(c->fd, iov, 2);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if(n <= 0) return -1;
+
+		fcgi_client_stats_t *stats = &c->backend->client->stats;
+		__sync_fetch_and_add(&stats->bytes_received, n);
+		if((size_t)n <= iov[0].iov_len) {
+			rb->len += n;
+		} else {
+			size_t extra = n - iov[0].iov_len;
+			rb->len = rb->cap;
+			if(fcgi_buf_reserve(rb, extra)) return -1;
+			memcpy(rb->data + rb->len, spill, extra);
+			rb->len += extra;
+			__sync_fetch_and_add(&stats->bytes_copied, extra);
+		}
+
+		size_t off = 0;
+		while(rb->len - off >= FCGI_HEADER_LEN) {
+			const unsigned char *h = (const unsigned char *)rb->data + off;
+			size_t clen = (h[4] << 8) | h[5];
+			size_t total = FCGI_HEADER_LEN + clen + h[6];
+			if(rb->len - off < total) break;
+
+			if(FCGI_VERSION_1 != h[0]) return -1;
+			fcgi_conn_record(c, h[1], (h[2] << 8) | h[3], h + FCGI_HEADER_LEN, clen);
+			off += total;
+		}
+
+		if(off) {
+			memmove(rb->data, rb->data + off, rb->len - off);
+			rb->len -= off;
+			__sync_fetch_and_add(&stats->bytes_copied, rb->len);
+		}
+
+		if(c->error) return -1;
+	}
+}
+
+static void fcgi_conn_event(fcgi_client_t *client, fcgi_conn_t *c, uint32_t events) {
+	fcgi_req_t *failed = NULL;
+
+	pthread_mutex_lock(&client->lock);
+	if(c->closed) {
+		pthread_mutex_unlock(&client->lock);
+		return;
+	}
+
+	if(FCGI_CONN_CONNECTING == c->state) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			fcgi_conn_close(c, 1, &failed);
+			pthread_mutex_unlock(&client->lock);
+			fcgi_fail_requests(failed);
+			return;
+		}
+		if(!(events & EPOLLOUT)) {
+			pthread_mutex_unlock(&client->lock);
+			return;
+		}
+		c->state = FCGI_CONN_READY;
+	}
+
+	if(events & EPOLLOUT) fcgi_conn_flush(c);
+	int error = c->error;
+	pthread_mutex_unlock(&client->lock);
+
+	if(!error && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		error = fcgi_conn_read(c);
+
+	if(error || (events & (EPOLLHUP | EPOLLERR))) {
+		pthread_mutex_lock(&client->lock);
+		if(!c->closed) fcgi_conn_close(c, 0, &failed);
+		pthread_mutex_unlock(&client->lock);
+		fcgi_fail_requests(failed);
+	}
+}
+
+/**
+ * Closes the connections which failed outside the client thread, and fails the
+ * queued requests of backends which are down. Must be called with the lock held.
+ */
+static void fcgi_client_sweep(fcgi_client_t *client, fcgi_req_t **failed) {
+	for(fcgi_backend_t *b = client->backends; b; b = b->next) {
+		fcgi_conn_t *c = b->conns;
+		while(c) {
+			fcgi_conn_t *next = c->next;
+			if(c->error) fcgi_conn_close(c, 0, failed);
+			c = next;
+		}
+
+		if(b->nconns || !b->waitq) continue;
+
+		if(b->down_until > mesibo_util_usec()) {
+			b->waitq_tail->next = *failed;
+			*failed = b->waitq;
+			b->waitq = b->waitq_tail = NULL;
+		} else {
+			fcgi_backend_dispatch(b);
+		}
+	}
+}
+
+/* Timer callback of a request, called from the client thread */
+static void fcgi_req_expired(void *data) {
+	fcgi_req_t *r = (fcgi_req_t *)data;
+	fcgi_backend_t *b = r->backend;
+	fcgi_client_t *client = b->client;
+	fcgi_conn_t *c = r->conn;
+
+	pthread_mutex_lock(&client->lock);
+	if(!c) {
+		//Still waiting for a connection
+		fcgi_req_t **pp = &b->waitq;
+		while(*pp != r) pp = &(*pp)->next;
+		*pp = r->next;
+		b->waitq_tail = NULL;
+		for(fcgi_req_t *q = b->waitq; q; q = q->next) b->waitq_tail = q;
+		pthread_mutex_unlock(&client->lock);
+
+		mesibo_log(client->mod, 0, "fcgi: request to %s timed out in the queue\n", b->name);
+		r->cb(r->cbdata, FCGI_CLIENT_RESULT_TIMEOUT, NULL, 0);
+		fcgi_req_free(r);
+		return;
+	}
+
+	if(fcgi_req_discard == r->cb) {
+		//Aborted and not ended by the backend either
+		c->error = 1;
+		pthread_mutex_unlock(&client->lock);
+		return;
+	}
+
+	mesibo_fcgi_ondata_t cb = r->cb;
+	r->cb = fcgi_req_discard;
+
+	//Like any other record of the request, the connection is closed if the request ends before it is sent
+	if(!c->error && !fcgi_conn_reserve(c, 1)) {
+		fcgi_put_header(r->abort, FCGI_ABORT_REQUEST, r->id, 0);
+		fcgi_conn_push(c, r->abort, FCGI_HEADER_LEN, 0);
+		r->wq_end = c->wq_done + (c->wq_count - c->wq_head);
+		fcgi_conn_flush(c);
+	}
+
+	//The request is freed when it ends or the connection is closed by the sweep
+	if(1 == b->multiplex) timer_wheel_add(&client->timers, &r->timer, r->timeout, fcgi_req_expired, r);
+	else c->error = 1;
+	pthread_mutex_unlock(&client->lock);
+
+	mesibo_log(client->mod, 0, "fcgi: request %u to %s timed out\n", (unsigned)r->id, b->name);
+	cb(r->cbdata, FCGI_CLIENT_RESULT_TIMEOUT, NULL, 0);
+}
+
+static void *fcgi_client_thread(void *arg) {
+	fcgi_client_t *client = (fcgi_client_t *)arg;
+	struct epoll_event events[FCGI_CLIENT_MAX_EVENTS];
+
+	while(client->running) {
+		int n = epoll_wait(client->epfd, events, FCGI_CLIENT_MAX_EVENTS, FCGI_CLIENT_TICK_MS);
+		for(int i = 0; i < n; i++)
+			fcgi_conn_event(client, (fcgi_conn_t *)events[i].data.ptr, events[i].events);
+
+		timer_wheel_advance(&client->timers);
+
+		fcgi_req_t *failed = NULL;
+		pthread_mutex_lock(&client->lock);
+		fcgi_client_sweep(client, &failed);
+
+		//Connections closed in this loop may still have had events pending
+		fcgi_conn_t *closed = client->closed;
+		client->closed = NULL;
+		pthread_mutex_unlock(&client->lock);
+
+		fcgi_fail_requests(failed);
+		while(closed) {
+			fcgi_conn_t *c = closed;
+			closed = c->next;
+			fcgi_conn_free(c);
+		}
+	}
+
+	client->stopped = 1;
+	return NULL;
+}
+
+/* 64-bit FNV-1a with a final avalanche, so that nearby keys land far apart on the ring */
+static uint64_t fcgi_hash(const char *key, size_t len, uint64_t seed) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+	for(size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int fcgi_vnode_compare(const void *a, const void *b) {
+	uint64_t pa = ((const fcgi_vnode_t *)a)->point;
+	uint64_t pb = ((const fcgi_vnode_t *)b)->point;
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/* Adds the virtual nodes of a backend to the ring, must be called with the lock held */
+static int fcgi_ring_add(fcgi_client_t *client, fcgi_backend_t *b) {
+	size_t count = FCGI_CLIENT_VNODES * b->weight;
+	fcgi_vnode_t *ring = (fcgi_vnode_t *)realloc(client->ring, (client->ring_len + count) * sizeof(fcgi_vnode_t));
+	if(!ring) return -1;
+	client->ring = ring;
+
+	size_t nlen = strlen(b->name);
+	for(size_t i = 0; i < count; i++) {
+		fcgi_vnode_t *v = &ring[client->ring_len + i];
+		v->point = fcgi_hash(b->name, nlen, i);
+		v->backend = b;
+	}
+	client->ring_len += count;
+	client->total_weight += b->weight;
+	qsort(client->ring, client->ring_len, sizeof(fcgi_vnode_t), fcgi_vnode_compare);
+	return 0;
+}
+
+fcgi_backend_t *fcgi_client_route(fcgi_client_t *client, const char *key, size_t len, double load_factor) {
+	fcgi_backend_t *fallback = NULL;
+	mesibo_int_t now = mesibo_util_usec();
+
+	pthread_mutex_lock(&client->lock);
+	if(!client->ring_len) {
+		pthread_mutex_unlock(&client->lock);
+		return NULL;
+	}
+
+	//First point at or after the key's hash, wrapping around
+	uint64_t h = fcgi_hash(key, len, 0);
+	size_t lo = 0, hi = client->ring_len;
+	while(lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if(client->ring[mid].point < h) lo = mid + 1;
+		else hi = mid;
+	}
+
+	//In-flight requests, counting this one, a backend may have per unit of weight
+	double share = load_factor * (client->inflight + 1) / client->total_weight;
+
+	for(size_t n = 0; n < client->ring_len; n++) {
+		fcgi_backend_t *b = client->ring[(lo + n) % client->ring_len].backend;
+		if(!b->nconns && b->down_until > now) continue;
+		if(!fallback) fallback = b;
+		if(load_factor <= 0 || b->inflight < ceil(share * b->weight)) {
+			pthread_mutex_unlock(&client->lock);
+			return b;
+		}
+	}
+
+	//All backends are down or at capacity, use the key's own backend
+	if(!fallback) fallback = client->ring[lo % client->ring_len].backend;
+	pthread_mutex_unlock(&client->lock);
+	return fallback;
+}
+
+fcgi_client_t *fcgi_client_create(mesibo_module_t *mod, mesibo_uint_t log) {
+	fcgi_client_t *client = (fcgi_client_t *)calloc(1, sizeof(fcgi_client_t));
+	if(!client) return NULL;
+
+	client->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(client->epfd < 0) {
+		free(client);
+		return NULL;
+	}
+
+	client->mod = mod;
+	client->log = log;
+	pthread_mutex_init(&client->lock, NULL);
+	timer_wheel_init(&client->timers, FCGI_CLIENT_TICK_MS * 1000);
+
+	client->running = 1;
+	mesibo_util_create_thread(fcgi_client_thread, client, 0, "fcgi_client");
+	return client;
+}
+
+static int fcgi_backend_address(fcgi_client_t *client, fcgi_backend_t *b, const fcgi_backend_config_t *config) {
+	size_t plen = strlen(FCGI_CLIENT_UNIX_PREFIX);
+	if(!strncmp(config->host, FCGI_CLIENT_UNIX_PREFIX, plen)) {
+		const char *path = config->host + plen;
+		struct sockaddr_un *sun = (struct sockaddr_un *)&b->addr;
+		size_t len = strlen(path);
+		if(!len || len >= sizeof(sun->sun_path)) {
+			mesibo_log(client->mod, 0, "fcgi: invalid socket path %s\n", config->host);
+			return -1;
+		}
+
+		sun->sun_family = AF_UNIX;
+		memcpy(sun->sun_path, path, len + 1);
+		b->addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+		b->name = strdup(config->host);
+		return 0;
+	}
+
+	char port[16];
+	snprintf(port, sizeof(port), "%lld", (long long)config->port);
+
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int rv = getaddrinfo(config->host, port, &hints, &res);
+	if(rv || !res) {
+		mesibo_log(client->mod, 0, "fcgi: unable to resolve %s: %s\n", config->host, gai_strerror(rv));
+		return -1;
+	}
+
+	memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+	b->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	char name[512];
+	snprintf(name, sizeof(name), "%s:%s", config->host, port);
+	b->name = strdup(name);
+	return 0;
+}
+
+fcgi_backend_t *fcgi_client_add_backend(fcgi_client_t *client, const fcgi_backend_config_t *config) {
+	fcgi_backend_t *b = (fcgi_backend_t *)calloc(1, sizeof(fcgi_backend_t));
+	if(!b) return NULL;
+
+	if(fcgi_backend_address(client, b, config)) {
+		free(b);
+		return NULL;
+	}
+
+	b->client = client;
+	b->weight = config->weight > 0 ? config->weight : 1;
+	b->max_conns = config->max_conns > 0 ? config->max_conns : 1;
+	b->multiplex = config->multiplex;
+	b->max_reqs = config->max_reqs;
+	if(b->max_reqs <= 0 || b->max_reqs > FCGI_CLIENT_MAX_REQS) b->max_reqs = FCGI_CLIENT_MAX_REQS;
+
+	pthread_mutex_lock(&client->lock);
+	if(fcgi_ring_add(client, b)) {
+		pthread_mutex_unlock(&client->lock);
+		free(b->name);
+		free(b);
+		return NULL;
+	}
+	b->next = client->backends;
+	client->backends = b;
+	pthread_mutex_unlock(&client->lock);
+
+	mesibo_log(client->mod, client->log, "fcgi: backend %s weight %lld connections %lld multiplex %lld\n",
+			b->name, b->weight, b->max_conns, b->multiplex);
+	return b;
+}
+
+/**
+ * Copies the body of a request which could not be sent right away, so that
+ * the caller's buffer is not needed anymore. Iovecs already queued on the
+ * connection are moved to the copy. Must be called with the lock held.
+ */
+static int fcgi_req_own_body(fcgi_req_t *r) {
+	fcgi_conn_t *c = r->conn;
+	if(r->body_owned || !r->bodylen) return 0;
+	if(c && r->wq_end <= c->wq_done) return 0; //Sent
+
+	char *body = (char *)malloc(r->bodylen);
+	if(!body) return -1;
+	memcpy(body, r->body, r->bodylen);
+	__sync_fetch_and_add(&r->backend->client->stats.bytes_copied, r->bodylen);
+
+	if(c) {
+		for(size_t i = c->wq_head; i < c->wq_count; i++) {
+			char *base = (char *)c->wq[i].iov_base;
+			if(base >= r->body && base < r->body + r->bodylen)
+				c->wq[i].iov_base = body + (base - r->body);
+		}
+	}
+
+	r->body = body;
+	r->body_owned = 1;
+	return 0;
+}
+
+mesibo_int_t fcgi_client_request(fcgi_client_t *client, fcgi_backend_t *b, const fcgi_params_t *params,
+		const char *user, const char *body, size_t bodylen, mesibo_uint_t timeout,
+		mesibo_fcgi_ondata_t cb, void *cbdata) {
+	fcgi_req_t *r = (fcgi_req_t *)calloc(1, sizeof(fcgi_req_t));
+	if(!r) return MESIBO_RESULT_FAIL;
+	r->cb = cb;
+	r->cbdata = cbdata;
+	r->params = params;
+	r->body = (char *)body;
+	r->bodylen = bodylen;
+
+	//Encoded without the lock, the request id is set once a connection is assigned
+	if(fcgi_encode_request(r, 0, user, bodylen)) {
+		fcgi_req_free(r);
+		return MESIBO_RESULT_FAIL;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	if(!b->nconns && b->down_until > mesibo_util_usec()) {
+		pthread_mutex_unlock(&client->lock);
+		fcgi_req_free(r);
+		return MESIBO_RESULT_FAIL;
+	}
+
+	if(b->waitq_tail) b->waitq_tail->next = r;
+	else b->waitq = r;
+	b->waitq_tail = r;
+
+	r->backend = b;
+	__sync_fetch_and_add(&b->inflight, 1);
+	__sync_fetch_and_add(&client->inflight, 1);
+	__sync_fetch_and_add(&client->stats.requests, 1);
+
+	//Sent right away if a connection is free, else queued
+	fcgi_backend_dispatch(b);
+
+	if(fcgi_req_own_body(r)) {
+		//Out of memory, fail the connection rather than leave it pointing at the caller's buffer
+		if(r->conn) {
+			r->conn->error = 1;
+		} else {
+			fcgi_req_t **pp = &b->waitq;
+			while(*pp != r) pp = &(*pp)->next;
+			*pp = r->next;
+			b->waitq_tail = NULL;
+			for(fcgi_req_t *q = b->waitq; q; q = q->next) b->waitq_tail = q;
+			pthread_mutex_unlock(&client->lock);
+			fcgi_req_free(r);
+			return MESIBO_RESULT_FAIL;
+		}
+	}
+
+	//Armed with the lock held, as the client thread may complete and free the request once it is released
+	if(timeout) {
+		r->timeout = (uint64_t)timeout * 1000;
+		timer_wheel_add(&client->timers, &r->timer, r->timeout, fcgi_req_expired, r);
+	}
+	pthread_mutex_unlock(&client->lock);
+	return MESIBO_RESULT_OK;
+}
+
+void fcgi_client_stats(fcgi_client_t *client, fcgi_client_stats_t *stats) {
+	stats->conns = __sync_fetch_and_add(&client->stats.conns, 0);
+	stats->requests = __sync_fetch_and_add(&client->stats.requests, 0);
+	stats->bytes_sent = __sync_fetch_and_add(&client->stats.bytes_sent, 0);
+	stats->bytes_received = __sync_fetch_and_add(&client->stats.bytes_received, 0);
+	stats->bytes_copied = __sync_fetch_and_add(&client->stats.bytes_copied, 0);
+}
+
+void fcgi_client_destroy(fcgi_client_t *client) {
+	if(!client) return;
+
+	client->running = 0;
+	while(!client->stopped)
+		usleep(FCGI_CLIENT_TICK_MS * 1000);
+
+	fcgi_req_t *failed = NULL;
+	pthread_mutex_lock(&client->lock);
+	for(fcgi_backend_t *b = client->backends; b; b = b->next) {
+		while(b->conns)
+			fcgi_conn_release(b->conns, &failed);
+		if(b->waitq) {
+			b->waitq_tail->next = failed;
+			failed = b->waitq;
+			b->waitq = b->waitq_tail = NULL;
+		}
+	}
+
+	while(client->closed) {
+		fcgi_conn_t *c = client->closed;
+		client->closed = c->next;
+		fcgi_conn_free(c);
+	}
+	pthread_mutex_unlock(&client->lock);
+
+	//Requests refer to their backend until freed
+	fcgi_fail_requests(failed);
+	while(client->backends) {
+		fcgi_backend_t *b = client->backends;
+		client->backends = b->next;
+		free(b->name);
+		free(b);
+	}
+
+	free(client->ring);
+	close(client->epfd);
+	pthread_mutex_destroy(&client->lock);
+	free(client);
+}
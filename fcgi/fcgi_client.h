@@ -0,0 +1,76 @@
+/**
+ * File: fcgi_client.h
+ * Description: Module-native FastCGI client
+ *
+ * Keeps a bounded pool of persistent connections per backend. Requests are
+ * multiplexed over a connection when the backend supports FCGI_MPXS_CONNS, and
+ * all the records of a request are written with a single system call.
+ *
+ * */
+#pragma once
+
+#include "module.h"
+
+#define FCGI_CLIENT_MAX_REQS 		64 	//Max concurrent requests on a multiplexed connection
+#define FCGI_CLIENT_MULTIPLEX_AUTO 	-1 	//Query the backend using FCGI_GET_VALUES
+#define FCGI_CLIENT_RESULT_TIMEOUT 	-2 	//Callback result of a request which timed out
+
+typedef struct fcgi_client_s fcgi_client_t;
+typedef struct fcgi_backend_s fcgi_backend_t;
+typedef struct fcgi_params_s fcgi_params_t;
+
+typedef struct fcgi_client_stats_s {
+	mesibo_int_t conns; 		//Open connections, including FCGI_GET_VALUES probes
+	mesibo_uint_t requests;
+	mesibo_uint_t bytes_sent;
+	mesibo_uint_t bytes_received;
+	mesibo_uint_t bytes_copied; 	//Request bodies which could not be sent right away, and read buffer moves
+} fcgi_client_stats_t;
+
+typedef struct fcgi_backend_config_s {
+	const char* host; 		//Host name or address, or unix:/path/to.sock
+	mesibo_int_t port;
+	mesibo_int_t weight; 		//Relative share of the requests routed by fcgi_client_route
+	mesibo_int_t max_conns; 	//Size of the connection pool
+	mesibo_int_t multiplex; 	//0, 1 or FCGI_CLIENT_MULTIPLEX_AUTO
+	mesibo_int_t max_reqs; 		//Max concurrent requests per connection, if multiplexed
+} fcgi_backend_config_t;
+
+/**
+ * Static parameters of a script (DOCUMENT_ROOT, SCRIPT_NAME, SERVER_* etc.),
+ * encoded once from the non-NULL fields of req. SCRIPT_FILENAME is derived
+ * from DOCUMENT_ROOT and SCRIPT_NAME if not set. USER and body are ignored,
+ * they are passed with each request.
+ */
+fcgi_params_t* fcgi_client_params_create(const mesibo_fcgi_t* req);
+void fcgi_client_params_destroy(fcgi_params_t* params);
+
+/**
+ * The body is sent from the caller's buffer when the request can be written
+ * right away, and copied otherwise, so it need not outlive the call.
+ *
+ * The callback is called with the script output (FCGI_STDOUT without the CGI
+ * response headers) as it arrives. Once the request is complete, it is called
+ * one last time with buffer NULL and size 0. On error, it is called once with
+ * result MESIBO_RESULT_FAIL and no further calls are made.
+ *
+ * If timeout (ms) is not 0 and the request is not complete by then, it is
+ * aborted and the callback is called once with FCGI_CLIENT_RESULT_TIMEOUT.
+ *
+ * Callbacks are called from the client thread.
+ */
+fcgi_client_t* fcgi_client_create(mesibo_module_t* mod, mesibo_uint_t log);
+fcgi_backend_t* fcgi_client_add_backend(fcgi_client_t* client, const fcgi_backend_config_t* config);
+
+/**
+ * Picks the backend for a key (for example, the sender) on a consistent hash
+ * ring. Backends which are down are skipped, as are backends with more than
+ * load_factor times their share of the in-flight requests. A load_factor of 0
+ * disables the bound.
+ */
+fcgi_backend_t* fcgi_client_route(fcgi_client_t* client, const char* key, size_t len, double load_factor);
+mesibo_int_t fcgi_client_request(fcgi_client_t* client, fcgi_backend_t* backend, const fcgi_params_t* params,
+		const char* user, const char* body, size_t bodylen, mesibo_uint_t timeout,
+		mesibo_fcgi_ondata_t cb, void* cbdata);
+void fcgi_client_stats(fcgi_client_t* client, fcgi_client_stats_t* stats);
+void fcgi_client_destroy(fcgi_client_t* client);
@@ -0,0 +1,78 @@
+/**
+ * File: byte_buffer.h
+ * Description:
+ * Growable byte buffer used by modules for binary data (frames, envelopes and
+ * partial records carried over between chunks). It is also the storage core
+ * of json_writer_t.
+ *
+ * The buffer is kept NUL terminated so that text content can be used directly.
+ * It can be reset and reused without releasing memory.
+ **/
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct byte_buffer_s {
+	char *buf;
+	size_t len;
+	size_t cap;
+	int error; //set if memory allocation failed
+} byte_buffer_t;
+
+static inline void byte_buffer_reset(byte_buffer_t *b) {
+	b->len = 0;
+	b->error = 0;
+	if(b->buf) b->buf[0] = '\0';
+}
+
+static inline int byte_buffer_reserve(byte_buffer_t *b, size_t extra) {
+	if(b->error) return -1;
+	size_t need = b->len + extra + 1; // +1 to keep the buffer NUL terminated
+	if(need <= b->cap) return 0;
+
+	size_t cap = b->cap ? b->cap : 256;
+	while(cap < need) cap <<= 1;
+
+	char *buf = (char *)realloc(b->buf, cap);
+	if(!buf) {
+		b->error = 1;
+		return -1;
+	}
+	b->buf = buf;
+	b->cap = cap;
+	return 0;
+}
+
+static inline void byte_buffer_init(byte_buffer_t *b, size_t cap) {
+	memset(b, 0, sizeof(byte_buffer_t));
+	if(cap) byte_buffer_reserve(b, cap);
+	byte_buffer_reset(b);
+}
+
+static inline void byte_buffer_free(byte_buffer_t *b) {
+	free(b->buf);
+	memset(b, 0, sizeof(byte_buffer_t));
+}
+
+static inline void byte_buffer_append(byte_buffer_t *b, const void *data, size_t len) {
+	if(byte_buffer_reserve(b, len)) return;
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+	b->buf[b->len] = '\0';
+}
+
+static inline void byte_buffer_char(byte_buffer_t *b, char c) {
+	if(byte_buffer_reserve(b, 1)) return;
+	b->buf[b->len++] = c;
+	b->buf[b->len] = '\0';
+}
+
+/* Drop the first n bytes, keeping the rest */
+static inline void byte_buffer_consume(byte_buffer_t *b, size_t n) {
+	if(n > b->len) n = b->len;
+	if(!b->buf) return;
+	memmove(b->buf, b->buf + n, b->len - n);
+	b->len -= n;
+	b->buf[b->len] = '\0';
+}
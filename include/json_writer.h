@@ -0,0 +1,206 @@
+/**
+ * File: json_writer.h
+ * Description:
+ * Minimal single-pass JSON writer used by modules to build request bodies
+ * (for example, the POST data sent to Dialogflow or Google Translate).
+ *
+ * Strings are escaped while they are copied. On SSE2 capable machines, 16 bytes
+ * are scanned at a time for characters that need escaping ('"', '\\' and
+ * control characters) so that plain text is copied with a single memcpy.
+ * UTF-8 sequences are passed through unchanged, which is valid JSON.
+ *
+ * The writer owns a growable byte_buffer_t (see byte_buffer.h) which can be
+ * reset and reused without releasing memory.
+ **/
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "byte_buffer.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define JSON_WRITER_MAX_DEPTH	64
+
+typedef struct json_writer_s {
+	byte_buffer_t out;
+
+	int depth;
+	uint64_t has_items; //bit n is set if the container at depth n has at least one item
+	int after_key;
+} json_writer_t;
+
+static inline void json_writer_reset(json_writer_t *w) {
+	byte_buffer_reset(&w->out);
+	w->depth = 0;
+	w->has_items = 0;
+	w->after_key = 0;
+}
+
+static inline int json_writer_reserve(json_writer_t *w, size_t extra) {
+	return byte_buffer_reserve(&w->out, extra);
+}
+
+static inline void json_writer_init(json_writer_t *w, size_t cap) {
+	memset(w, 0, sizeof(json_writer_t));
+	byte_buffer_init(&w->out, cap);
+}
+
+static inline void json_writer_free(json_writer_t *w) {
+	byte_buffer_free(&w->out);
+	memset(w, 0, sizeof(json_writer_t));
+}
+
+/* Returns NUL terminated output, or NULL if the writer ran out of memory */
+static inline const char *json_writer_data(json_writer_t *w) {
+	if(json_writer_reserve(w, 0)) return NULL;
+	w->out.buf[w->out.len] = '\0';
+	return w->out.buf;
+}
+
+static inline void json_writer_raw(json_writer_t *w, const char *s, size_t len) {
+	byte_buffer_append(&w->out, s, len);
+}
+
+static inline void json_writer_char(json_writer_t *w, char c) {
+	byte_buffer_char(&w->out, c);
+}
+
+/* Emit the separator required before a value in the current container */
+static inline void json_writer_value_prefix(json_writer_t *w) {
+	if(w->after_key) {
+		w->after_key = 0;
+		return;
+	}
+	if(!w->depth) return;
+
+	uint64_t bit = 1ULL << (w->depth - 1);
+	if(w->has_items & bit)
+		json_writer_char(w, ',');
+	w->has_items |= bit;
+}
+
+/* Length of the prefix of s[0..len) which can be copied without escaping */
+static inline size_t json_writer_plain_span(const unsigned char *s, size_t len) {
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i ctrl_max = _mm_set1_epi8(0x1F);
+
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		// v <= 0x1F (unsigned) if max(v, 0x1F) == 0x1F
+		__m128i ctrl = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl_max), ctrl_max);
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+		int mask = _mm_movemask_epi8(_mm_or_si128(ctrl, special));
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for(; i < len; i++) {
+		unsigned char c = s[i];
+		if(c < 0x20 || c == '"' || c == '\\')
+			break;
+	}
+	return i;
+}
+
+/* Append s as a quoted and escaped JSON string */
+static inline void json_writer_string(json_writer_t *w, const char *s, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+
+	json_writer_value_prefix(w);
+
+	// Common case: nothing to escape, so reserve exactly once
+	if(json_writer_reserve(w, len + 2)) return;
+	byte_buffer_t *out = &w->out;
+	out->buf[out->len++] = '"';
+
+	const unsigned char *p = (const unsigned char *)s;
+	while(len) {
+		size_t n = json_writer_plain_span(p, len);
+		if(n) {
+			if(json_writer_reserve(w, n + 1)) return;
+			memcpy(out->buf + out->len, p, n);
+			out->len += n;
+			p += n;
+			len -= n;
+			if(!len) break;
+		}
+
+		if(json_writer_reserve(w, 6 + 1)) return;
+		char *o = out->buf + out->len;
+		unsigned char c = *p++;
+		len--;
+		switch(c) {
+			case '"':  o[0] = '\\'; o[1] = '"';  out->len += 2; break;
+			case '\\': o[0] = '\\'; o[1] = '\\'; out->len += 2; break;
+			case '\n': o[0] = '\\'; o[1] = 'n';  out->len += 2; break;
+			case '\r': o[0] = '\\'; o[1] = 'r';  out->len += 2; break;
+			case '\t': o[0] = '\\'; o[1] = 't';  out->len += 2; break;
+			case '\b': o[0] = '\\'; o[1] = 'b';  out->len += 2; break;
+			case '\f': o[0] = '\\'; o[1] = 'f';  out->len += 2; break;
+			default:
+				o[0] = '\\'; o[1] = 'u'; o[2] = '0'; o[3] = '0';
+				o[4] = hex[c >> 4]; o[5] = hex[c & 0xF];
+				out->len += 6;
+				break;
+		}
+	}
+
+	json_writer_char(w, '"');
+}
+
+static inline void json_writer_cstring(json_writer_t *w, const char *s) {
+	if(!s) {
+		json_writer_value_prefix(w);
+		json_writer_raw(w, "null", 4);
+		return;
+	}
+	json_writer_string(w, s, strlen(s));
+}
+
+/* Keys are escaped just like values */
+static inline void json_writer_key(json_writer_t *w, const char *key) {
+	json_writer_cstring(w, key);
+	json_writer_char(w, ':');
+	w->after_key = 1;
+}
+
+static inline void json_writer_uint(json_writer_t *w, uint64_t value) {
+	char tmp[24];
+	int n = 0;
+	do {
+		tmp[sizeof(tmp) - 1 - n++] = '0' + (value % 10);
+		value /= 10;
+	} while(value);
+
+	json_writer_value_prefix(w);
+	json_writer_raw(w, tmp + sizeof(tmp) - n, n);
+}
+
+static inline void json_writer_begin(json_writer_t *w, char open) {
+	json_writer_value_prefix(w);
+	json_writer_char(w, open);
+	if(w->depth >= JSON_WRITER_MAX_DEPTH) {
+		w->out.error = 1;
+		return;
+	}
+	w->depth++;
+	w->has_items &= ~(1ULL << (w->depth - 1));
+}
+
+static inline void json_writer_end(json_writer_t *w, char close) {
+	if(w->depth) w->depth--;
+	json_writer_char(w, close);
+}
+
+#define json_writer_object_begin(w)	json_writer_begin(w, '{')
+#define json_writer_object_end(w)	json_writer_end(w, '}')
+#define json_writer_array_begin(w)	json_writer_begin(w, '[')
+#define json_writer_array_end(w)	json_writer_end(w, ']')
@@ -0,0 +1,188 @@
+/**
+ * File: timer_wheel.h
+ * Description:
+ * Hierarchical timer wheel driven by a single thread.
+ *
+ * Timers are kept in four levels of 64 slots. Level 0 holds the timers which
+ * expire within the next 64 ticks, each higher level covers 64 times the range
+ * of the level below it. When the lower levels wrap around, the next slot of the
+ * higher level is cascaded down. Adding, cancelling and expiring a timer are O(1)
+ * and the thread wakes up only once per tick, however many timers are pending.
+ *
+ * Callbacks are called from the timer thread without any lock held, so they may
+ * add or cancel timers. timer_wheel_del() returns 0 if the timer has already
+ * fired (or is about to fire), in which case the owner must not free the timer
+ * until its callback has run.
+ **/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_WHEEL_MAX_TICKS	((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+typedef void (*timer_wheel_cb_t)(void *data);
+
+typedef struct timer_wheel_timer_s {
+	struct timer_wheel_timer_s *next, *prev;
+	uint64_t expires; //tick
+	timer_wheel_cb_t cb;
+	void *data;
+	int pending;
+} timer_wheel_timer_t;
+
+typedef struct timer_wheel_s {
+	pthread_mutex_t lock;
+	uint64_t tick_usec;
+	uint64_t start_usec; //monotonic time of tick 0
+	uint64_t now; //last processed tick
+	timer_wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; //list heads
+
+	volatile int running;
+	volatile int stopped;
+} timer_wheel_t;
+
+static inline uint64_t timer_wheel_usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void timer_wheel_init(timer_wheel_t *tw, uint64_t tick_usec) {
+	memset(tw, 0, sizeof(timer_wheel_t));
+	pthread_mutex_init(&tw->lock, NULL);
+	tw->tick_usec = tick_usec ? tick_usec : 1000;
+	tw->start_usec = timer_wheel_usec();
+	for(int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		for(int s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+			timer_wheel_timer_t *head = &tw->slots[l][s];
+			head->next = head->prev = head;
+		}
+	}
+}
+
+static inline void timer_wheel_unlink(timer_wheel_timer_t *t) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	t->pending = 0;
+}
+
+/* Must be called with the lock held */
+static inline void timer_wheel_place(timer_wheel_t *tw, timer_wheel_timer_t *t) {
+	uint64_t delta = t->expires - tw->now;
+	int level = 0;
+	while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	int slot = (t->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	timer_wheel_timer_t *head = &tw->slots[level][slot];
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+	t->pending = 1;
+}
+
+/* Arms (or re-arms) a timer to call cb(data) after usec microseconds */
+static inline void timer_wheel_add(timer_wheel_t *tw, timer_wheel_timer_t *t, uint64_t usec,
+		timer_wheel_cb_t cb, void *data) {
+	uint64_t ticks = (usec + tw->tick_usec - 1) / tw->tick_usec;
+	if(!ticks) ticks = 1;
+	if(ticks > TIMER_WHEEL_MAX_TICKS) ticks = TIMER_WHEEL_MAX_TICKS;
+
+	pthread_mutex_lock(&tw->lock);
+	if(t->pending) timer_wheel_unlink(t);
+	t->cb = cb;
+	t->data = data;
+	t->expires = tw->now + ticks;
+	timer_wheel_place(tw, t);
+	pthread_mutex_unlock(&tw->lock);
+}
+
+/* Returns 1 if the timer was cancelled, 0 if it was not pending */
+static inline int timer_wheel_del(timer_wheel_t *tw, timer_wheel_timer_t *t) {
+	int cancelled = 0;
+	pthread_mutex_lock(&tw->lock);
+	if(t->pending) {
+		timer_wheel_unlink(t);
+		cancelled = 1;
+	}
+	pthread_mutex_unlock(&tw->lock);
+	return cancelled;
+}
+
+static inline int timer_wheel_pending(timer_wheel_t *tw, timer_wheel_timer_t *t) {
+	pthread_mutex_lock(&tw->lock);
+	int pending = t->pending;
+	pthread_mutex_unlock(&tw->lock);
+	return pending;
+}
+
+/* Moves all timers of a higher level slot to the levels below it */
+static inline void timer_wheel_cascade(timer_wheel_t *tw, int level, int slot) {
+	timer_wheel_timer_t *head = &tw->slots[level][slot];
+	timer_wheel_timer_t *t = head->next;
+	head->next = head->prev = head;
+
+	while(t != head) {
+		timer_wheel_timer_t *next = t->next;
+		timer_wheel_place(tw, t);
+		t = next;
+	}
+}
+
+/* Processes all ticks up to the current time and runs the expired timers */
+static inline void timer_wheel_advance(timer_wheel_t *tw) {
+	uint64_t target = (timer_wheel_usec() - tw->start_usec) / tw->tick_usec;
+
+	pthread_mutex_lock(&tw->lock);
+	while(tw->now < target) {
+		tw->now++;
+
+		for(int l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+			if(tw->now & ((1ULL << (TIMER_WHEEL_BITS * l)) - 1)) continue;
+			timer_wheel_cascade(tw, l, (tw->now >> (TIMER_WHEEL_BITS * l)) & TIMER_WHEEL_MASK);
+		}
+
+		timer_wheel_timer_t *head = &tw->slots[0][tw->now & TIMER_WHEEL_MASK];
+		while(head->next != head) {
+			timer_wheel_timer_t *t = head->next;
+			timer_wheel_unlink(t);
+
+			timer_wheel_cb_t cb = t->cb;
+			void *data = t->data;
+
+			// t may be re-armed or freed by its owner once the lock is released
+			pthread_mutex_unlock(&tw->lock);
+			cb(data);
+			pthread_mutex_lock(&tw->lock);
+		}
+	}
+	pthread_mutex_unlock(&tw->lock);
+}
+
+/* Thread function, compatible with mesibo_util_create_thread. Set running before starting it */
+static inline void *timer_wheel_thread(void *arg) {
+	timer_wheel_t *tw = (timer_wheel_t *)arg;
+	while(tw->running) {
+		usleep(tw->tick_usec);
+		timer_wheel_advance(tw);
+	}
+	tw->stopped = 1;
+	return NULL;
+}
+
+static inline void timer_wheel_stop(timer_wheel_t *tw) {
+	if(!tw->running) return;
+	tw->running = 0;
+	while(!tw->stopped)
+		usleep(tw->tick_usec);
+}
@@ -54,6 +54,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "module.h"
+#include "json_writer.h"
 
 #define HTTP_BUFFER_LEN (64 * 1024)
 #define HTTP_RESPONSE_TYPE_LEN (1024)
@@ -84,7 +85,7 @@ typedef struct http_context_s {
         mesibo_message_params_t* params;
         char *from;
         char *to;
-        char* post_data; //Cleanup after HTTP request is complete
+        json_writer_t post_data; //Cleanup after HTTP request is complete
         mesibo_int_t status;
         char response_type[HTTP_RESPONSE_TYPE_LEN];
         // To copy data in response
@@ -97,7 +98,7 @@ void mesibo_translate_destroy_http_context(http_context_t* mc){
         free(mc->from);
         free(mc->to);
 	free(mc->params);
-        free(mc->post_data);
+        json_writer_free(&mc->post_data);
         free(mc);
 }
 
@@ -221,18 +222,29 @@ static int translate_process_message(mesibo_module_t *mod, mesibo_message_params
 	translate_config_t* tc = (translate_config_t*)mod->ctx;
 	const char* post_url = tc->endpoint; 
 
-	char* raw_post_data;
-	asprintf(&raw_post_data, "{\"q\":\"%.*s\", \"target\":\"%s\"}",
-			(int)len, message, tc->target);
-
 	http_context_t *http_context =
 		(http_context_t *)calloc(1, sizeof(http_context_t));
 	http_context->mod = mod;
 	http_context->params = p;
 	http_context->from = strdup(p->from);
 	http_context->to = strdup(p->to);
-	http_context->post_data= raw_post_data;
-	
+
+	// {"q":"<message>","target":"<target>"}
+	json_writer_t* w = &http_context->post_data;
+	json_writer_init(w, len + 32);
+	json_writer_object_begin(w);
+	json_writer_key(w, "q");
+	json_writer_string(w, message, len);
+	json_writer_key(w, "target");
+	json_writer_cstring(w, tc->target);
+	json_writer_object_end(w);
+
+	const char* raw_post_data = json_writer_data(w);
+	if(!raw_post_data){
+		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Error building POST data \n");
+		mesibo_translate_destroy_http_context(http_context);
+		return MESIBO_RESULT_FAIL;
+	}
 
 	mesibo_log(mod, tc->log,  "POST request %s %s %s %s \n", 
 			post_url, raw_post_data,
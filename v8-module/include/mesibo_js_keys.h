@@ -0,0 +1,138 @@
+/**
+ * File: mesibo_js_keys.h
+ * Description: Property names of the objects passed to the script
+ *
+ * Each name is created once per isolate as an internalized string, and looked
+ * up by its JS_KEY_* index with MesiboJsUtil::Key.
+ **/
+#pragma once
+
+/** Message Parmeters **/
+#define MESSAGE_AID 				"aid"
+#define MESSAGE_ID 				"id"
+#define MESSAGE_REFID 				"refid"
+#define MESSAGE_GROUPID 			"groupid"
+#define MESSAGE_FLAGS 				"flags"
+#define MESSAGE_TYPE 				"type"
+#define MESSAGE_EXPIRY 				"expiry"
+#define MESSAGE_TO_ONLINE 			"toOnline"
+#define MESSAGE_TO 				"to"
+#define MESSAGE_FROM                   		"from"
+#define MESSAGE_ENABLE_READ_RECEIPT 		"enableReadReceipt"
+#define MESSAGE_ENABLE_DELIVERY_RECEIPT 	"enableDeliveryReceipt"
+#define MESSAGE_ENABLE_PRESENCE 		"enablePresence"
+#define MESSAGE_SEND_IF_ONLINE 			"sendIfOnline"
+#define MESSAGE_SEND  				"send"
+
+#define MESSAGE_MESSAGE 			"message"
+#define MESSAGE_DATA 				"data"
+
+/** HTTP options **/
+//proxy disabled
+#define HTTP_CONTENT_TYPE 			"contentType"
+#define HTTP_EXTRA_HEADER 			"headers"
+#define HTTP_USER_AGENT 			"userAgent"
+#define HTTP_REFERRER 				"referrer"
+#define HTTP_ORIGIN 				"origin"
+#define HTTP_COOKIE 				"cookie"
+#define HTTP_ENCODING 				"encoding"
+#define HTTP_CACHE_CONTROL 			"cacheControl"
+#define HTTP_ACCEPT 				"accept"
+#define HTTP_ETAG 				"etag"
+#define HTTP_IMS 				"ims"
+#define HTTP_CONN_TIMEOUT 			"connTimeout"
+#define HTTP_HEADER_TIMEOUT 			"headerTimeout"
+#define HTTP_BODY_TIMEOUT 			"bodyTimeout"
+#define HTTP_TOTAL_TIMEOUT 			"totalTimeout"
+
+#define HTTP_DATA 				"data"
+#define HTTP_STATUS 				"status"
+#define HTTP_RESPONSE 				"response"
+#define HTTP_RESPONSE_JSON 			"responseJSON"
+#define HTTP_RESPONSE_TYPE  			"responseType"
+#define HTTP_RESPONSE_LENGTH 			"responseLength"
+
+#define HTTP_ONDATA 				"ondata"
+#define HTTP_ONCHUNK 				"onchunk"
+#define HTTP_ACCUMULATE 			"accumulate"
+#define HTTP_URL 				"url"
+#define HTTP_POST 				"post"
+#define HTTP_CBDATA 				"cbdata"
+#define HTTP_SEND 				"send"
+
+/**Socket Parameters**/
+#define SOCKET_URL 				"url"
+#define SOCKET_KEEPALIVE                        "keepalive"
+#define SOCKET_VERIFY_HOST                      "verifyHost"
+#define SOCKET_CBDATA 				"cbdata"
+
+/**Socket Callback functions **/
+#define SOCKET_ON_CONNECT                       "onconnect"
+#define SOCKET_ON_DATA                          "ondata"
+
+/** Mesibo Socket Utils **/
+#define SOCKET_CONNECT 		  		"connect" 
+#define SOCKET_WRITE 		  		"write"
+#define SOCKET_CLOSE 		  		"close"
+
+#define JS_KEYS(X) \
+	X(MESSAGE_AID) \
+	X(MESSAGE_ID) \
+	X(MESSAGE_REFID) \
+	X(MESSAGE_GROUPID) \
+	X(MESSAGE_FLAGS) \
+	X(MESSAGE_TYPE) \
+	X(MESSAGE_EXPIRY) \
+	X(MESSAGE_TO_ONLINE) \
+	X(MESSAGE_TO) \
+	X(MESSAGE_FROM) \
+	X(MESSAGE_ENABLE_READ_RECEIPT) \
+	X(MESSAGE_ENABLE_DELIVERY_RECEIPT) \
+	X(MESSAGE_ENABLE_PRESENCE) \
+	X(MESSAGE_SEND_IF_ONLINE) \
+	X(MESSAGE_SEND) \
+	X(MESSAGE_MESSAGE) \
+	X(MESSAGE_DATA) \
+	X(HTTP_CONTENT_TYPE) \
+	X(HTTP_EXTRA_HEADER) \
+	X(HTTP_USER_AGENT) \
+	X(HTTP_REFERRER) \
+	X(HTTP_ORIGIN) \
+	X(HTTP_COOKIE) \
+	X(HTTP_ENCODING) \
+	X(HTTP_CACHE_CONTROL) \
+	X(HTTP_ACCEPT) \
+	X(HTTP_ETAG) \
+	X(HTTP_IMS) \
+	X(HTTP_CONN_TIMEOUT) \
+	X(HTTP_HEADER_TIMEOUT) \
+	X(HTTP_BODY_TIMEOUT) \
+	X(HTTP_TOTAL_TIMEOUT) \
+	X(HTTP_DATA) \
+	X(HTTP_STATUS) \
+	X(HTTP_RESPONSE) \
+	X(HTTP_RESPONSE_JSON) \
+	X(HTTP_RESPONSE_TYPE) \
+	X(HTTP_RESPONSE_LENGTH) \
+	X(HTTP_ONDATA) \
+	X(HTTP_ONCHUNK) \
+	X(HTTP_ACCUMULATE) \
+	X(HTTP_URL) \
+	X(HTTP_POST) \
+	X(HTTP_CBDATA) \
+	X(HTTP_SEND) \
+	X(SOCKET_URL) \
+	X(SOCKET_KEEPALIVE) \
+	X(SOCKET_VERIFY_HOST) \
+	X(SOCKET_CBDATA) \
+	X(SOCKET_ON_CONNECT) \
+	X(SOCKET_ON_DATA) \
+	X(SOCKET_CONNECT) \
+	X(SOCKET_WRITE) \
+	X(SOCKET_CLOSE)
+
+#define JS_KEY_ENUM(name) JS_KEY_##name,
+typedef enum js_key_e {
+	JS_KEYS(JS_KEY_ENUM)
+	JS_KEY_COUNT
+} js_key_t;
@@ -2,8 +2,12 @@
 
 #include "module.h"
 #include <string.h>
+#include <pthread.h>
 #include <iostream>
+#include <map>
 #include <v8.h>
+#include "timer_wheel.h"
+#include "mesibo_js_keys.h"
 #include <include/libplatform/libplatform.h>
 
 using std::pair;
@@ -39,6 +43,12 @@ using v8::Persistent;
 #define JS_MESIBO_CLASS_HTTP 			"Http"
 #define JS_MESIBO_CLASS_SOCKET 			"Socket"
 
+/* Global Timers */
+#define JS_MESIBO_SET_TIMEOUT 			"setTimeout"
+#define JS_MESIBO_SET_INTERVAL 			"setInterval"
+#define JS_MESIBO_CLEAR_TIMEOUT 		"clearTimeout"
+#define JS_MESIBO_CLEAR_INTERVAL 		"clearInterval"
+
 /* Global Listener functions */
 #define JS_MESIBO_LISTENER_ON_MESSAGE 		"onmessage"
 #define JS_MESIBO_LISTENER_ON_MESSAGE_STATUS 	"onmessagestatus"
@@ -46,25 +56,60 @@ using v8::Persistent;
 
 /* Global Mesibo Utils */
 #define JS_MESIBO_LOG 				"log" 
+#define JS_MESIBO_FETCH 			"fetch"
 #define JS_MESIBO_RESULT_FAIL 			"RESULT_FAIL"
 #define JS_MESIBO_RESULT_OK 			"RESULT_OK"
 
 
 
+
 typedef struct v8_config_s v8_config_t;
 typedef struct http_context_s http_context_t;
 typedef struct socket_context_s socket_context_t;
+typedef struct js_timer_s js_timer_t;
 
 class MesiboJsProcessor {
 	public:
 		MesiboJsProcessor(mesibo_module_t* mod, const char* script, int log_level)
-			:mod_(mod), script_(script), log_(log_level), lastchanged_(0) {
+			:mod_(mod), script_(script), log_(log_level), code_cache_(true), allocator_(NULL), 
+			refs_(0), retired_(NULL), replaced_(false), keys_(), scratch_(NULL), scratch_size_(0), 
+			scratch_busy_(false), timers_(NULL), next_timer_id_(0), depth_(0), 
+			timeout_(0), watchdog_(NULL), watch_seq_(0), watch_start_(0), terminated_(NULL) {
+				//Recursive, a script callback may reenter the module on the same thread
+				pthread_mutexattr_t attr;
+				pthread_mutexattr_init(&attr);
+				pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+				pthread_mutex_init(&lock_, &attr);
+				pthread_mutexattr_destroy(&attr);
+				pthread_mutex_init(&watch_lock_, NULL);
+				memset(&watch_timer_, 0, sizeof(watch_timer_));
 			}
 		virtual int Initialize();
-		virtual ~MesiboJsProcessor() { };
+		virtual ~MesiboJsProcessor() { 
+			pthread_mutex_destroy(&lock_); 
+			pthread_mutex_destroy(&watch_lock_); 
+			free(scratch_); 
+		};
+
+		//Serializes the use of the isolate, taken before the v8::Locker
+		bool TryLock() { return 0 == pthread_mutex_trylock(&lock_); }
+		void Lock() { pthread_mutex_lock(&lock_); }
+		void Unlock() { pthread_mutex_unlock(&lock_); }
 
 		mesibo_int_t ExecuteJsFunctionObj(Local<Context>& context,
 				Local<Function>& js_func, int argc, Local<Value> argv[]);
+
+		//Runs the promise reactions queued by a callback, once it has returned to the module
+		void RunMicrotasks();
+
+		//Time budget of an outermost call into the script, including its microtasks.
+		//Watch returns false if a call is already being watched.
+		bool Watch();
+		void Unwatch();
+		static void OnWatchdog(void* data);
+		static size_t OnNearHeapLimit(void* data, size_t current_heap_limit, size_t initial_heap_limit);
+		//Once the script is out of the isolate, makes it usable again after a termination
+		bool CheckTerminated();
 		
 		void SetCallables(Local<ObjectTemplate> & global);
 		Local<Function> GetGlobalFunction(const Local<Context>& context, const char* func_name);	
@@ -74,20 +119,46 @@ class MesiboJsProcessor {
 				mesibo_uint_t len);
 		mesibo_int_t OnMessageStatus(mesibo_message_params_t* p, mesibo_uint_t status);
 		
-		void SetIsolate(Isolate* isolate){ isolate_ = isolate;}	
+		//Each processor owns its isolate, which points back to it
+		void SetIsolate(Isolate* isolate){ isolate_ = isolate; isolate->SetData(0, this);}	
 		Isolate* GetIsolate() { return isolate_; }
+		static MesiboJsProcessor* FromIsolate(Isolate* isolate) {
+			return static_cast<MesiboJsProcessor*>(isolate->GetData(0));
+		}
 		Local<Context> GetContext(); //Return allocated context initialized to base context_
+
+		//Internalized property name, created once per isolate by InitKeys
+		Local<String> GetKey(js_key_t key) { return keys_[key].Get(isolate_); }
+		void InitKeys();
+
+		//Reusable buffer for converting outgoing messages. NULL if it is already
+		//in use by an outer call on the same thread; the caller then allocates.
+		char* AcquireScratch(size_t len);
+		void ReleaseScratch() { scratch_busy_ = false; }
+		void Reset(); //Release the handles into the isolate, before disposing it
 		
 		//Scripting Module Configuration
 		mesibo_module_t* mod_;
 		const char* script_;	
 		mesibo_int_t log_;
-		int lastchanged_;
+		bool code_cache_; //Keep compiled code next to the script, in <script>.v8cache
 	
-		int ExecuteScript(Local<String> script, Local<ObjectTemplate> global);
-		MaybeLocal<String> ReadFile(Isolate* isolate, const string& name);
+		int ExecuteScript(Local<String> script, Local<ObjectTemplate> global, uint64_t hash);
+		MaybeLocal<String> ReadFile(Isolate* isolate, const string& name, uint64_t* hash = NULL);
+
+		//Code cache, valid only for the script content with the given hash
+		v8::ScriptCompiler::CachedData* ReadCodeCache(uint64_t hash);
+		void WriteCodeCache(Local<v8::UnboundScript> script, uint64_t hash);
 		
 		Isolate* isolate_;
+		v8::ArrayBuffer::Allocator* allocator_;
+		pthread_mutex_t lock_;
+
+		//Threads using or waiting for the isolate, and requests which will call back into it.
+		//A processor replaced by a reload is disposed once this drops to zero.
+		volatile mesibo_int_t refs_;
+		MesiboJsProcessor* retired_; //Next in the list of replaced processors
+		volatile bool replaced_; //Intervals stop repeating once the script is reloaded
 		Global<Context> context_; //Load base context from here 
 		
 		//Global Mesibo Listeners
@@ -95,9 +166,40 @@ class MesiboJsProcessor {
 		Global<Function> js_mesibo_on_message_status; 
 		Global<Function> js_mesibo_on_login;
 
-		static Global<ObjectTemplate> message_template_;
-		static Global<ObjectTemplate>  http_template_;
-		static Global<ObjectTemplate> socket_template_;
+		v8::Eternal<String> keys_[JS_KEY_COUNT];
+
+		char* scratch_;
+		size_t scratch_size_;
+		bool scratch_busy_;
+
+		//setTimeout and setInterval, by id
+		timer_wheel_t* timers_; //Shared by all the isolates of the module
+		std::map<uint32_t, js_timer_t*> js_timers_;
+		uint32_t next_timer_id_;
+		int depth_; //Nested calls into JS
+
+		//Watchdog, see Watch
+		mesibo_uint_t timeout_; //ms, 0 for none
+		timer_wheel_t* watchdog_; //Shared by all the isolates of the module
+		timer_wheel_timer_t watch_timer_;
+		pthread_mutex_t watch_lock_;
+		volatile uint64_t watch_seq_; //Odd while a call is watched
+		uint64_t watch_start_;
+		const char* terminated_; //Why the script was terminated, if it was
+
+		//Templates belong to an isolate, so each processor has its own
+		Global<ObjectTemplate> message_template_;
+		Global<ObjectTemplate>  http_template_;
+		Global<ObjectTemplate> socket_template_;
+};
+
+//Holds the processor lock for a scope, for callbacks which are not dispatched by v8_on_message
+class MesiboJsLock {
+	public:
+		explicit MesiboJsLock(MesiboJsProcessor* mp) : mp_(mp) { mp_->Lock(); }
+		~MesiboJsLock() { mp_->Unlock(); }
+	private:
+		MesiboJsProcessor* mp_;
 };
 
 class MesiboJsDebug {
@@ -127,8 +229,23 @@ class MesiboJsMessage {
 
 		static Local<Object> CtoJ_MessageParams(Isolate* isolate, Local<Context>& context , 
 				mesibo_message_params_t* p);
+
+		//Sets message.data and message.message over the message buffer, without copying it.
+		//The returned buffer must be detached once the callback returns.
+		static Local<v8::ArrayBuffer> CtoJ_MessageBody(Isolate* isolate, Local<Context>& context,
+				Local<Object>& message_obj, const char* message, mesibo_uint_t len);
+		static void MessageBodyGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info);
 		static mesibo_message_params_t* JtoC_MessageParams(Isolate* isolate, 
 				const Local<Context>& context, const Local<Object>& params);
+
+		//A Message object owns a copy of its parameters, which its accessors read and write
+		static mesibo_message_params_t* Wrap(Isolate* isolate, Local<Object>& message_obj,
+				const mesibo_message_params_t* p);
+		static mesibo_message_params_t* Unwrap(const Local<Object>& message_obj);
+		static void UintGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info);
+		static void UintSetter(Local<Name> property, Local<Value> value, const PropertyCallbackInfo<void>& info);
+		static void StringGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info);
+		static void StringSetter(Local<Name> property, Local<Value> value, const PropertyCallbackInfo<void>& info);
 };
 
 class MesiboJsHttp {
@@ -143,10 +260,32 @@ class MesiboJsHttp {
 
 		static mesibo_http_t* JtoC_HttpOptions(Isolate* isolate, 
 				const Local<Context>& context, const Local<Object>& options);
+		//mesibo.fetch(url, options), returns a Promise of the response
+		static void FetchCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+
 		static http_context_t* JtoC_HttpCallbackContext(Isolate* isolate, 
 				Local<Context>& context, Local<Object>& js_obj,
 				Local<Function>& js_cb, Local<Value>& js_cbdata, 
 				mesibo_module_t* mod);	
+
+		//Sets response, responseLength, responseType, status and responseJSON on obj
+		static void CtoJ_HttpResponse(Isolate* isolate, Local<Context>& context,
+				Local<Object>& obj, http_context_t* hc);
+		//Parses the response on first access
+		static void ResponseJSONGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info);
+};
+
+class MesiboJsTimer {
+	public:
+		//setTimeout(fn, delay, ...args) and setInterval(fn, delay, ...args), return the timer id
+		static void SetTimeoutCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+		static void SetIntervalCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+		//clearTimeout(id) and clearInterval(id)
+		static void ClearTimerCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
+
+		static void SetTimer(const v8::FunctionCallbackInfo<v8::Value>& args, bool repeat);
+		static void OnTimer(void* data);
+		static void Destroy(js_timer_t* t);
 };
 
 class MesiboJsSocket {
@@ -174,10 +313,16 @@ class MesiboJsSocket {
 // and going back again.
 class MesiboJsUtil {
 	public:
+		static Local<String> Key(Isolate* isolate, js_key_t key) {
+			return MesiboJsProcessor::FromIsolate(isolate)->GetKey(key);
+		}
+
 		static int CtoJ_Uint(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
-				const char* key, mesibo_uint_t value);
+				js_key_t key, mesibo_uint_t value);
 		static int CtoJ_String(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
-				const char* key, const char* value, mesibo_int_t len = -1);
+				js_key_t key, const char* value, mesibo_int_t len = -1);
+		static int CtoJ_Value(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
+				js_key_t key, Local<Value> value);
 
 		static mesibo_int_t JtoC_Int(Isolate* isolate,
 				const Local<Context>& context, const Local<Value>& integer); 
@@ -189,20 +334,20 @@ class MesiboJsUtil {
 				const Local<Value>& json_object);
 
 		static Local<Value> GetParamValue(Isolate* isolate, 
-				const Local<Context>& context, const char* param_name,
+				const Local<Context>& context, js_key_t param_name,
 				const Local<Object>& params);
 
 		static mesibo_int_t JtoC_ParamInt(Isolate* isolate, 
-				const Local<Context>& context, const char* param_name, 
+				const Local<Context>& context, js_key_t param_name, 
 				const Local<Object>& params);
 		static mesibo_uint_t JtoC_ParamUint(Isolate* isolate, 
-				const Local<Context>& context, const char* param_name, 
+				const Local<Context>& context, js_key_t param_name, 
 				const Local<Object>& params);
 		static char* JtoC_ParamString(Isolate* isolate, 
-				const Local<Context>& context, const char* param_name,
+				const Local<Context>& context, js_key_t param_name,
 				const Local<Object>& params);
 		static Local<Function> JtoJ_ParamFunction(Isolate* isolate,
-				const Local<Context>& context, const char* func_name,
+				const Local<Context>& context, js_key_t func_name,
 				const Local<Object>& params); 
 
 };
@@ -210,11 +355,24 @@ class MesiboJsUtil {
  * Sample V8 Module Configuration
  * Refer sample.conf
  */
+#define V8_MAX_ISOLATES 		64
+#define V8_TIMER_TICK_USEC 		1000 	//Resolution of setTimeout and setInterval
+
 struct v8_config_s{
 	const char* script;
 	int log; //log level
-	long last_changed; // Time Stamp
-	MesiboJsProcessor* ctx; // v8 context
+	int isolates; //Number of isolates, each running the script in its own context
+	int code_cache; //Cache compiled code next to the script
+	timer_wheel_t* timers; //Runs setTimeout and setInterval of all isolates
+	mesibo_uint_t timeout; //Time budget of a call into the script in ms, 0 for none
+	mesibo_uint_t max_heap; //Heap limit of an isolate in MB, 0 for the V8 default
+	timer_wheel_t* watchdog; //Terminates calls over their budget
+	mesibo_uint_t next_isolate; //Assigns isolates to threads, round robin
+	MesiboJsProcessor* ctx[V8_MAX_ISOLATES]; // v8 context, one per isolate
+	MesiboJsProcessor* retired; //Replaced by a reload, not yet disposed
+	pthread_rwlock_t swap_lock; //Taking a reference to the processor in a slot, against a reload swapping it
+	int watch_fd; //eventfd which stops the watcher, -1 if it is not running
+	volatile int watch_stopped;
 };
 
 
@@ -228,16 +386,21 @@ struct socket_context_s{
 	Persistent<Function> js_ondata;
 	//JSValue js_onclose;
 
+	MesiboJsProcessor* ctx_; //Isolate the callbacks belong to
 	mesibo_module_t* mod;
 };
 
-#define HTTP_BUFFER_LEN (64 * 1024)
+#define HTTP_BUFFER_LEN (4 * 1024) //Initial size of the response buffer, doubled as needed
+#define HTTP_BUFFER_MAX_LEN (16 * 1024 * 1024)
 #define HTTP_RESPONSE_TYPE_LEN (1024)
 typedef struct http_context_s {
 	mesibo_int_t status;
 	char response_type[HTTP_RESPONSE_TYPE_LEN];
-	char buffer[HTTP_BUFFER_LEN];
-	int datalen;
+	char* buffer; //The response, if accumulated
+	size_t datalen;
+	size_t buflen;
+	size_t length; //Received, whether accumulated or not
+	bool accumulate;
 	MesiboJsProcessor* ctx_;
 	mesibo_module_t* mod;
 
@@ -247,4 +410,15 @@ typedef struct http_context_s {
 	Persistent<Object> http_obj; //Js HTTP Object
 	Persistent<Function> http_cb; //Js HTTP Callback function
 	Persistent<Value> http_cbdata; //Js HTTP Callback Data 
+	Persistent<Function> http_chunk_cb; //Js callback for each chunk of the response, if streamed
+	Persistent<v8::Promise::Resolver> resolver; //Set for mesibo.fetch instead of the callback
 }http_context_t;
+
+struct js_timer_s {
+	timer_wheel_timer_t timer;
+	MesiboJsProcessor* ctx_;
+	uint32_t id;
+	uint64_t interval; //usec, 0 for setTimeout
+	Global<Function> fn;
+	Global<v8::Array> args; //Extra arguments passed to fn
+};
@@ -6,6 +6,12 @@
 MesiboJsProcessor* mesibo_v8_init(mesibo_module_t* mod, v8_config_t* vc);
 v8_config_t* get_config_v8(mesibo_module_t* mod);
 
+//Isolate pool
+MesiboJsProcessor* mesibo_v8_acquire(v8_config_t* vc);
+void mesibo_v8_release(MesiboJsProcessor* mesibo_js);
+int mesibo_v8_reload(mesibo_module_t* mod, v8_config_t* vc);
+void mesibo_v8_destroy(MesiboJsProcessor* mesibo_js);
+
 //Message Callbacks
 mesibo_int_t v8_on_message(mesibo_module_t *mod, mesibo_message_params_t *p, char *message,
                 mesibo_uint_t len);
@@ -2,41 +2,140 @@
 #include "v8_module.h"
 
 
-/** HTTP options **/
-//proxy disabled
-#define HTTP_CONTENT_TYPE 			"contentType"
-#define HTTP_EXTRA_HEADER 			"headers"
-#define HTTP_USER_AGENT 			"userAgent"
-#define HTTP_REFERRER 				"referrer"
-#define HTTP_ORIGIN 				"origin"
-#define HTTP_COOKIE 				"cookie"
-#define HTTP_ENCODING 				"encoding"
-#define HTTP_CACHE_CONTROL 			"cacheControl"
-#define HTTP_ACCEPT 				"accept"
-#define HTTP_ETAG 				"etag"
-#define HTTP_IMS 				"ims"
-#define HTTP_CONN_TIMEOUT 			"connTimeout"
-#define HTTP_HEADER_TIMEOUT 			"headerTimeout"
-#define HTTP_BODY_TIMEOUT 			"bodyTimeout"
-#define HTTP_TOTAL_TIMEOUT 			"totalTimeout"
-
-#define HTTP_DATA 				"data"
-#define HTTP_STATUS 				"status"
-#define HTTP_RESPONSE 				"response"
-#define HTTP_RESPONSE_JSON 			"responseJSON"
-#define HTTP_RESPONSE_TYPE  			"responseType"
-#define HTTP_RESPONSE_LENGTH 			"responseLength"
-
-#define HTTP_ONDATA 				"ondata"
-#define HTTP_URL 				"url"
-#define HTTP_POST 				"post"
-#define HTTP_CBDATA 				"cbdata"
-#define HTTP_SEND 				"send"
-
 void mesibo_js_destroy_http_context(http_context_t* mc){
+	MesiboJsProcessor* mp = mc->ctx_;
+	if(mp){
+		//The handles belong to the isolate, and are released under its locks
+		{
+			MesiboJsLock lock(mp);
+			v8::Locker locker(mp->GetIsolate());
+			mc->http_obj.Reset();
+			mc->http_cb.Reset();
+			mc->http_cbdata.Reset();
+			mc->http_chunk_cb.Reset();
+			mc->resolver.Reset();
+		}
+		__sync_fetch_and_sub(&mp->refs_, 1);
+	}
+	free(mc->buffer);
 	free(mc);
 }
 
+static int js_mesibo_http_append(http_context_t* b, const char* data, size_t len){
+	if(b->datalen + len > b->buflen){
+		size_t buflen = b->buflen ? b->buflen : HTTP_BUFFER_LEN;
+		while(buflen < b->datalen + len)
+			buflen *= 2;
+		if(buflen > HTTP_BUFFER_MAX_LEN)
+			return MESIBO_RESULT_FAIL;
+
+		char* buffer = (char*)realloc(b->buffer, buflen);
+		if(!buffer)
+			return MESIBO_RESULT_FAIL;
+		b->buffer = buffer;
+		b->buflen = buflen;
+	}
+
+	memcpy(b->buffer + b->datalen, data, len);
+	b->datalen += len;
+	return MESIBO_RESULT_OK;
+}
+
+/**
+ * Passes a chunk of the response to onchunk as an ArrayBuffer over the buffer
+ * of the HTTP client, which is detached once the callback returns.
+ */
+static void js_mesibo_http_onchunk(http_context_t* b, const char* data, size_t len){
+	MesiboJsProcessor* mp = b->ctx_;
+	Isolate* isolate = mp->GetIsolate();
+
+	MesiboJsLock lock(mp);
+	v8::Locker locker(isolate);
+	v8::Isolate::Scope isolate_scope(isolate);
+	v8::HandleScope handle_scope(isolate);
+	v8::Local<v8::Context> context = mp->GetContext(); 
+	v8::Context::Scope context_scope(context);
+
+	Local<Function> js_chunk_cb = b->http_chunk_cb.Get(isolate);
+	Local<v8::ArrayBuffer> chunk = v8::ArrayBuffer::New(isolate, (void*)data, len);
+
+	int argc = 2;
+	Local<Value> argv[argc];
+	argv[0] = b->http_obj.Get(isolate);
+	argv[1] = chunk;
+
+	mp->ExecuteJsFunctionObj(context, js_chunk_cb, argc, argv);
+	chunk->Detach();
+}
+
+void MesiboJsHttp::ResponseJSONGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info){
+
+	Isolate* isolate = info.GetIsolate();
+	Local<Context> context = isolate->GetCurrentContext();
+
+	info.GetReturnValue().SetNull();
+	if(!info.Data()->IsString())
+		return;
+
+	//Not JSON is null rather than an exception
+	v8::TryCatch try_catch(isolate);
+	Local<Value> json;
+	if(v8::JSON::Parse(context, info.Data().As<String>()).ToLocal(&json))
+		info.GetReturnValue().Set(json);
+}
+
+void MesiboJsHttp::CtoJ_HttpResponse(Isolate* isolate, Local<Context>& context,
+		Local<Object>& obj, http_context_t* b){
+
+	HandleScope handle_scope(isolate);
+
+	Local<Value> response = v8::Null(isolate);
+	Local<String> response_string;
+	if(b->accumulate && String::NewFromUtf8(isolate, b->buffer ? b->buffer : "", 
+				NewStringType::kNormal, (int)b->datalen).ToLocal(&response_string))
+		response = response_string;
+
+	MesiboJsUtil::CtoJ_Value(isolate, context, obj, JS_KEY_HTTP_RESPONSE, response);
+	MesiboJsUtil::CtoJ_Uint(isolate, context, obj, JS_KEY_HTTP_RESPONSE_LENGTH, b->length);
+	MesiboJsUtil::CtoJ_String(isolate, context, obj, JS_KEY_HTTP_RESPONSE_TYPE, b->response_type);
+	MesiboJsUtil::CtoJ_Uint(isolate, context, obj, JS_KEY_HTTP_STATUS, b->status);
+
+	if(obj->SetLazyDataProperty(context, MesiboJsUtil::Key(isolate, JS_KEY_HTTP_RESPONSE_JSON),
+				ResponseJSONGetter, response).IsNothing()){
+		MesiboJsDebug::ErrorLog("Unable to set %s\n", HTTP_RESPONSE_JSON);
+	}
+}
+
+
+/**
+ * Settles the promise of mesibo.fetch with the response, or rejects it, and
+ * runs the reactions of the script to it.
+ */
+static void js_mesibo_fetch_settle(http_context_t* b, bool ok){
+	MesiboJsProcessor* mp = b->ctx_;
+	Isolate* isolate = mp->GetIsolate();
+
+	MesiboJsLock lock(mp);
+	v8::Locker locker(isolate);
+	v8::Isolate::Scope isolate_scope(isolate);
+	v8::HandleScope handle_scope(isolate);
+	v8::Local<v8::Context> context = mp->GetContext(); 
+	v8::Context::Scope context_scope(context);
+
+	Local<v8::Promise::Resolver> resolver = b->resolver.Get(isolate);
+	if(ok){
+		Local<Object> response = Object::New(isolate);
+		MesiboJsHttp::CtoJ_HttpResponse(isolate, context, response, b);
+		resolver->Resolve(context, response).Check();
+	} else {
+		resolver->Reject(context, v8::Exception::Error(
+					String::NewFromUtf8(isolate, "HTTP request failed").ToLocalChecked())).Check();
+	}
+	b->resolver.Reset();
+
+	mp->RunMicrotasks();
+	mesibo_js_destroy_http_context(b);
+}
 
 /**
  * C++ HTTP Callback Function which in turn calls the JS callback reference
@@ -48,9 +147,10 @@ mesibo_int_t js_mesibo_http_ondata(void *cbdata, mesibo_int_t state,
 	mesibo_module_t *mod = b->mod;
 
 	
+	//The request is failed and the context freed by js_mesibo_http_onclose,
+	//which is always the last callback of a request
 	if (progress < 0) {
 		mesibo_log(mod, 0, "Error in http callback \n");
-		mesibo_js_destroy_http_context(b);
 		return MESIBO_RESULT_FAIL;
 	}
 
@@ -61,13 +161,16 @@ mesibo_int_t js_mesibo_http_ondata(void *cbdata, mesibo_int_t state,
 	if ((MODULE_HTTP_STATE_RESPBODY == state) && buffer!=NULL && size!=0 ) {
 		
 		//MesiboJsDebug::Log("=====> HTTP Body of len: %u , %.*s\n", (unsigned long)size, size, buffer);
-		if(HTTP_BUFFER_LEN < (b->datalen + size )){
+		b->length += size;
+
+		if(!b->http_chunk_cb.IsEmpty())
+			js_mesibo_http_onchunk(b, buffer, size);
+
+		if(b->accumulate && MESIBO_RESULT_FAIL == js_mesibo_http_append(b, buffer, size)){
 			mesibo_log(mod, 0,
-					"Error in http callback : Buffer overflow detected \n", mod->name);
+					"Error in http callback : Response too large \n", mod->name);
 			return MESIBO_RESULT_FAIL;
 		}
-		memcpy(b->buffer + b->datalen, buffer, size);
-		b->datalen += size;
 	}
 
 	if (100 == progress) {
@@ -95,23 +198,35 @@ mesibo_int_t js_mesibo_http_onstatus(void *cbdata, mesibo_int_t status, const ch
 }
 
 void js_mesibo_http_onclose(void *cbdata,  mesibo_int_t result){
+	http_context_t *b = (http_context_t *)cbdata;
+	if(!b) return;
+
 	if(MESIBO_RESULT_FAIL == result){
 		MesiboJsDebug::ErrorLog("Intenral Error: HTTP Response failed \n");
+		//The context holds a reference on the isolate, which must be dropped
+		if(!b->resolver.IsEmpty())
+			js_mesibo_fetch_settle(b, false);
+		else
+			mesibo_js_destroy_http_context(b);
 		return;
 	}
-		
-	http_context_t *b = (http_context_t *)cbdata;
-	if(!b) return;
 	
 	mesibo_module_t* mod = b->mod;
 	if(!mod) return;
 
-	MesiboJsProcessor* mp = ((v8_config_t*)mod->ctx)->ctx;
+	//The isolate which made the request
+	MesiboJsProcessor* mp = b->ctx_;
 	if(!mp) return;
 
 	Isolate* isolate = mp->GetIsolate();
 	if(!isolate) return;
+
+	if(!b->resolver.IsEmpty()){
+		js_mesibo_fetch_settle(b, true);
+		return;
+	}
 	
+	MesiboJsLock lock(mp);
 	v8::Locker locker(isolate);
 	v8::HandleScope handle_scope(isolate);
 	v8::Local<v8::Context> context = mp->GetContext(); 
@@ -131,9 +246,7 @@ void js_mesibo_http_onclose(void *cbdata,  mesibo_int_t result){
 		return ;
 	}
 
-	MesiboJsUtil::CtoJ_String(isolate, context, js_http_obj, HTTP_RESPONSE, b->buffer);
-	MesiboJsUtil::CtoJ_String(isolate, context, js_http_obj, HTTP_RESPONSE_TYPE, b->response_type);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, js_http_obj, HTTP_STATUS, b->status);
+	MesiboJsHttp::CtoJ_HttpResponse(isolate, context, js_http_obj, b);
 
 	argv[0] = Local<Value>::Cast(js_http_obj);
 	mesibo_int_t rv = mp->ExecuteJsFunctionObj(context, js_http_cb, argc, argv);
@@ -179,6 +292,8 @@ Local<v8::ObjectTemplate> MesiboJsHttp::MakeHttpTemplate(Isolate* isolate, mesib
 	http_obj->Set(isolate, HTTP_RESPONSE, v8::Null(isolate));	
 	http_obj->Set(isolate, HTTP_RESPONSE_JSON, v8::Null(isolate));	
 	http_obj->Set(isolate, HTTP_RESPONSE_TYPE, v8::Null(isolate));	
+	http_obj->Set(isolate, HTTP_ONCHUNK, v8::Null(isolate));	
+	http_obj->Set(isolate, HTTP_ACCUMULATE, v8::False(isolate));	
 	http_obj->Set(isolate, HTTP_URL, v8::Null(isolate));	
 	http_obj->Set(isolate, HTTP_POST, v8::Null(isolate));	
 	http_obj->Set(isolate, HTTP_SEND, FunctionTemplate::New(isolate, 
@@ -199,28 +314,28 @@ mesibo_http_t* MesiboJsHttp::JtoC_HttpOptions(Isolate* isolate,
 
 	//xxx: Collect the given keys. Check if option is present, then unwrap	
 	//The string references are allocated by strdup, needs to be freed 
-	opt->url = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_URL, options);
-	if(!opt->url)
-		return NULL;
-	opt->post = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_POST, options);
-	if(!opt->post)
+	opt->url = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_URL, options);
+	if(!opt->url){
+		free(opt);
 		return NULL;
-	opt->content_type = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_CONTENT_TYPE, options);
-	opt->extra_header = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_EXTRA_HEADER, options);
-	opt->referrer = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_REFERRER, options);
-	opt->origin  = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_ORIGIN, options);
-	opt->cookie = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_COOKIE, options);
-	opt->encoding = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_ENCODING, options);
-	opt->cache_control = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_CACHE_CONTROL, options);
-	opt->accept = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_ACCEPT, options);
-	opt->etag = MesiboJsUtil::JtoC_ParamString(isolate, context, HTTP_ETAG, options);
+	}
+	opt->post = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_POST, options); //GET if not set
+	opt->content_type = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_CONTENT_TYPE, options);
+	opt->extra_header = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_EXTRA_HEADER, options);
+	opt->referrer = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_REFERRER, options);
+	opt->origin  = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_ORIGIN, options);
+	opt->cookie = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_COOKIE, options);
+	opt->encoding = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_ENCODING, options);
+	opt->cache_control = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_CACHE_CONTROL, options);
+	opt->accept = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_ACCEPT, options);
+	opt->etag = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_HTTP_ETAG, options);
 
 	//In case of integer params, All are considered 32-bit unsigned integers	
-	opt->ims = MesiboJsUtil::JtoC_ParamUint(isolate, context, HTTP_IMS, options);
-	opt->conn_timeout = MesiboJsUtil::JtoC_ParamUint(isolate, context, HTTP_CONN_TIMEOUT, options);
-	opt->header_timeout = MesiboJsUtil::JtoC_ParamUint(isolate, context, HTTP_HEADER_TIMEOUT, options);
-	opt->body_timeout = MesiboJsUtil::JtoC_ParamUint(isolate, context, HTTP_BODY_TIMEOUT, options);
-	opt->total_timeout= MesiboJsUtil::JtoC_ParamUint(isolate, context, HTTP_TOTAL_TIMEOUT, options);
+	opt->ims = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_HTTP_IMS, options);
+	opt->conn_timeout = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_HTTP_CONN_TIMEOUT, options);
+	opt->header_timeout = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_HTTP_HEADER_TIMEOUT, options);
+	opt->body_timeout = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_HTTP_BODY_TIMEOUT, options);
+	opt->total_timeout= MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_HTTP_TOTAL_TIMEOUT, options);
 	
 	opt->on_data = js_mesibo_http_ondata;
 	opt->on_status = js_mesibo_http_onstatus;
@@ -246,6 +361,8 @@ http_context_t* MesiboJsHttp::JtoC_HttpCallbackContext(Isolate* isolate,
 	if(!hc) return NULL;
 
 	//V8 Context	
+	hc->ctx_ = MesiboJsProcessor::FromIsolate(isolate);
+	__sync_fetch_and_add(&hc->ctx_->refs_, 1); //Keep the isolate until the response
 	hc->isolate = isolate;
 	hc->context = context;	
 
@@ -259,6 +376,57 @@ http_context_t* MesiboJsHttp::JtoC_HttpCallbackContext(Isolate* isolate,
 	return hc; //The caller is responsible for freeing this pointer
 }
 
+void MesiboJsHttp::FetchCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
+
+	Isolate* isolate = args.GetIsolate();
+	HandleScope scope(isolate);
+
+	v8::Local<v8::Context> context = isolate->GetCurrentContext(); 
+
+	Local<External> mod_cb = args.Data().As<External>();
+	mesibo_module_t* mod = static_cast<mesibo_module_t*>(mod_cb->Value()); 
+	if(!mod) return; //Internal Error
+
+	if(args.Length() < 1 || !args[0]->IsString()){
+		MesiboJsDebug::ReportExceptionInCallable(args, "Bad Parameters");
+		return;
+	}
+
+	Local<v8::Promise::Resolver> resolver;
+	if(!v8::Promise::Resolver::New(context).ToLocal(&resolver))
+		return;
+	args.GetReturnValue().Set(resolver->GetPromise());
+
+	//The options (post, contentType, headers etc. as for Http) are looked up
+	//through the prototype, so that the object of the caller is not modified
+	Local<Object> options = Object::New(isolate);
+	if(args.Length() > 1 && args[1]->IsObject())
+		options->SetPrototype(context, args[1]).Check();
+	options->Set(context, MesiboJsUtil::Key(isolate, JS_KEY_HTTP_URL), args[0]).Check();
+
+	mesibo_http_t* req = JtoC_HttpOptions(isolate, context, options);
+	if(!req){
+		resolver->Reject(context, v8::Exception::TypeError(
+					String::NewFromUtf8(isolate, "Invalid HTTP options").ToLocalChecked())).Check();
+		return;
+	}
+
+	http_context_t* hc = (http_context_t*)calloc(1, sizeof(http_context_t));
+	hc->ctx_ = MesiboJsProcessor::FromIsolate(isolate);
+	__sync_fetch_and_add(&hc->ctx_->refs_, 1); //Keep the isolate until the response
+	hc->isolate = isolate;
+	hc->mod = mod;
+	hc->accumulate = true;
+	hc->resolver.Reset(isolate, resolver);
+
+	if(MESIBO_RESULT_FAIL == mesibo_util_http(req, (void*)hc)){
+		hc->resolver.Reset();
+		mesibo_js_destroy_http_context(hc);
+		resolver->Reject(context, v8::Exception::Error(
+					String::NewFromUtf8(isolate, "HTTP request failed").ToLocalChecked())).Check();
+	}
+}
+
 void MesiboJsHttp::HttpClassCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
 	if(!args.IsConstructCall()){
 		MesiboJsDebug::ErrorLog("Invalid constructor: %s \n", "Http");
@@ -279,7 +447,7 @@ void MesiboJsHttp::HttpClassCallback(const v8::FunctionCallbackInfo<v8::Value>&
 	}
 	// Return a new http object back to the javascript caller
 	Local<ObjectTemplate> http_obj 	=
-		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::http_template_);
+		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::FromIsolate(isolate)->http_template_);
 
 	v8::Local<v8::Object> http_instance = http_obj->NewInstance(context).ToLocalChecked();
 
@@ -307,14 +475,20 @@ void MesiboJsHttp::HttpCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
 
 	//JtoJ_ParamFunction	
 	Local<Value> arg_on_data = http_bundle->Get(context, 
-			String::NewFromUtf8(args.GetIsolate(), HTTP_ONDATA).ToLocalChecked()).ToLocalChecked();	
+			MesiboJsUtil::Key(isolate, JS_KEY_HTTP_ONDATA)).ToLocalChecked();	
 	if(!arg_on_data->IsFunction()){
 		MesiboJsDebug::ReportExceptionInCallable(args, "Bad function");
 		return;
 	}
 
 	Local<Value> arg_cbdata = http_bundle->Get(context, 
-			String::NewFromUtf8(args.GetIsolate(), HTTP_CBDATA).ToLocalChecked()).ToLocalChecked();	
+			MesiboJsUtil::Key(isolate, JS_KEY_HTTP_CBDATA)).ToLocalChecked();	
+
+	//Streamed, the response is only accumulated if asked for
+	Local<Value> arg_on_chunk = http_bundle->Get(context, 
+			MesiboJsUtil::Key(isolate, JS_KEY_HTTP_ONCHUNK)).ToLocalChecked();	
+	Local<Value> arg_accumulate = http_bundle->Get(context, 
+			MesiboJsUtil::Key(isolate, JS_KEY_HTTP_ACCUMULATE)).ToLocalChecked();	
 
 	//Unwrap params
 	Local<External> mod_cb = args.Data().As<External>();
@@ -337,10 +511,23 @@ void MesiboJsHttp::HttpCallback(const v8::FunctionCallbackInfo<v8::Value>& args)
 		MesiboJsDebug::ErrorLog("Invalid HTTP Context\n");
 		return;
 	}
+
+	if(arg_on_chunk->IsFunction()){
+		hc->http_chunk_cb.Reset(isolate, arg_on_chunk.As<Function>());
+		hc->accumulate = arg_accumulate->BooleanValue(isolate);
+	} else 
+		hc->accumulate = true;
 	
 	mesibo_http_t* req = JtoC_HttpOptions(args.GetIsolate(), context, http_bundle);
+	if(!req){
+		mesibo_js_destroy_http_context(hc);
+		MesiboJsDebug::ReportExceptionInCallable(args, "Invalid HTTP options");
+		return;
+	}
 	
 	mesibo_int_t rv = mesibo_util_http(req, (void*)hc);
+	if(MESIBO_RESULT_FAIL == rv)
+		mesibo_js_destroy_http_context(hc); //No callback will come, and the reference to the isolate is dropped
 
 	args.GetReturnValue().Set(v8::Integer::New(args.GetIsolate(), (int32_t)rv));
 }
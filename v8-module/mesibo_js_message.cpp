@@ -1,24 +1,5 @@
 #include "mesibo_js_processor.h"
-
-/** Message Parmeters **/
-#define MESSAGE_AID 				"aid"
-#define MESSAGE_ID 				"id"
-#define MESSAGE_REFID 				"refid"
-#define MESSAGE_GROUPID 			"groupid"
-#define MESSAGE_FLAGS 				"flags"
-#define MESSAGE_TYPE 				"type"
-#define MESSAGE_EXPIRY 				"expiry"
-#define MESSAGE_TO_ONLINE 			"toOnline"
-#define MESSAGE_TO 				"to"
-#define MESSAGE_FROM                   		"from"
-#define MESSAGE_ENABLE_READ_RECEIPT 		"enableReadReceipt"
-#define MESSAGE_ENABLE_DELIVERY_RECEIPT 	"enableDeliveryReceipt"
-#define MESSAGE_ENABLE_PRESENCE 		"enablePresence"
-#define MESSAGE_SEND_IF_ONLINE 			"sendIfOnline"
-#define MESSAGE_SEND  				"send"
-
-#define MESSAGE_MESSAGE 			"message"
-#define MESSAGE_DATA 				"data"
+#include "v8_module.h"
 
 //Internal
 #define MESIBO_FLAG_DELIVERYRECEIPT     	0x1
@@ -28,12 +9,19 @@
 //Types Supported
 #define MESIBO_JS_TYPE_STRING     	 0 //Text 
 #define MESIBO_JS_TYPE_INTEGER 		 1 //Integer(32-bit)
-#define MESIBO_JS_TYPE_ARRAY 		 2 //Byte Array: Uint8Array, Uint16Array,...
+#define MESIBO_JS_TYPE_ARRAY 		 2 //ArrayBuffer, or a view of one: Uint8Array, DataView,...
 #define MESIBO_JS_TYPE_OBJECT 		 3 //JSON Object. Stringify Internally 
 #define MESIBO_JS_TYPE_INVALID 	 	-1	
 
+//Internal fields of a Message object. Other objects, such as ArrayBuffers, have
+//internal fields too; only the ones tagged with the address of message_tag are messages.
+#define MESSAGE_FIELD_TAG 		 0
+#define MESSAGE_FIELD_PARAMS 		 1
+#define MESSAGE_FIELD_COUNT 		 2
+static const int message_tag = 0;
+
 //Internal
-mesibo_int_t EnableMessageProperty(const v8::FunctionCallbackInfo<v8::Value>& args, const char* property, mesibo_uint_t value);
+mesibo_int_t EnableMessageProperty(const v8::FunctionCallbackInfo<v8::Value>& args, js_key_t property, mesibo_uint_t value);
 void EnableReadReceiptCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
 void EnableDeliveryReceiptCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
 void EnablePresenceCallback(const v8::FunctionCallbackInfo<v8::Value>& args);
@@ -45,20 +33,14 @@ mesibo_int_t v8_on_message(mesibo_module_t *mod, mesibo_message_params_t *p, cha
 	
 	v8_config_t* vc = (v8_config_t*)mod->ctx;
 
-	MesiboJsProcessor* mesibo_js = vc->ctx;
-
 	mesibo_log(mod, vc->log,  "================> %s on_message called\n", mod->name);
+	if(NULL == p) return MESIBO_RESULT_FAIL;
 	mesibo_log(mod, vc->log, " from %s to %s id %u message %s\n", 
 			p->from, p->to, (uint32_t) p->id, message);
 	
-	// Clone Parameters
-	mesibo_message_params_t mp;
-	memset(&mp, 0, sizeof(mesibo_message_params_t));
-	if(NULL == p) return MESIBO_RESULT_FAIL;
+	//The Message object passed to the script takes its own copy of the parameters
 
-	memcpy(&mp, p, sizeof(mesibo_message_params_t));
-	mp.from = NULL != p->from  ? strdup(p->from): NULL; 
-	mp.to = NULL != p->to ? strdup(p->to): NULL; 
+	MesiboJsProcessor* mesibo_js = mesibo_v8_acquire(vc);
 
 	mesibo_int_t rv;
 	double et = 0;
@@ -66,13 +48,15 @@ mesibo_int_t v8_on_message(mesibo_module_t *mod, mesibo_message_params_t *p, cha
 	for(int i=1; i <= N; i++){	
 	
 		mesibo_int_t t1 = mesibo_util_usec();
-		rv = mesibo_js->OnMessage(&mp, message, len);	
+		rv = mesibo_js->OnMessage(p, message, len);	
 		mesibo_int_t t2 = mesibo_util_usec();
 		et = et +  uint32_t(t2-t1);	
 	
 		mesibo_log(mod, 0 ,"\n\n Time taken %d onMessage() %u usec\n\n",i, (uint32_t)(t2-t1)); 
 	}
 
+	mesibo_v8_release(mesibo_js);
+
 	mesibo_log(mod, 0 ,"\n\n Time taken onMessage avg(%d):  %lf usec\n\n", N, et/N);
        	
 	return rv; 
@@ -81,20 +65,13 @@ mesibo_int_t v8_on_message(mesibo_module_t *mod, mesibo_message_params_t *p, cha
 mesibo_int_t v8_on_message_status(mesibo_module_t *mod, mesibo_message_params_t *p) {
 
 	v8_config_t* vc = (v8_config_t*)mod->ctx;
-
-	MesiboJsProcessor* mesibo_js = vc->ctx;
        		
 	mesibo_log(mod, 0, "================>%s on_message_status called\n", mod->name);
 	mesibo_log(mod, 0, "to %s from %s id %u status %d\n", p->to, p->from, (uint32_t)p->id, (int)p->status);
 
-	// Clone Parameters
-	mesibo_message_params_t mp;
-	memset(&mp, 0, sizeof(mesibo_message_params_t));
-	memcpy(&mp, p, sizeof(mesibo_message_params_t));
-	mp.to = NULL != p->to ? strdup(p->to): NULL; 
-	mp.from = NULL != p->from  ? strdup(p->from): NULL;
-	
-	mesibo_int_t rv = mesibo_js->OnMessageStatus(&mp, p->status);	
+	MesiboJsProcessor* mesibo_js = mesibo_v8_acquire(vc);
+	mesibo_int_t rv = mesibo_js->OnMessageStatus(p, p->status);	
+	mesibo_v8_release(mesibo_js);
 
 	return rv;
 }
@@ -104,13 +81,27 @@ Local<v8::ObjectTemplate> MesiboJsMessage::MakeMessageTemplate(Isolate* isolate,
 
 	EscapableHandleScope handle_scope(isolate);
 	v8::Local<v8::ObjectTemplate> message_obj = v8::ObjectTemplate::New(isolate);
-	message_obj->Set(isolate, MESSAGE_AID, v8::Null(isolate));	
-	message_obj->Set(isolate, MESSAGE_ID, v8::Null(isolate));	
-	message_obj->Set(isolate, MESSAGE_REFID, v8::Null(isolate));	
-	message_obj->Set(isolate, MESSAGE_GROUPID, v8::Null(isolate));	
-	message_obj->Set(isolate, MESSAGE_FLAGS, v8::Null(isolate));	
-	message_obj->Set(isolate, MESSAGE_TYPE, v8::Null(isolate));	
-	message_obj->Set(isolate, MESSAGE_EXPIRY, v8::Null(isolate));	
+
+	//The parameters are converted only when the script reads or writes them
+	message_obj->SetInternalFieldCount(MESSAGE_FIELD_COUNT);
+	struct { js_key_t name; size_t offset; } uint_params[] = {
+		{JS_KEY_MESSAGE_AID, offsetof(mesibo_message_params_t, aid)},
+		{JS_KEY_MESSAGE_ID, offsetof(mesibo_message_params_t, id)},
+		{JS_KEY_MESSAGE_REFID, offsetof(mesibo_message_params_t, refid)},
+		{JS_KEY_MESSAGE_GROUPID, offsetof(mesibo_message_params_t, groupid)},
+		{JS_KEY_MESSAGE_FLAGS, offsetof(mesibo_message_params_t, flags)},
+		{JS_KEY_MESSAGE_TYPE, offsetof(mesibo_message_params_t, type)},
+		{JS_KEY_MESSAGE_EXPIRY, offsetof(mesibo_message_params_t, expiry)},
+	};
+	for(size_t i = 0; i < sizeof(uint_params)/sizeof(uint_params[0]); i++){
+		message_obj->SetAccessor(MesiboJsUtil::Key(isolate, uint_params[i].name),
+				UintGetter, UintSetter, v8::Integer::NewFromUnsigned(isolate, uint_params[i].offset));
+	}
+	message_obj->SetAccessor(MesiboJsUtil::Key(isolate, JS_KEY_MESSAGE_TO), StringGetter, StringSetter, 
+			v8::Integer::NewFromUnsigned(isolate, offsetof(mesibo_message_params_t, to)));
+	message_obj->SetAccessor(MesiboJsUtil::Key(isolate, JS_KEY_MESSAGE_FROM), StringGetter, StringSetter, 
+			v8::Integer::NewFromUnsigned(isolate, offsetof(mesibo_message_params_t, from)));
+
 	message_obj->Set(isolate, MESSAGE_TO_ONLINE, v8::Null(isolate));	
 	message_obj->Set(isolate, MESSAGE_SEND, FunctionTemplate::New(isolate, 
 				MesiboJsMessage::MessageCallback, External::New(isolate, (void*)mod)));
@@ -142,10 +133,14 @@ void MesiboJsMessage::MessageClassCallback(const v8::FunctionCallbackInfo<v8::Va
 	if(!mod)return;
 
 	Local<ObjectTemplate> message_templ =
-		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::message_template_);
+		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::FromIsolate(isolate)->message_template_);
 
 	v8::Local<v8::Object> message_instance = message_templ->NewInstance(context).ToLocalChecked();
 
+	mesibo_message_params_t p;
+	memset(&p, 0, sizeof(p));
+	Wrap(isolate, message_instance, &p);
+
 	args.GetReturnValue().Set(message_instance);
 
 }
@@ -157,7 +152,7 @@ mesibo_int_t GetJsMessageType(v8::Local<Value>& message){
 	if(message->IsString())
 		return MESIBO_JS_TYPE_STRING;
        	//ArrayBuffer is a subtype of object. So compare it for specificity earlier. Consider such cases carefully.
-	if(message->IsUint8Array())
+	if(message->IsArrayBuffer() || message->IsArrayBufferView())
 		return MESIBO_JS_TYPE_ARRAY;
 	if(message->IsObject())
 		return MESIBO_JS_TYPE_OBJECT;
@@ -175,10 +170,11 @@ void MesiboJsMessage::MessageCallback(const v8::FunctionCallbackInfo<v8::Value>&
 
 	Local<Object> message_bundle = args.This();
 
-	const char* message;
-	mesibo_int_t len; 
+	const char* message = NULL;
+	mesibo_int_t len = 0; 
+	Local<String> text; //Text to be converted to UTF-8
 	Local<Value> arg_message = message_bundle->Get(context,
-			String::NewFromUtf8(args.GetIsolate(), MESSAGE_MESSAGE).ToLocalChecked()).ToLocalChecked();
+			MesiboJsUtil::Key(isolate, JS_KEY_MESSAGE_MESSAGE)).ToLocalChecked();
 	
 	//Overloaded types for messaging
 	mesibo_int_t message_type = GetJsMessageType(arg_message);
@@ -192,28 +188,34 @@ void MesiboJsMessage::MessageCallback(const v8::FunctionCallbackInfo<v8::Value>&
 		//Number and string can be safely parsed as a string
 		case MESIBO_JS_TYPE_INTEGER:
 		case MESIBO_JS_TYPE_STRING:
-			message = MesiboJsUtil::JtoC_String(isolate, context, arg_message);
-			if(!message) 
+			if(!arg_message->ToString(context).ToLocal(&text))
 			{
 				MesiboJsDebug::ReportExceptionInCallable(args, "Invalid: message");
 				return;
 			}
-			len = strlen(message);
 			break;
 		
 		case MESIBO_JS_TYPE_OBJECT:
 			//JSON Stringify Internally
-			message = MesiboJsUtil::JtoC_ObjectToString(isolate, context, arg_message);
-			if(!message) 
+			if(!v8::JSON::Stringify(context, arg_message).ToLocal(&text))
 			{
 				MesiboJsDebug::ReportExceptionInCallable(args, "Invalid: message");
 				return;
 			}
-			len = strlen(message);
 			break;
 		
+		//Sent from the buffer of the array, mesibo_message copies it
 		case MESIBO_JS_TYPE_ARRAY:
-			return;
+			if(arg_message->IsArrayBuffer()){
+				v8::ArrayBuffer::Contents contents = arg_message.As<v8::ArrayBuffer>()->GetContents();
+				message = (const char*)contents.Data();
+				len = contents.ByteLength();
+			} else {
+				Local<v8::ArrayBufferView> view = arg_message.As<v8::ArrayBufferView>();
+				v8::ArrayBuffer::Contents contents = view->Buffer()->GetContents();
+				message = contents.Data() ? (const char*)contents.Data() + view->ByteOffset() : NULL;
+				len = view->ByteLength();
+			}
 			break;
 
 		default: return;
@@ -230,16 +232,36 @@ void MesiboJsMessage::MessageCallback(const v8::FunctionCallbackInfo<v8::Value>&
 		return;
 	}
 	if(!p->aid  || !p->id){
+		free(p->to);
+		free(p->from);
+		free(p);
 		MesiboJsDebug::ReportExceptionInCallable(args, "Invalid params");
 		return;
 	}
 
+	//Text is written as UTF-8 into the scratch buffer of the isolate, not a copy per message
+	MesiboJsProcessor* mp = MesiboJsProcessor::FromIsolate(isolate);
+	char* buffer = NULL;
+	bool scratch = false;
+	if(!text.IsEmpty()){
+		len = text->Utf8Length(isolate);
+		buffer = mp->AcquireScratch(len + 1);
+		scratch = (NULL != buffer);
+		if(!scratch)
+			buffer = (char*)malloc(len + 1);
+		text->WriteUtf8(isolate, buffer, len, NULL, String::NO_NULL_TERMINATION);
+		message = buffer;
+	}
 
-
-	MesiboJsDebug::Log("=======> Sending Message %p %p %d %s \n", mod, p , len, message);
+	MesiboJsDebug::Log("=======> Sending Message %p %p %d\n", mod, p , len);
 	mesibo_int_t rv = mesibo_message(mod, p, message, len); 
 	Local<v8::Integer> ret = v8::Integer::New(isolate, rv);
 
+	if(scratch)
+		mp->ReleaseScratch();
+	else
+		free(buffer);
+
 	free(p->to);
 	free(p->from);
 	free(p);
@@ -256,19 +278,11 @@ Local<Object> MesiboJsMessage::CtoJ_MessageParams(Isolate* isolate,
 		return Local<Object>::Cast(v8::Null(isolate));	
 
 	Local<ObjectTemplate> templ =
-		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::message_template_);
+		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::FromIsolate(isolate)->message_template_);
 	v8::Local<v8::Object> message_obj =
 		templ->NewInstance(context).ToLocalChecked();
 
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_AID, 	  p->aid);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_ID,        p->id);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_REFID,     p->refid);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_GROUPID,   p->groupid);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_FLAGS,     p->flags);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_TYPE,      p->type);
-	MesiboJsUtil::CtoJ_Uint(isolate, context, message_obj, MESSAGE_EXPIRY,    p->expiry);
-	MesiboJsUtil::CtoJ_String(isolate, context, message_obj, MESSAGE_TO,      p->to);
-	MesiboJsUtil::CtoJ_String(isolate, context, message_obj, MESSAGE_FROM,    p->from);
+	Wrap(isolate, message_obj, p);
 
 	// Return the result through the current handle scope.  Since each
 	// of these handles will go away when the handle scope is deleted
@@ -278,6 +292,49 @@ Local<Object> MesiboJsMessage::CtoJ_MessageParams(Isolate* isolate,
 }
 
 
+Local<v8::ArrayBuffer> MesiboJsMessage::CtoJ_MessageBody(Isolate* isolate, Local<Context>& context,
+		Local<Object>& message_obj, const char* message, mesibo_uint_t len){
+
+	EscapableHandleScope handle_scope(isolate);
+
+	//Externalized, it does not own the buffer of the message
+	Local<v8::ArrayBuffer> body = (message && len) ?
+		v8::ArrayBuffer::New(isolate, (void*)message, len) : v8::ArrayBuffer::New(isolate, 0);
+
+	MesiboJsUtil::CtoJ_Value(isolate, context, message_obj, JS_KEY_MESSAGE_DATA, body);
+
+	//The string is only created if the script reads message.message
+	if(message_obj->SetLazyDataProperty(context, 
+				MesiboJsUtil::Key(isolate, JS_KEY_MESSAGE_MESSAGE),
+				MessageBodyGetter, body).IsNothing()){
+		MesiboJsDebug::ErrorLog("Unable to set %s\n", MESSAGE_MESSAGE);
+	}
+
+	return handle_scope.Escape(body);
+}
+
+//Once the callback has returned, the buffer is detached and the message is empty
+void MesiboJsMessage::MessageBodyGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info){
+
+	Isolate* isolate = info.GetIsolate();
+	Local<v8::ArrayBuffer> body = info.Data().As<v8::ArrayBuffer>();
+
+	v8::ArrayBuffer::Contents contents = body->GetContents();
+	if(!contents.Data() || !contents.ByteLength()){
+		info.GetReturnValue().SetEmptyString();
+		return;
+	}
+
+	Local<String> message;
+	if(!String::NewFromUtf8(isolate, (const char*)contents.Data(), NewStringType::kNormal,
+				(int)contents.ByteLength()).ToLocal(&message)){
+		info.GetReturnValue().SetEmptyString();
+		return;
+	}
+
+	info.GetReturnValue().Set(message);
+}
+
 mesibo_message_params_t* MesiboJsMessage::JtoC_MessageParams(Isolate* isolate, 
 		const Local<Context>& context,
 		const Local<Object>& params){
@@ -286,22 +343,118 @@ mesibo_message_params_t* MesiboJsMessage::JtoC_MessageParams(Isolate* isolate,
 
 	mesibo_message_params_t *mp = (mesibo_message_params_t*)calloc(1, sizeof(mesibo_message_params_t)); 
 
+	//A Message object already has them in C. Only the fields visible to scripts are copied,
+	//so that a reply built from a received message does not carry its status, uflags etc.
+	mesibo_message_params_t* wrapped = Unwrap(params);
+	if(wrapped){
+		mp->aid = wrapped->aid;
+		mp->id = wrapped->id;
+		mp->refid = wrapped->refid;
+		mp->groupid = wrapped->groupid;
+		mp->flags = wrapped->flags;
+		mp->type = wrapped->type;
+		mp->expiry = wrapped->expiry;
+		mp->to = wrapped->to ? strdup(wrapped->to) : NULL;
+		mp->from = wrapped->from ? strdup(wrapped->from) : NULL;
+		return mp;
+	}
+
 	//In case of integer params, All are considered 32-bit unsigned integers	
-	mp->aid = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_AID, params);	
-	mp->id = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_ID, params);	
-	mp->refid = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_REFID, params);	
-	mp->groupid = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_GROUPID, params);	
-	mp->flags = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_FLAGS, params);	
-	mp->type = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_TYPE, params);	
-	mp->expiry = MesiboJsUtil::JtoC_ParamUint(isolate, context, MESSAGE_EXPIRY, params);	
-	mp->to = MesiboJsUtil::JtoC_ParamString(isolate, context, MESSAGE_TO, params);	
-	mp->from = MesiboJsUtil::JtoC_ParamString(isolate, context, MESSAGE_FROM, params);	
+	mp->aid = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_AID, params);	
+	mp->id = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_ID, params);	
+	mp->refid = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_REFID, params);	
+	mp->groupid = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_GROUPID, params);	
+	mp->flags = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_FLAGS, params);	
+	mp->type = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_TYPE, params);	
+	mp->expiry = MesiboJsUtil::JtoC_ParamUint(isolate, context, JS_KEY_MESSAGE_EXPIRY, params);	
+	mp->to = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_MESSAGE_TO, params);	
+	mp->from = MesiboJsUtil::JtoC_ParamString(isolate, context, JS_KEY_MESSAGE_FROM, params);	
 
 	return mp;
 }
 
+typedef struct js_message_s {
+	mesibo_message_params_t params; //First, the params field points to both
+	Global<Object> handle;
+} js_message_t;
+
+static void MessageWeakCallback(const v8::WeakCallbackInfo<js_message_t>& info){
+	js_message_t* m = info.GetParameter();
+	m->handle.Reset();
+	free(m->params.to);
+	free(m->params.from);
+	delete m;
+}
+
+mesibo_message_params_t* MesiboJsMessage::Wrap(Isolate* isolate, Local<Object>& message_obj,
+		const mesibo_message_params_t* p){
+
+	js_message_t* m = new js_message_t;
+	memcpy(&m->params, p, sizeof(mesibo_message_params_t));
+	m->params.to = p->to ? strdup(p->to) : NULL;
+	m->params.from = p->from ? strdup(p->from) : NULL;
+
+	//Freed when the script no longer references the object
+	m->handle.Reset(isolate, message_obj);
+	m->handle.SetWeak(m, MessageWeakCallback, v8::WeakCallbackType::kParameter);
+	message_obj->SetAlignedPointerInInternalField(MESSAGE_FIELD_TAG, (void*)&message_tag);
+	message_obj->SetAlignedPointerInInternalField(MESSAGE_FIELD_PARAMS, m);
+
+	return &m->params;
+}
+
+mesibo_message_params_t* MesiboJsMessage::Unwrap(const Local<Object>& message_obj){
+	if(message_obj->InternalFieldCount() != MESSAGE_FIELD_COUNT ||
+			message_obj->GetAlignedPointerFromInternalField(MESSAGE_FIELD_TAG) != &message_tag)
+		return NULL;
+	return (mesibo_message_params_t*)message_obj->GetAlignedPointerFromInternalField(MESSAGE_FIELD_PARAMS);
+}
+
+void MesiboJsMessage::UintGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info){
+	mesibo_message_params_t* p = Unwrap(info.Holder());
+	if(!p){
+		info.GetReturnValue().SetNull();
+		return;
+	}
+	size_t offset = info.Data().As<v8::Uint32>()->Value();
+	info.GetReturnValue().Set((uint32_t)*(mesibo_uint_t*)((char*)p + offset));
+}
+
+//Converted as when sending, null or undefined is 0
+void MesiboJsMessage::UintSetter(Local<Name> property, Local<Value> value, 
+		const PropertyCallbackInfo<void>& info){
+	Isolate* isolate = info.GetIsolate();
+	mesibo_message_params_t* p = Unwrap(info.Holder());
+	if(!p) return;
+	size_t offset = info.Data().As<v8::Uint32>()->Value();
+	*(mesibo_uint_t*)((char*)p + offset) = value->IsNullOrUndefined() ? 0 :
+		MesiboJsUtil::JtoC_Uint(isolate, isolate->GetCurrentContext(), value);
+}
+
+void MesiboJsMessage::StringGetter(Local<Name> property, const PropertyCallbackInfo<Value>& info){
+	mesibo_message_params_t* p = Unwrap(info.Holder());
+	size_t offset = info.Data().As<v8::Uint32>()->Value();
+	const char* value = p ? *(char**)((char*)p + offset) : NULL;
+	if(!value){
+		info.GetReturnValue().SetNull();
+		return;
+	}
+	info.GetReturnValue().Set(String::NewFromUtf8(info.GetIsolate(), value).ToLocalChecked());
+}
+
+void MesiboJsMessage::StringSetter(Local<Name> property, Local<Value> value, 
+		const PropertyCallbackInfo<void>& info){
+	Isolate* isolate = info.GetIsolate();
+	mesibo_message_params_t* p = Unwrap(info.Holder());
+	if(!p) return;
+	size_t offset = info.Data().As<v8::Uint32>()->Value();
+	char** field = (char**)((char*)p + offset);
+	free(*field);
+	*field = MesiboJsUtil::JtoC_String(isolate, isolate->GetCurrentContext(), value);
+}
+
 //Usage Note: Property must be of type mesibo_uint_t
-mesibo_int_t EnableMessageProperty(const v8::FunctionCallbackInfo<v8::Value>& args, const char* property, mesibo_uint_t value){
+mesibo_int_t EnableMessageProperty(const v8::FunctionCallbackInfo<v8::Value>& args, js_key_t property, mesibo_uint_t value){
 
 	Isolate* isolate = args.GetIsolate();
 	HandleScope scope(isolate);
@@ -311,9 +464,6 @@ mesibo_int_t EnableMessageProperty(const v8::FunctionCallbackInfo<v8::Value>& ar
 
 	Local<Object> message_bundle = args.This();
 
-	if(!property)
-		return MESIBO_RESULT_FAIL;
-
 	if(!args[0]->IsBoolean()){
 		MesiboJsDebug::ReportExceptionInCallable(args, "Bad Parameters");
 		return MESIBO_RESULT_FAIL;
@@ -329,7 +479,7 @@ mesibo_int_t EnableMessageProperty(const v8::FunctionCallbackInfo<v8::Value>& ar
 }
 
 void EnableReadReceiptCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
-	mesibo_int_t rv = EnableMessageProperty(args, MESSAGE_FLAGS, MESIBO_FLAG_READRECEIPT);
+	mesibo_int_t rv = EnableMessageProperty(args, JS_KEY_MESSAGE_FLAGS, MESIBO_FLAG_READRECEIPT);
 	if(MESIBO_RESULT_FAIL == rv)
 		return;
 	Local<v8::Integer> ret = v8::Integer::New(args.GetIsolate(), rv);
@@ -338,7 +488,7 @@ void EnableReadReceiptCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
 
 
 void EnableDeliveryReceiptCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
-	mesibo_int_t rv = EnableMessageProperty(args, MESSAGE_FLAGS, MESIBO_FLAG_DELIVERYRECEIPT);
+	mesibo_int_t rv = EnableMessageProperty(args, JS_KEY_MESSAGE_FLAGS, MESIBO_FLAG_DELIVERYRECEIPT);
 	if(MESIBO_RESULT_FAIL == rv)
 		return;
 	Local<v8::Integer> ret = v8::Integer::New(args.GetIsolate(), rv);
@@ -346,7 +496,7 @@ void EnableDeliveryReceiptCallback(const v8::FunctionCallbackInfo<v8::Value>& ar
 }
 
 void EnablePresenceCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
-	mesibo_int_t rv = EnableMessageProperty(args, MESSAGE_FLAGS, MESIBO_FLAG_PRESENCE);
+	mesibo_int_t rv = EnableMessageProperty(args, JS_KEY_MESSAGE_FLAGS, MESIBO_FLAG_PRESENCE);
 	if(MESIBO_RESULT_FAIL == rv)
 		return;
 	Local<v8::Integer> ret = v8::Integer::New(args.GetIsolate(), rv);
@@ -354,7 +504,7 @@ void EnablePresenceCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
 }
 
 void SendIfOnlineCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
-	mesibo_int_t rv = EnableMessageProperty(args, MESSAGE_TO_ONLINE, 1);
+	mesibo_int_t rv = EnableMessageProperty(args, JS_KEY_MESSAGE_TO_ONLINE, 1);
 	if(MESIBO_RESULT_FAIL == rv)
 		return;
 	Local<v8::Integer> ret = v8::Integer::New(args.GetIsolate(), rv);
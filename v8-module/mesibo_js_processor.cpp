@@ -54,48 +54,143 @@
 #include <string>
 
 
-Global<ObjectTemplate> MesiboJsProcessor::message_template_;
-Global<ObjectTemplate>  MesiboJsProcessor::http_template_;
-Global<ObjectTemplate> MesiboJsProcessor::socket_template_;
-
-//Get the timestamp of the last made change in script
-long GetLastChanged(const char* script){
-	struct stat attr;
-	if(!stat(script, &attr) != 0){
-		return attr.st_mtime;
+/**
+ * Returns the context the script was loaded in. Changes to the script are
+ * loaded into a new processor by the module's watcher thread (see
+ * mesibo_v8_reload), so this never recompiles.
+ **/
+Local<Context> MesiboJsProcessor::GetContext() {
+
+	EscapableHandleScope handle_scope(GetIsolate());
+
+	return handle_scope.Escape(Local<Context>::New(GetIsolate(), context_));
+}
+
+#define JS_KEY_NAME(name) name,
+static const char* const js_key_names[JS_KEY_COUNT] = { JS_KEYS(JS_KEY_NAME) };
+
+void MesiboJsProcessor::InitKeys() {
+	HandleScope handle_scope(GetIsolate());
+	for(int i = 0; i < JS_KEY_COUNT; i++){
+		keys_[i].Set(GetIsolate(), String::NewFromUtf8(GetIsolate(), js_key_names[i], 
+					NewStringType::kInternalized).ToLocalChecked());
+	}
+}
+
+char* MesiboJsProcessor::AcquireScratch(size_t len) {
+	if(scratch_busy_)
+		return NULL;
+
+	if(len > scratch_size_){
+		size_t size = scratch_size_ ? scratch_size_ : 1024;
+		while(size < len) size *= 2;
+		char* scratch = (char*)realloc(scratch_, size);
+		if(!scratch)
+			return NULL;
+		scratch_ = scratch;
+		scratch_size_ = size;
 	}
-	return MESIBO_RESULT_FAIL;
+
+	scratch_busy_ = true;
+	return scratch_;
+}
+
+void MesiboJsProcessor::RunMicrotasks(){
+	if(depth_) return;
+
+	bool watched = Watch();
+	isolate_->RunMicrotasks();
+	if(watched)
+		Unwatch();
+	CheckTerminated();
 }
 
 /**
- * Recompile if the script is changed.
- * Returns newly allocated context object derived from base context
- * 
+ * The watchdog is a timer wheel of its own, on its own thread, so that it
+ * fires even while a script is stuck in a timer callback. A watched call takes
+ * a reference on the processor which is dropped by the watchdog timer, or by
+ * Unwatch if it cancels the timer, so the processor outlives a late watchdog.
  **/
-Local<Context> MesiboJsProcessor::GetContext() {
+bool MesiboJsProcessor::Watch(){
+	if(!watchdog_ || !timeout_ || (watch_seq_ & 1))
+		return false;
+
+	pthread_mutex_lock(&watch_lock_);
+	watch_seq_++;
+	watch_start_ = timer_wheel_usec();
+	pthread_mutex_unlock(&watch_lock_);
+
+	__sync_fetch_and_add(&refs_, 1);
+	timer_wheel_add(watchdog_, &watch_timer_, (uint64_t)timeout_ * 1000, OnWatchdog, this);
+	return true;
+}
 
-	EscapableHandleScope handle_scope(GetIsolate());
+void MesiboJsProcessor::Unwatch(){
+	pthread_mutex_lock(&watch_lock_);
+	watch_seq_++;
+	pthread_mutex_unlock(&watch_lock_);
 
-	long latestchange = GetLastChanged(script_);
-	if(MESIBO_RESULT_FAIL == latestchange)
-		MesiboJsDebug::Log("Error stating file %s \n", script_);
+	if(timer_wheel_del(watchdog_, &watch_timer_))
+		__sync_fetch_and_sub(&refs_, 1);
+}
 
-	//lastchanged will be zero if file is loaded for the first time 
-	bool isFileChange = (lastchanged_!= 0) && (lastchanged_ != latestchange); 
-	lastchanged_ = latestchange;
+void MesiboJsProcessor::OnWatchdog(void* data){
+	MesiboJsProcessor* mp = (MesiboJsProcessor*)data;
 
-	int init_status = 0; 
-	if(isFileChange){ 
-		MesiboJsDebug::Log("File has changed \n");
-		init_status = Initialize(); // Recompile & Reinitialize 
-		
+	pthread_mutex_lock(&mp->watch_lock_);
+	//Not for a call which has already returned, if this timer fired late
+	if((mp->watch_seq_ & 1) && 
+			timer_wheel_usec() + V8_TIMER_TICK_USEC >= mp->watch_start_ + (uint64_t)mp->timeout_ * 1000){
+		mp->terminated_ = "exceeded its time budget";
+		mp->isolate_->TerminateExecution();
 	}
+	pthread_mutex_unlock(&mp->watch_lock_);
 
+	__sync_fetch_and_sub(&mp->refs_, 1);
+}
 
-	if(MESIBO_RESULT_FAIL == init_status)
-		MesiboJsDebug::Log("Error initializing context\n");
+/**
+ * Called on the thread running the script when its heap is about to run out.
+ * The script is terminated, and the limit raised so that it can unwind; V8
+ * restores the initial limit once the heap shrinks. A script which keeps
+ * growing is given at most twice the initial limit, after which V8 aborts.
+ **/
+size_t MesiboJsProcessor::OnNearHeapLimit(void* data, size_t current_heap_limit, size_t initial_heap_limit){
+	MesiboJsProcessor* mp = (MesiboJsProcessor*)data;
 
-	return handle_scope.Escape(Local<Context>::New(GetIsolate(), context_));
+	pthread_mutex_lock(&mp->watch_lock_);
+	mp->terminated_ = "reached its heap limit";
+	mp->isolate_->TerminateExecution();
+	pthread_mutex_unlock(&mp->watch_lock_);
+
+	if(current_heap_limit >= 2 * initial_heap_limit)
+		return current_heap_limit;
+	return current_heap_limit + initial_heap_limit / 2;
+}
+
+bool MesiboJsProcessor::CheckTerminated(){
+	pthread_mutex_lock(&watch_lock_);
+	const char* reason = terminated_;
+	terminated_ = NULL;
+	pthread_mutex_unlock(&watch_lock_);
+
+	if(!reason)
+		return false;
+
+	//Also clears a termination which was requested but not reached
+	isolate_->CancelTerminateExecution();
+	mesibo_log(mod_, 0, "%s: script %s terminated, it %s\n", mod_->name, script_, reason);
+	return true;
+}
+
+void MesiboJsProcessor::Reset() {
+	js_mesibo_on_message.Reset();
+	js_mesibo_on_message_status.Reset();
+	js_mesibo_on_login.Reset();
+	message_template_.Reset();
+	http_template_.Reset();
+	socket_template_.Reset();
+	context_.Reset();
 }
 
 Local<Function> MesiboJsProcessor::GetGlobalFunction(const Local<Context>& context, const char* func_name){
@@ -118,10 +213,8 @@ Local<Function> MesiboJsProcessor::GetGlobalFunction(const Local<Context>& conte
 	//onlogin = function(){}; //optional
 	// 
 	//xxx: Validate global mesibo prototype and store it 
-	if (!context->Global()->Get(context, 
-				v8::String::NewFromUtf8(GetIsolate(), 
-					JS_MESIBO_GLOBAL_OBJECT)
-				.ToLocalChecked())
+	if (!context->Global()->Get(context, String::NewFromUtf8(GetIsolate(), JS_MESIBO_GLOBAL_OBJECT,
+					NewStringType::kInternalized).ToLocalChecked())
 			.ToLocal(&mesibo_global_ref) 
 			|| !mesibo_global_ref->IsObject()) { 
 		//Invalid Global Mesibo Object
@@ -132,9 +225,8 @@ Local<Function> MesiboJsProcessor::GetGlobalFunction(const Local<Context>& conte
 	//Absolutely sure this is a valid object 
 	Local<Object> mesibo_global_obj = Local<Object>::Cast(mesibo_global_ref);
 	Local<Value> mesibo_func_ref;
-	if (!mesibo_global_obj->Get(context,v8::String::NewFromUtf8(GetIsolate()
-					, func_name )
-				.ToLocalChecked())
+	if (!mesibo_global_obj->Get(context, String::NewFromUtf8(GetIsolate(), func_name,
+					NewStringType::kInternalized).ToLocalChecked())
 			.ToLocal(&mesibo_func_ref) 
 			|| !mesibo_func_ref->IsFunction()) { 
 		//xxx:Check if the function matches the defined signature
@@ -146,7 +238,81 @@ Local<Function> MesiboJsProcessor::GetGlobalFunction(const Local<Context>& conte
 	return handle_scope.Escape(mesibo_func);
 }	
 
-int MesiboJsProcessor::ExecuteScript(Local<String> script, Local<ObjectTemplate> global) {
+//FNV-1a, identifies the script content a code cache was created from
+static uint64_t HashSource(const char* data, size_t len){
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < len; i++){
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static string CodeCachePath(const char* script){
+	return string(script) + ".v8cache";
+}
+
+/**
+ * The cache file has the hash of the script it was created from, followed by
+ * the V8 cache data. It is ignored if the script has changed since. V8 checks
+ * its own version and flags, and rejects the data if they do not match.
+ **/
+v8::ScriptCompiler::CachedData* MesiboJsProcessor::ReadCodeCache(uint64_t hash){
+	string path = CodeCachePath(script_);
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == NULL) return NULL;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	uint64_t cached_hash = 0;
+	if(size <= (long)sizeof(cached_hash) || 1 != fread(&cached_hash, sizeof(cached_hash), 1, file)
+			|| cached_hash != hash){
+		fclose(file);
+		return NULL;
+	}
+
+	size -= sizeof(cached_hash);
+	uint8_t* data = new uint8_t[size];
+	if((size_t)size != fread(data, 1, size, file)){
+		fclose(file);
+		delete[] data;
+		return NULL;
+	}
+	fclose(file);
+
+	return new v8::ScriptCompiler::CachedData(data, (int)size, 
+			v8::ScriptCompiler::CachedData::BufferOwned);
+}
+
+//Written to a temporary file first, so that other isolates and processes never read a partial cache
+void MesiboJsProcessor::WriteCodeCache(Local<v8::UnboundScript> script, uint64_t hash){
+	v8::ScriptCompiler::CachedData* cache = v8::ScriptCompiler::CreateCodeCache(script);
+	if(!cache) return;
+
+	string path = CodeCachePath(script_);
+	string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+
+	FILE* file = fopen(tmp_path.c_str(), "wb");
+	if(file == NULL){
+		MesiboJsDebug::ErrorLog("Unable to write code cache %s \n", tmp_path.c_str());
+		delete cache;
+		return;
+	}
+
+	bool ok = (1 == fwrite(&hash, sizeof(hash), 1, file))
+		&& ((size_t)cache->length == fwrite(cache->data, 1, cache->length, file));
+	ok = (0 == fclose(file)) && ok;
+	delete cache;
+
+	if(!ok || 0 != rename(tmp_path.c_str(), path.c_str())){
+		MesiboJsDebug::ErrorLog("Unable to write code cache %s \n", path.c_str());
+		unlink(tmp_path.c_str());
+	}
+}
+
+int MesiboJsProcessor::ExecuteScript(Local<String> script, Local<ObjectTemplate> global, uint64_t hash) {
 
 	HandleScope handle_scope(GetIsolate());
 
@@ -165,9 +331,17 @@ int MesiboJsProcessor::ExecuteScript(Local<String> script, Local<ObjectTemplate>
 	// Enter the new context so all the following operations take place within it.
 	Context::Scope context_scope(context);
 
-	// Compile the script and check for errors.
+	// Compile the script and check for errors. Skip the compilation if
+	// there is code cached from an earlier load of the same script.
+	v8::ScriptCompiler::CachedData* cached_data = code_cache_ ? ReadCodeCache(hash) : NULL;
+	v8::ScriptOrigin origin(String::NewFromUtf8(GetIsolate(), script_, NewStringType::kNormal)
+			.ToLocalChecked());
+	v8::ScriptCompiler::Source source(script, origin, cached_data); //Owns cached_data
+	v8::ScriptCompiler::CompileOptions options = cached_data ? 
+		v8::ScriptCompiler::kConsumeCodeCache : v8::ScriptCompiler::kNoCompileOptions;
+
 	Local<Script> compiled_script;
-	if (!Script::Compile(context, script).ToLocal(&compiled_script)) {
+	if (!v8::ScriptCompiler::Compile(context, &source, options).ToLocal(&compiled_script)) {
 		MesiboJsDebug::ReportException(GetIsolate(), &try_catch);
 		// The script failed to compile; bail out.
 		return MESIBO_RESULT_FAIL;
@@ -175,12 +349,23 @@ int MesiboJsProcessor::ExecuteScript(Local<String> script, Local<ObjectTemplate>
 
 	// Run the script
 	Local<Value> result;
-	if (!compiled_script->Run(context).ToLocal(&result)) {
+	bool watched = Watch();
+	bool ran = compiled_script->Run(context).ToLocal(&result);
+	if(watched)
+		Unwatch();
+	if(CheckTerminated())
+		return MESIBO_RESULT_FAIL;
+	if (!ran) {
 		// The TryCatch above is still in effect and will have caught the error.
 		MesiboJsDebug::ReportException(GetIsolate(), &try_catch);
 		// Running the script failed; bail out.
 		return MESIBO_RESULT_FAIL;
 	}
+
+	// Create the cache after running the script, so that it also has the
+	// functions compiled while running it
+	if(code_cache_ && (!cached_data || source.GetCachedData()->rejected))
+		WriteCodeCache(compiled_script->GetUnboundScript(), hash);
 	
 	//Initialize global listeners
 	//mandatory to define on_message
@@ -226,6 +411,16 @@ void MesiboJsProcessor::SetCallables(Local<ObjectTemplate> & global){
 
 
 
+	//Timers, as in browsers
+	global->Set(GetIsolate(), JS_MESIBO_SET_TIMEOUT, 
+			FunctionTemplate::New(GetIsolate(), MesiboJsTimer::SetTimeoutCallback));
+	global->Set(GetIsolate(), JS_MESIBO_SET_INTERVAL, 
+			FunctionTemplate::New(GetIsolate(), MesiboJsTimer::SetIntervalCallback));
+	global->Set(GetIsolate(), JS_MESIBO_CLEAR_TIMEOUT, 
+			FunctionTemplate::New(GetIsolate(), MesiboJsTimer::ClearTimerCallback));
+	global->Set(GetIsolate(), JS_MESIBO_CLEAR_INTERVAL, 
+			FunctionTemplate::New(GetIsolate(), MesiboJsTimer::ClearTimerCallback));
+
 	global->Set(String::NewFromUtf8(GetIsolate(), JS_MESIBO_CLASS_SOCKET, NewStringType::kNormal)
 			.ToLocalChecked(),
 			FunctionTemplate::New(GetIsolate(),
@@ -243,6 +438,9 @@ int MesiboJsProcessor::Initialize(){
 	// Create a handle scope to hold the temporary references.
 	HandleScope handle_scope(GetIsolate());
 
+	//Before the templates, which use them
+	InitKeys();
+
 	// Create a template for the global object where we set the
 	// built-in global functions.
 	Local<ObjectTemplate> global = ObjectTemplate::New(GetIsolate());
@@ -261,6 +459,9 @@ int MesiboJsProcessor::Initialize(){
 			.ToLocalChecked(),
 			FunctionTemplate::New(GetIsolate(),
 				MesiboJsDebug::LogCallback, External::New(GetIsolate(), (void*)mod_)));
+	mesibo_global->Set(GetIsolate(), JS_MESIBO_FETCH,
+			FunctionTemplate::New(GetIsolate(),
+				MesiboJsHttp::FetchCallback, External::New(GetIsolate(), (void*)mod_)));
 
 	// Codes & flags 
 	mesibo_global->Set(GetIsolate(), JS_MESIBO_RESULT_OK, 
@@ -281,12 +482,14 @@ int MesiboJsProcessor::Initialize(){
 	}
 
 
-	Local<String> source = ReadFile(GetIsolate(), script_).ToLocalChecked();
-	if(source->IsNullOrUndefined()){
+	uint64_t hash = 0;
+	//The script may be replaced while it is read by a reload
+	Local<String> source;
+	if(!ReadFile(GetIsolate(), script_, &hash).ToLocal(&source)){
 		MesiboJsDebug::ErrorLog("Error reading file %s \n", script_);
 		return MESIBO_RESULT_FAIL;
 	}	
-	int rv = ExecuteScript(source, global);
+	int rv = ExecuteScript(source, global, hash);
 	if(MESIBO_RESULT_FAIL == rv){
 		MesiboJsDebug::ErrorLog("Error executing script %s\n", script_);
 		return MESIBO_RESULT_FAIL;
@@ -321,7 +524,22 @@ mesibo_int_t MesiboJsProcessor::ExecuteJsFunctionObj(Local<Context>& context,
 	v8::Local<v8::Value> js_result ;
 
 	v8::TryCatch try_catch(GetIsolate());
-	if(!js_fun->Call(context, context->Global(), argc, argv).ToLocal(&js_result)){
+	bool watched = Watch();
+	depth_++;
+	bool called = js_fun->Call(context, context->Global(), argc, argv).ToLocal(&js_result);
+	depth_--;
+
+	//Also after a failed call, the script may have resolved promises before throwing
+	if(!depth_)
+		isolate_->RunMicrotasks();
+
+	if(watched)
+		Unwatch();
+	//A call over its budget fails, the caller is not held up by the script
+	if(!depth_ && CheckTerminated())
+		return MESIBO_RESULT_FAIL;
+
+	if(!called){
 		MesiboJsDebug::ReportException(GetIsolate(), &try_catch);
 		String::Utf8Value fun_name(GetIsolate(), js_fun->GetName());
 		return MESIBO_RESULT_FAIL;
@@ -333,24 +551,32 @@ mesibo_int_t MesiboJsProcessor::ExecuteJsFunctionObj(Local<Context>& context,
 	return MesiboJsUtil::JtoC_Int(GetIsolate(), context, js_result);
 }
 // Reads a file into a v8 string.
-MaybeLocal<String> MesiboJsProcessor::ReadFile(Isolate* isolate, const string& name) {
+MaybeLocal<String> MesiboJsProcessor::ReadFile(Isolate* isolate, const string& name, uint64_t* hash) {
 	FILE* file = fopen(name.c_str(), "rb");
 	if (file == NULL) return MaybeLocal<String>(); //Error reading file. Return MESIBO_RESULT_FAIL	
 
 	fseek(file, 0, SEEK_END);
-	size_t size = ftell(file);
+	long end = ftell(file);
+	if (end < 0) {
+		fclose(file);
+		return MaybeLocal<String>();
+	}
+	size_t size = (size_t)end;
 	rewind(file);
 
-	std::unique_ptr<char> chars(new char[size + 1]);
+	std::unique_ptr<char[]> chars(new char[size + 1]);
 	chars.get()[size] = '\0';
 	for (size_t i = 0; i < size;) {
-		i += fread(&chars.get()[i], 1, size - i, file);
-		if (ferror(file)) {
+		size_t n = fread(&chars.get()[i], 1, size - i, file);
+		i += n;
+		if (ferror(file) || (!n && feof(file))) { //Truncated while reading
 			fclose(file);
 			return MaybeLocal<String>();
 		}
 	}
 	fclose(file);
+	if(hash)
+		*hash = HashSource(chars.get(), size);
 	MaybeLocal<String> result = String::NewFromUtf8(
 			isolate, chars.get(), NewStringType::kNormal, static_cast<int>(size));
 	return result;
@@ -377,6 +603,8 @@ mesibo_int_t MesiboJsProcessor::OnMessage(mesibo_message_params_t* p, const char
 	v8::Handle<v8::Value> args_bundle[argc];
 
 	v8::Local<v8::Object> message_instance = MesiboJsMessage::CtoJ_MessageParams(GetIsolate(), context, p); 
+	v8::Local<v8::ArrayBuffer> body = MesiboJsMessage::CtoJ_MessageBody(GetIsolate(), context, 
+			message_instance, message, len);
 	
 	Local<Function> js_fun = Local<Function>::New(GetIsolate(), js_mesibo_on_message); 
 	//Local<Function> js_fun = GetGlobalFunction(context, JS_MESIBO_LISTENER_ON_MESSAGE);
@@ -391,6 +619,10 @@ mesibo_int_t MesiboJsProcessor::OnMessage(mesibo_message_params_t* p, const char
 	mesibo_int_t rv = ExecuteJsFunctionObj(context, js_fun, argc, args_bundle);
 	mesibo_int_t t6 = mesibo_util_usec();
 
+	//The message buffer is only valid during the call
+	if(body->IsDetachable())
+		body->Detach();
+
 	mesibo_log(mod_, 0 , "\n ExecuteJsFunction " JS_MESIBO_LISTENER_ON_MESSAGE" %u usec\n\n",
 			(uint32_t)(t6-t5));
 
@@ -1,20 +1,6 @@
 #include "mesibo_js_processor.h"
 #include "v8_module.h"
 
-/**Socket Parameters**/
-#define SOCKET_URL 				"url"
-#define SOCKET_KEEPALIVE                        "keepalive"
-#define SOCKET_VERIFY_HOST                      "verifyHost"
-
-/**Socket Callback functions **/
-#define SOCKET_ON_CONNECT                       "onconnect"
-#define SOCKET_ON_DATA                          "ondata"
-
-/** Mesibo Socket Utils **/
-#define SOCKET_CONNECT 		  		"connect" 
-#define SOCKET_WRITE 		  		"write"
-#define SOCKET_CLOSE 		  		"close" 
-
 /** Socket Callbacks **/
 mesibo_int_t js_mesibo_socket_ondata(void *cbdata, const char *data, mesibo_int_t len){
 
@@ -23,10 +9,11 @@ mesibo_int_t js_mesibo_socket_ondata(void *cbdata, const char *data, mesibo_int_
 	mesibo_module_t* mod = b->mod;
 	if(!mod) return MESIBO_RESULT_FAIL;
 
-	MesiboJsProcessor* mp = ((v8_config_t*)mod->ctx)->ctx;
+	MesiboJsProcessor* mp = b->ctx_;
 	if(!mp) return MESIBO_RESULT_FAIL;
 
 	Isolate* isolate = mp->GetIsolate();
+	MesiboJsLock lock(mp);
 	v8::Locker locker(isolate);
 	v8::HandleScope handle_scope(isolate);
 	v8::Local<v8::Context> context = mp->GetContext();
@@ -63,10 +50,11 @@ void js_mesibo_socket_onconnect(void *cbdata, mesibo_int_t asock, mesibo_int_t f
 	mesibo_module_t* mod = b->mod;
 	if(!mod) return;
 
-	MesiboJsProcessor* mp = ((v8_config_t*)mod->ctx)->ctx;
+	MesiboJsProcessor* mp = b->ctx_;
 	if(!mp) return ;
 
 	Isolate* isolate = mp->GetIsolate();
+	MesiboJsLock lock(mp);
 	v8::Locker locker(isolate);
 	v8::HandleScope handle_scope(isolate);
 	v8::Local<v8::Context> context = mp->GetContext();
@@ -132,8 +120,8 @@ mesibo_socket_t* MesiboJsSocket::JtoC_SocketParams(Isolate* isolate, const Local
 	
 	mesibo_socket_t *s = (mesibo_socket_t*)malloc(sizeof(mesibo_socket_t));
 
-	s->keepalive = MesiboJsUtil::JtoC_ParamInt(isolate, context, SOCKET_KEEPALIVE, socket_params);
-	s->verify_host = MesiboJsUtil::JtoC_ParamInt(isolate, context, SOCKET_VERIFY_HOST, socket_params);
+	s->keepalive = MesiboJsUtil::JtoC_ParamInt(isolate, context, JS_KEY_SOCKET_KEEPALIVE, socket_params);
+	s->verify_host = MesiboJsUtil::JtoC_ParamInt(isolate, context, JS_KEY_SOCKET_VERIFY_HOST, socket_params);
 
 	Local<Value> ret_socket_cb;
 	ret_socket_cb = JtoJ_SocketCallback(isolate, context, socket_params, sc);
@@ -168,7 +156,7 @@ void MesiboJsSocket::SocketClassCallback(const v8::FunctionCallbackInfo<v8::Valu
 		return; //Internal Error
 	}
 	Local<ObjectTemplate> socket_obj 	=
-		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::socket_template_);
+		Local<ObjectTemplate>::New(isolate, MesiboJsProcessor::FromIsolate(isolate)->socket_template_);
 
 	// Return a new http object back to the javascript caller
 	v8::Local<v8::Object> socket_instance = socket_obj->NewInstance(context).ToLocalChecked();
@@ -191,7 +179,7 @@ void MesiboJsSocket::SocketConnectCallback(const v8::FunctionCallbackInfo<v8::Va
 	Local<Object> socket_bundle = args.This();
 
 	Local<Value> arg_cbdata = socket_bundle->Get(context,
-			String::NewFromUtf8(args.GetIsolate(), "cbdata").ToLocalChecked()).ToLocalChecked();
+			MesiboJsUtil::Key(isolate, JS_KEY_SOCKET_CBDATA)).ToLocalChecked();
 
 	Local<External> mod_cb = args.Data().As<External>();
 	mesibo_module_t* mod = static_cast<mesibo_module_t*>(mod_cb->Value()); 
@@ -200,6 +188,9 @@ void MesiboJsSocket::SocketConnectCallback(const v8::FunctionCallbackInfo<v8::Va
 	//Unwrap params	
 	socket_context_t* cbdata = (socket_context_t*)calloc(1, sizeof(socket_context_t));	
 	cbdata->js_cbdata.Reset(isolate, arg_cbdata);
+	cbdata->ctx_ = MesiboJsProcessor::FromIsolate(isolate); //Callbacks run in this isolate
+	__sync_fetch_and_add(&cbdata->ctx_->refs_, 1); //Sockets are never released, nor is their isolate
+	cbdata->mod = mod;
 
 	mesibo_socket_t* sock = JtoC_SocketParams(isolate, context, socket_bundle, cbdata);
 	if(!sock) return;
@@ -271,12 +262,12 @@ Local<Value> MesiboJsSocket::JtoJ_SocketCallback(Isolate* isolate, const Local<C
 		const Local<Object>& socket_params, socket_context_t* sc){
 
 	Local<Function> func_obj = MesiboJsUtil::JtoJ_ParamFunction(isolate, context, 
-			SOCKET_ON_CONNECT, socket_params); 
+			JS_KEY_SOCKET_ON_CONNECT, socket_params); 
 	if(func_obj->IsNullOrUndefined())
 		return Local<Value>::Cast(v8::Null(isolate)); //xxx: Return Exception 
 	sc->js_onconnect.Reset(isolate, func_obj); 
 
-	func_obj = MesiboJsUtil::JtoJ_ParamFunction(isolate, context, SOCKET_ON_DATA, socket_params); 
+	func_obj = MesiboJsUtil::JtoJ_ParamFunction(isolate, context, JS_KEY_SOCKET_ON_DATA, socket_params); 
 	if(func_obj->IsNullOrUndefined())
 		return Local<Value>::Cast(v8::Null(isolate)); //xxx: Return Exception 
 	sc->js_ondata.Reset(isolate, func_obj);
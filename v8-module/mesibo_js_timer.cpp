@@ -0,0 +1,146 @@
+#include "mesibo_js_processor.h"
+#include "v8_module.h"
+
+/**
+ * setTimeout and setInterval run on the timer wheel of the module, which is
+ * shared by all the isolates. A timer keeps a reference to its processor, and
+ * its callback runs in that isolate. If the isolate is busy when the timer
+ * fires, the timer is tried again on the next tick rather than blocking the
+ * wheel.
+ *
+ * Timers are owned by the js_timers_ map of the processor, which is only used
+ * with the processor lock held. A timer which is cleared while it is firing
+ * is freed by the firing callback, once it finds the timer gone from the map.
+ **/
+
+void MesiboJsTimer::Destroy(js_timer_t* t){
+	t->fn.Reset();
+	t->args.Reset();
+	__sync_fetch_and_sub(&t->ctx_->refs_, 1);
+	delete t;
+}
+
+void MesiboJsTimer::OnTimer(void* data){
+	js_timer_t* t = (js_timer_t*)data;
+	MesiboJsProcessor* mp = t->ctx_;
+
+	if(!mp->TryLock()){
+		timer_wheel_add(mp->timers_, &t->timer, V8_TIMER_TICK_USEC, OnTimer, t);
+		return;
+	}
+
+	std::map<uint32_t, js_timer_t*>::iterator it = mp->js_timers_.find(t->id);
+	if(it == mp->js_timers_.end() || it->second != t){
+		//Cleared while firing
+		{
+			v8::Locker locker(mp->GetIsolate());
+			Destroy(t);
+		}
+		mp->Unlock();
+		return;
+	}
+
+	//A timeout is done once it runs, and so is an interval of a script which was reloaded
+	bool repeat = t->interval && !mp->replaced_;
+	if(!repeat)
+		mp->js_timers_.erase(it);
+
+	Isolate* isolate = mp->GetIsolate();
+	{
+		v8::Locker locker(isolate);
+		v8::Isolate::Scope isolate_scope(isolate);
+		v8::HandleScope handle_scope(isolate);
+		v8::Local<v8::Context> context = mp->GetContext();
+
+		Local<Function> fn = t->fn.Get(isolate);
+		Local<v8::Array> fn_args = t->args.Get(isolate);
+
+		int argc = fn_args->Length();
+		Local<Value> argv[argc + 1];
+		for(int i = 0; i < argc; i++)
+			argv[i] = fn_args->Get(context, i).ToLocalChecked();
+
+		mp->ExecuteJsFunctionObj(context, fn, argc, argv);
+
+		//Unless the callback cleared it
+		if(repeat && mp->js_timers_.count(t->id))
+			timer_wheel_add(mp->timers_, &t->timer, t->interval, OnTimer, t);
+		else
+			Destroy(t);
+	}
+
+	mp->Unlock();
+}
+
+void MesiboJsTimer::SetTimer(const v8::FunctionCallbackInfo<v8::Value>& args, bool repeat){
+
+	Isolate* isolate = args.GetIsolate();
+	HandleScope scope(isolate);
+
+	v8::Local<v8::Context> context = isolate->GetCurrentContext();
+
+	if(args.Length() < 1 || !args[0]->IsFunction()){
+		MesiboJsDebug::ReportExceptionInCallable(args, "Bad Parameters");
+		return;
+	}
+
+	MesiboJsProcessor* mp = MesiboJsProcessor::FromIsolate(isolate);
+	if(!mp->timers_) return;
+
+	//As in browsers, the delay is in milliseconds and a missing or negative delay is 0
+	double delay = 0;
+	if(args.Length() > 1 && args[1]->IsNumber())
+		delay = args[1]->NumberValue(context).FromMaybe(0);
+	if(!(delay > 0))
+		delay = 0;
+
+	Local<v8::Array> fn_args = v8::Array::New(isolate, args.Length() > 2 ? args.Length() - 2 : 0);
+	for(int i = 2; i < args.Length(); i++)
+		fn_args->Set(context, i - 2, args[i]).Check();
+
+	js_timer_t* t = new js_timer_t;
+	memset(&t->timer, 0, sizeof(t->timer));
+	t->ctx_ = mp;
+	t->id = ++mp->next_timer_id_;
+	if(!t->id) t->id = ++mp->next_timer_id_; //0 is never a timer
+	t->interval = repeat ? (uint64_t)(delay * 1000) : 0;
+	if(repeat && t->interval < V8_TIMER_TICK_USEC)
+		t->interval = V8_TIMER_TICK_USEC;
+	t->fn.Reset(isolate, args[0].As<Function>());
+	t->args.Reset(isolate, fn_args);
+
+	__sync_fetch_and_add(&mp->refs_, 1); //Keep the isolate until the timer is done
+	mp->js_timers_[t->id] = t;
+	timer_wheel_add(mp->timers_, &t->timer, (uint64_t)(delay * 1000), OnTimer, t);
+
+	args.GetReturnValue().Set(t->id);
+}
+
+void MesiboJsTimer::SetTimeoutCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
+	SetTimer(args, false);
+}
+
+void MesiboJsTimer::SetIntervalCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
+	SetTimer(args, true);
+}
+
+void MesiboJsTimer::ClearTimerCallback(const v8::FunctionCallbackInfo<v8::Value>& args){
+
+	Isolate* isolate = args.GetIsolate();
+	if(args.Length() < 1 || !args[0]->IsUint32())
+		return;
+
+	MesiboJsProcessor* mp = MesiboJsProcessor::FromIsolate(isolate);
+	uint32_t id = args[0]->Uint32Value(isolate->GetCurrentContext()).FromMaybe(0);
+
+	std::map<uint32_t, js_timer_t*>::iterator it = mp->js_timers_.find(id);
+	if(it == mp->js_timers_.end())
+		return;
+
+	js_timer_t* t = it->second;
+	mp->js_timers_.erase(it);
+
+	//Otherwise it is firing, or running this very call, and is freed there
+	if(timer_wheel_del(mp->timers_, &t->timer))
+		Destroy(t);
+}
@@ -52,7 +52,7 @@ char* MesiboJsUtil::JtoC_ObjectToString(Isolate* isolate, const Local<Context>&
 }
 
 Local<Value> MesiboJsUtil::GetParamValue(Isolate* isolate, const Local<Context>& context, 
-		const char* param_name, const Local<Object>& params){
+		js_key_t param_name, const Local<Object>& params){
 
 	// Create a handle scope to keep the temporary object references.
 	EscapableHandleScope handle_scope(isolate);
@@ -60,14 +60,14 @@ Local<Value> MesiboJsUtil::GetParamValue(Isolate* isolate, const Local<Context>&
 	Local<Value> p_key;
 	Local<Value> p_value;
 
-	p_key = String::NewFromUtf8(isolate, param_name).ToLocalChecked();
+	p_key = Key(isolate, param_name);
 	p_value = params->Get(context, p_key).ToLocalChecked();
 
 	return  handle_scope.Escape(p_value);	
 }
 
 Local<Function> MesiboJsUtil::JtoJ_ParamFunction(Isolate* isolate, const Local<Context>& context,
-		const char* func_name, const Local<Object>& params){
+		js_key_t func_name, const Local<Object>& params){
 	// Create a handle scope to keep the temporary object references.
 	EscapableHandleScope handle_scope(isolate);
 
@@ -81,7 +81,7 @@ Local<Function> MesiboJsUtil::JtoJ_ParamFunction(Isolate* isolate, const Local<C
 }
 
 mesibo_int_t MesiboJsUtil::JtoC_ParamInt(Isolate* isolate, const Local<Context>& context,     
-		const char* param_name, const Local<Object>& params){
+		js_key_t param_name, const Local<Object>& params){
 
 	// Create a handle scope to keep the temporary object references.
 	HandleScope handle_scope(isolate);
@@ -93,7 +93,7 @@ mesibo_int_t MesiboJsUtil::JtoC_ParamInt(Isolate* isolate, const Local<Context>&
 	return int_val;
 }
 mesibo_uint_t MesiboJsUtil::JtoC_ParamUint(Isolate* isolate, const Local<Context>& context,     
-		const char* param_name, const Local<Object>& params){
+		js_key_t param_name, const Local<Object>& params){
 
 	// Create a handle scope to keep the temporary object references.
 	HandleScope handle_scope(isolate);
@@ -106,7 +106,7 @@ mesibo_uint_t MesiboJsUtil::JtoC_ParamUint(Isolate* isolate, const Local<Context
 }
 
 char* MesiboJsUtil::JtoC_ParamString(Isolate* isolate, const Local<Context>& context,     
-		const char* param_name, const Local<Object>& params){
+		js_key_t param_name, const Local<Object>& params){
 
 	// Create a handle scope to keep the temporary object references.
 	HandleScope handle_scope(isolate);
@@ -124,16 +124,15 @@ char* MesiboJsUtil::JtoC_ParamString(Isolate* isolate, const Local<Context>& con
 }
 
 int MesiboJsUtil::CtoJ_Uint(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
-		const char* key, mesibo_uint_t value){
+		js_key_t key, mesibo_uint_t value){
 
-	if(NULL == key) return MESIBO_RESULT_FAIL;
 	// Create a handle scope to keep the temporary object references.
 	HandleScope handle_scope(isolate);
 
 	Local<Value> p_key;
 	Local<Value> p_value;
 
-	p_key = String::NewFromUtf8(isolate, key).ToLocalChecked();
+	p_key = Key(isolate, key);
 	p_value = v8::Integer::NewFromUnsigned(isolate, (uint32_t)value); //Casting from uint32
 
 	if(js_params->Set(context, p_key, p_value).IsNothing()) //Unlikely exception
@@ -144,10 +143,22 @@ int MesiboJsUtil::CtoJ_Uint(Isolate* isolate, Local<Context>& context, Local<Obj
 }
 
 
-int MesiboJsUtil::CtoJ_String(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
-		const char* key, const char* value, mesibo_int_t len){
+int MesiboJsUtil::CtoJ_Value(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
+		js_key_t key, Local<Value> value){
+
+	// Create a handle scope to keep the temporary object references.
+	HandleScope handle_scope(isolate);
+
+	Local<Value> p_key = Key(isolate, key);
 
-	if(NULL == key ) return MESIBO_RESULT_FAIL;
+	if(js_params->Set(context, p_key, value).IsNothing()) //Unlikely exception
+		return MESIBO_RESULT_FAIL;
+
+	return MESIBO_RESULT_OK;
+}
+
+int MesiboJsUtil::CtoJ_String(Isolate* isolate, Local<Context>& context, Local<Object> &js_params, 
+		js_key_t key, const char* value, mesibo_int_t len){
 
 	// Create a handle scope to keep the temporary object references.
 	HandleScope handle_scope(isolate);
@@ -155,13 +166,14 @@ int MesiboJsUtil::CtoJ_String(Isolate* isolate, Local<Context>& context, Local<O
 	Local<Value> p_key;
 	Local<Value> p_value;
 
-	p_key = String::NewFromUtf8(isolate, key).ToLocalChecked();
+	p_key = Key(isolate, key);
 
-	if(NULL == value)
+	Local<String> p_string;
+	if(NULL == value || !String::NewFromUtf8(isolate, value, NewStringType::kNormal, 
+				len < 0 ? -1 : (int)len).ToLocal(&p_string))
 		p_value =  Local<Value>::Cast(v8::Null(isolate));	
 	else
-		//p_value = String::NewFromUtf8(isolate, value, NewStringType::kNormal, len).ToLocalChecked();
-		p_value = String::NewFromUtf8(isolate, value).ToLocalChecked();
+		p_value = p_string;
 
 
 	if(js_params->Set(context, p_key, p_value).IsNothing()) //Unlikely exception
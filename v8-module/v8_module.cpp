@@ -46,11 +46,24 @@
  */
 #include "mesibo_js_processor.h"
 #include <v8.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <libgen.h>
 #include "v8_module.h"
 
 #define MODULE_LOG_LEVEL_0VERRIDE 	 0
 #define MODULE_CONFIG_LOG 		"log"
 #define MODULE_CONFIG_SCRIPT 		"script"
+#define MODULE_CONFIG_ISOLATES 		"isolates"
+#define MODULE_CONFIG_CODE_CACHE 	"code_cache"
+#define MODULE_CONFIG_TIMEOUT 		"timeout"
+#define MODULE_CONFIG_MAX_HEAP 		"max_heap"
+
+#define V8_RELOAD_SETTLE_MS 		100 	//Wait for the script writes to settle before reloading
+#define V8_RETIRED_POLL_MS 		1000 	//Check the replaced processors while any are left
 
 //Single Global Platform Instance
 std::unique_ptr<v8::Platform> gMesiboV8Platform ; //v8 Global Platform Initialization
@@ -66,8 +79,13 @@ MesiboJsProcessor* mesibo_v8_init(mesibo_module_t* mod, v8_config_t* vc){
 
 	v8::Isolate::CreateParams createParams;
 	createParams.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+	if(vc->max_heap)
+		createParams.constraints.ConfigureDefaultsFromHeapSize(0, (size_t)vc->max_heap * 1024 * 1024);
 	v8::Isolate* isolate = v8::Isolate::New(createParams);
 
+	//Microtasks are run by the processor once each callback returns
+	isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+
 	mesibo_log(mod, vc->log,"Running V8 version %s\n", v8::V8::GetVersion());
 
 	const char* script_path = strdup(vc->script);
@@ -75,14 +93,266 @@ MesiboJsProcessor* mesibo_v8_init(mesibo_module_t* mod, v8_config_t* vc){
 
 	MesiboJsProcessor* mesibo_js = new MesiboJsProcessor(mod, script_path, log_level);
 	mesibo_js->SetIsolate(isolate);
+	mesibo_js->allocator_ = createParams.array_buffer_allocator;
+	mesibo_js->code_cache_ = vc->code_cache;
+	mesibo_js->timers_ = vc->timers;
+	mesibo_js->timeout_ = vc->timeout;
+	mesibo_js->watchdog_ = vc->watchdog;
+
+	//Terminate the script rather than the process when it runs out of heap
+	isolate->AddNearHeapLimitCallback(MesiboJsProcessor::OnNearHeapLimit, mesibo_js);
+	isolate->AutomaticallyRestoreInitialHeapLimit();
 	
-	if (MESIBO_RESULT_FAIL == mesibo_js->Initialize()){
+	int rv;
+	{
+		//The isolate is used with a Locker from other threads from here on
+		v8::Locker locker(isolate);
+		v8::Isolate::Scope isolate_scope(isolate);
+		rv = mesibo_js->Initialize();
+	}
+
+	if (MESIBO_RESULT_FAIL == rv){
 		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "Failed to intitialize MesiboJsProcessor\n");
+		mesibo_v8_destroy(mesibo_js);
 		return NULL;
 	}
 
 	return mesibo_js;
 }
+
+void mesibo_v8_destroy(MesiboJsProcessor* mesibo_js){
+	v8::Isolate* isolate = mesibo_js->GetIsolate();
+	{
+		v8::Locker locker(isolate);
+		v8::Isolate::Scope isolate_scope(isolate);
+		mesibo_js->Reset();
+	}
+	isolate->Dispose();
+
+	delete mesibo_js->allocator_;
+	free((void*)mesibo_js->script_);
+	delete mesibo_js;
+}
+
+//Takes a reference to the processor in a slot, so it is not disposed while in use.
+//The slot is read and the reference taken under the swap lock, so a processor
+//cannot be retired, and then disposed by the watcher, in between.
+static MesiboJsProcessor* mesibo_v8_ref(v8_config_t* vc, int i){
+	pthread_rwlock_rdlock(&vc->swap_lock);
+	MesiboJsProcessor* mesibo_js = __atomic_load_n(&vc->ctx[i], __ATOMIC_ACQUIRE);
+	__sync_fetch_and_add(&mesibo_js->refs_, 1);
+	pthread_rwlock_unlock(&vc->swap_lock);
+	return mesibo_js;
+}
+
+/**
+ * Picks an isolate for the calling thread. Each thread is assigned an isolate
+ * the first time it calls, and keeps using it while it is free, so its code
+ * and data stay warm in that core's cache. If another thread is running in it,
+ * the next free isolate is used, and only if all of them are busy does the
+ * thread wait for its own.
+ **/
+MesiboJsProcessor* mesibo_v8_acquire(v8_config_t* vc){
+	static __thread mesibo_int_t affinity = -1;
+	if(affinity < 0)
+		affinity = __sync_fetch_and_add(&vc->next_isolate, 1);
+
+	int first = affinity % vc->isolates;
+	for(int i = 0; i < vc->isolates; i++){
+		MesiboJsProcessor* mesibo_js = mesibo_v8_ref(vc, (first + i) % vc->isolates);
+		if(mesibo_js->TryLock())
+			return mesibo_js;
+		__sync_fetch_and_sub(&mesibo_js->refs_, 1);
+	}
+
+	//The processor may be replaced by a reload while waiting; it still runs the
+	//previous version of the script, which is as if the message came before the reload
+	MesiboJsProcessor* mesibo_js = mesibo_v8_ref(vc, first);
+	mesibo_js->Lock();
+	return mesibo_js;
+}
+
+void mesibo_v8_release(MesiboJsProcessor* mesibo_js){
+	mesibo_js->Unlock();
+	__sync_fetch_and_sub(&mesibo_js->refs_, 1);
+}
+
+/**
+ * Disposes the replaced processors which are no longer referenced. Called only
+ * from the watcher thread, which owns the list.
+ **/
+static void mesibo_v8_sweep(v8_config_t* vc){
+	MesiboJsProcessor** prev = &vc->retired;
+	while(*prev){
+		MesiboJsProcessor* mesibo_js = *prev;
+		if(0 == __sync_fetch_and_add(&mesibo_js->refs_, 0)){
+			*prev = mesibo_js->retired_;
+			mesibo_v8_destroy(mesibo_js);
+			continue;
+		}
+		prev = &mesibo_js->retired_;
+	}
+}
+
+/**
+ * Loads the script into a new set of isolates and swaps them in, one pointer
+ * per slot, so messages keep running in the current isolates meanwhile and
+ * never wait for the compilation. If the new script fails to load, the
+ * current isolates are kept.
+ *
+ * The replaced processors are disposed by the watcher thread, once no thread
+ * is using them and no HTTP or socket request will call back into them. Called
+ * only from the watcher thread.
+ **/
+int mesibo_v8_reload(mesibo_module_t* mod, v8_config_t* vc){
+	MesiboJsProcessor* pool[V8_MAX_ISOLATES];
+
+	for(int i = 0; i < vc->isolates; i++){
+		pool[i] = mesibo_v8_init(mod, vc);
+		if(!pool[i]){
+			mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "%s : Failed to reload %s, keeping the previous version\n", 
+					mod->name, vc->script);
+			for(int j = 0; j < i; j++)
+				mesibo_v8_destroy(pool[j]);
+			return MESIBO_RESULT_FAIL;
+		}
+	}
+
+	pthread_rwlock_wrlock(&vc->swap_lock);
+	for(int i = 0; i < vc->isolates; i++){
+		MesiboJsProcessor* mesibo_js = __atomic_exchange_n(&vc->ctx[i], pool[i], __ATOMIC_ACQ_REL);
+		mesibo_js->replaced_ = true;
+		mesibo_js->retired_ = vc->retired;
+		vc->retired = mesibo_js;
+	}
+	pthread_rwlock_unlock(&vc->swap_lock);
+
+	mesibo_log(mod, vc->log, "%s : Reloaded %s\n", mod->name, vc->script);
+	return MESIBO_RESULT_OK;
+}
+
+/**
+ * Watches the directory of the script, since editors and deployments often
+ * replace the file rather than write to it. A burst of events is coalesced
+ * into a single reload once no event arrives for V8_RELOAD_SETTLE_MS.
+ **/
+static void* mesibo_v8_watch(void* arg){
+	mesibo_module_t* mod = (mesibo_module_t*)arg;
+	v8_config_t* vc = (v8_config_t*)mod->ctx;
+
+	char* path = strdup(vc->script);
+	char* name = strdup(basename(path));
+	const char* dir = dirname(path);
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if(fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0){
+		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "%s : Unable to watch %s, changes will not be reloaded\n", 
+				mod->name, vc->script);
+		if(fd >= 0) close(fd);
+		free(name);
+		free(path);
+		vc->watch_stopped = 1;
+		return NULL;
+	}
+
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd[2] = {{fd, POLLIN, 0}, {vc->watch_fd, POLLIN, 0}};
+	bool changed = false;
+
+	while(1){
+		int wait = changed ? V8_RELOAD_SETTLE_MS : (vc->retired ? V8_RETIRED_POLL_MS : -1);
+		int n = poll(pfd, 2, wait);
+		if(n < 0){
+			if(EINTR == errno) continue;
+			break;
+		}
+
+		if(0 == n){
+			if(changed){
+				changed = false;
+				mesibo_v8_reload(mod, vc);
+			}
+			mesibo_v8_sweep(vc);
+			continue;
+		}
+
+		//Module cleanup
+		if(pfd[1].revents)
+			break;
+
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if(len <= 0) continue;
+
+		for(char* p = buf; p < buf + len; ){
+			struct inotify_event* event = (struct inotify_event*)p;
+			if(event->len && !strcmp(event->name, name))
+				changed = true;
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	close(fd);
+	free(name);
+	free(path);
+	vc->watch_stopped = 1;
+	return NULL;
+}
+
+/**
+ * Stops the watcher and the timer threads, and disposes the processors. A
+ * processor still referenced, by an HTTP or socket request or a pending timer,
+ * is left as it is, along with the configuration it uses.
+ **/
+static void mesibo_v8_shutdown(mesibo_module_t* mod, v8_config_t* vc){
+	if(vc->watch_fd >= 0){
+		uint64_t one = 1;
+		if(sizeof(one) == write(vc->watch_fd, &one, sizeof(one))){
+			while(!vc->watch_stopped)
+				usleep(V8_TIMER_TICK_USEC);
+		}
+		close(vc->watch_fd);
+		vc->watch_fd = -1;
+	}
+
+	if(vc->timers) timer_wheel_stop(vc->timers);
+	if(vc->watchdog) timer_wheel_stop(vc->watchdog);
+
+	for(int i = 0; i < vc->isolates; i++){
+		MesiboJsProcessor* mesibo_js = vc->ctx[i];
+		if(!mesibo_js) continue;
+		vc->ctx[i] = NULL;
+		mesibo_js->retired_ = vc->retired;
+		vc->retired = mesibo_js;
+	}
+	mesibo_v8_sweep(vc);
+
+	if(vc->retired){
+		mesibo_log(mod, MODULE_LOG_LEVEL_0VERRIDE, "%s : Isolates still in use are not disposed\n", mod->name);
+		return;
+	}
+
+	free(vc->timers);
+	free(vc->watchdog);
+	pthread_rwlock_destroy(&vc->swap_lock);
+	free(vc);
+}
+
+/*
+ * Function: v8_on_cleanup
+ * ---------------------------
+ * This function is called when the module is unloaded.
+ * Refer https://mesibo.com/documentation/on-premise/loadable-modules/#on_cleanup
+ *
+ */
+static mesibo_int_t v8_on_cleanup(mesibo_module_t* mod){
+	v8_config_t* vc = (v8_config_t*)mod->ctx;
+	if(!vc) return MESIBO_RESULT_OK;
+
+	mesibo_v8_shutdown(mod, vc);
+	mod->ctx = NULL;
+	return MESIBO_RESULT_OK;
+}
+
 /**
  * Helper function for getting v8 module configuration
  * Gets /path/to/script which contains Javascript code
@@ -92,10 +362,31 @@ v8_config_t* get_config_v8(mesibo_module_t* mod){
 	v8_config_t* vc = (v8_config_t*)calloc(1, sizeof(v8_config_t));
 	vc->script = mesibo_util_getconfig(mod, MODULE_CONFIG_SCRIPT);
 	vc->log = atoi(mesibo_util_getconfig(mod, MODULE_CONFIG_LOG));
-	vc->last_changed = 0; //Initialize TS to zero
-	vc->ctx = NULL;
-	mesibo_log(mod, vc->log, "V8 Module Configurations - %s: %s , %s:%d\n", MODULE_CONFIG_SCRIPT, vc->script, 
-			MODULE_CONFIG_LOG, vc->log);
+
+	//Optional, a single isolate by default
+	const char* isolates = mesibo_util_getconfig(mod, MODULE_CONFIG_ISOLATES);
+	vc->isolates = isolates ? atoi(isolates) : 1;
+	if(vc->isolates < 1)
+		vc->isolates = 1;
+	if(vc->isolates > V8_MAX_ISOLATES)
+		vc->isolates = V8_MAX_ISOLATES;
+
+	//Optional, enabled by default
+	const char* code_cache = mesibo_util_getconfig(mod, MODULE_CONFIG_CODE_CACHE);
+	vc->code_cache = code_cache ? atoi(code_cache) : 1;
+
+	//Optional, a script callback may run for a second by default
+	const char* timeout = mesibo_util_getconfig(mod, MODULE_CONFIG_TIMEOUT);
+	vc->timeout = timeout ? atoi(timeout) : 1000;
+
+	//Optional, the V8 default if not set
+	const char* max_heap = mesibo_util_getconfig(mod, MODULE_CONFIG_MAX_HEAP);
+	vc->max_heap = max_heap ? atoi(max_heap) : 0;
+
+	mesibo_log(mod, vc->log, "V8 Module Configurations - %s: %s , %s:%d , %s:%d , %s:%u , %s:%u\n", 
+			MODULE_CONFIG_SCRIPT, vc->script, MODULE_CONFIG_LOG, vc->log, 
+			MODULE_CONFIG_ISOLATES, vc->isolates, MODULE_CONFIG_TIMEOUT, (uint32_t)vc->timeout,
+			MODULE_CONFIG_MAX_HEAP, (uint32_t)vc->max_heap);
 
 	return vc;
 }
@@ -115,27 +406,48 @@ MESIBO_EXPORT int mesibo_module_v8_init(mesibo_int_t version, mesibo_module_t *m
 		return MESIBO_RESULT_FAIL;
 	}
 
-	MesiboJsProcessor* mesibo_js = mesibo_v8_init(m, vc);
+	pthread_rwlock_init(&vc->swap_lock, NULL);
+	vc->watch_fd = -1;
 
-	if(!mesibo_js){
-		mesibo_log(m, MODULE_LOG_LEVEL_0VERRIDE, "%s : Invalid Initialization\n", m->name);
-		return MESIBO_RESULT_FAIL;
+	vc->timers = (timer_wheel_t*)malloc(sizeof(timer_wheel_t));
+	timer_wheel_init(vc->timers, V8_TIMER_TICK_USEC);
+	vc->timers->running = 1;
+	mesibo_util_create_thread(timer_wheel_thread, vc->timers, 0, "v8_timer");
+
+	if(vc->timeout){
+		vc->watchdog = (timer_wheel_t*)malloc(sizeof(timer_wheel_t));
+		timer_wheel_init(vc->watchdog, V8_TIMER_TICK_USEC);
+		vc->watchdog->running = 1;
+		mesibo_util_create_thread(timer_wheel_thread, vc->watchdog, 0, "v8_watchdog");
 	}
-	vc->ctx = mesibo_js;
 
-	if (!vc->ctx) {
-		mesibo_log(m, MODULE_LOG_LEVEL_0VERRIDE, "Loading context failed for script %s", 
-				vc->script);
-		return MESIBO_RESULT_FAIL;
+	//Each isolate runs the script in its own context, so they can execute in parallel
+	for(int i = 0; i < vc->isolates; i++){
+		MesiboJsProcessor* mesibo_js = mesibo_v8_init(m, vc);
+
+		if(!mesibo_js){
+			mesibo_log(m, MODULE_LOG_LEVEL_0VERRIDE, "%s : Invalid Initialization\n", m->name);
+			mesibo_v8_shutdown(m, vc);
+			return MESIBO_RESULT_FAIL;
+		}
+		vc->ctx[i] = mesibo_js;
 	}
 
 	m->ctx = (void*)vc;
 
+	//Reload the script when it changes
+	vc->watch_fd = eventfd(0, EFD_CLOEXEC);
+	if(vc->watch_fd >= 0)
+		mesibo_util_create_thread(mesibo_v8_watch, m, 0, "v8_watch");
+	else
+		mesibo_log(m, MODULE_LOG_LEVEL_0VERRIDE, "%s : Unable to watch %s, changes will not be reloaded\n", 
+				m->name, vc->script);
 
 	m->flags = 0;
 	m->description = strdup("Sample V8 Module");
 	m->on_message= v8_on_message;
 	m->on_message_status = v8_on_message_status;
+	m->on_cleanup = v8_on_cleanup;
 
 	return MESIBO_RESULT_OK;
 }